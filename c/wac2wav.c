@@ -30,8 +30,9 @@
 //
 // wac2wavcmd.c VERSION 1.0
 //
-// This code will take an untriggered WAC file (version 4 or earlier) as
-// standard input and produce an uncompressed WAV file as standard output.
+// This code will take a WAC file (version 4 or earlier, triggered or not),
+// from a file or standard input, and produce an uncompressed WAV file, to a
+// file or standard output.
 //
 // This code serves as an example of how to decode the Wildlife Acoustics
 // proprietary audio compression format known as "WAC".
@@ -66,9 +67,9 @@
 //                             time between triggered recordings.  Software
 //                             capable of handling triggers can break a file
 //                             into pieces discarding these zero-value frames.
-//                             Note: This example code does not support
-//                             this, but look in the code for "ZERO FRAME"
-//                             to see where this would be used.
+//                             This is what wac_write_wav() does: look in
+//                             the code for "ZERO FRAME" and "Triggered
+//                             files" to see how.
 //                      0x20 = GPS data present - GPS data is interleaved with
 //                             data in block headers.
 //                      0x40 = TAG data present - TAG data is interleaved with
@@ -86,8 +87,9 @@
 //    you would double these values to convert to a byte offset into the file.
 //    The intention of the seek table is to make it easier to jump to a position
 //    in the WAC file without needing to decompress all the data before that
-//    position.  This code example does not use the seek table so we simply
-//    skip over it.
+//    position.  This code uses it to split the file between decoder threads
+//    and to decode sample ranges (wac_decode_range()) without decoding
+//    everything before them.
 //
 // 3. BLOCKS OF FRAMES OF SAMPLES
 //    Samples are grouped into frames (according to the frame size), and
@@ -123,9 +125,9 @@
 //    indicates that no tag is present.  While the tag button is pressed,
 //    blocks will be written with the corresponding tag.
 //
-//    Note that the GPS and TAG values are not implemented in this code and are
-//    simply skipped, but please see the comments in the code for more
-//    information.
+//    The GPS and TAG values are skipped while decoding.  wac_probe() (wac2wavcmd
+//    -p) reads them from the block headers without decoding the audio, see
+//    the comments in the code for more information.
 //
 //    Following the block header and optional GPS or tag data are block size
 //    frames of frame size samples for each channel.  For multi-channel
@@ -153,8 +155,25 @@
 //
 #include "wac2wav.h"
 
+typedef struct WacResampler_s WacResampler;
+typedef struct WacPipe_s WacPipe;
+typedef struct WacTracker_s WacTracker;
 
-typedef struct WacState_s
+// A slot of the wac_decode_range() cache: one seek table entry of samples in
+// the arena, on a list from most to least recently used
+typedef struct WacCacheSlot_s
+{
+        int entry;              // seek table entry held, or -1 if empty
+        int prev;               // more recently used slot (-1 at the head)
+        int next;               // less recently used slot (-1 at the tail)
+} WacCacheSlot;
+
+// Sample reconstruction kernel and Golomb code reader (see FrameDecode())
+typedef void (*WacReconstructFn)(const unsigned short *codes, int framesize, int channelcount,
+                                 int lossybits, short *out);
+typedef void (*WacFrameCodesFn)(struct WacState_s *WP, const int *g);
+
+struct WacState_s
 {
         int version;            // WAC file version number
         int flags;              // WAC flags
@@ -165,375 +184,5101 @@ typedef struct WacState_s
         int channelcount;       // number of channels
         int samplerate;         // sample rate
         unsigned long samplecount; // number of samples in file per channel
+        uint32_t *seektbl;      // seek table (offsets in 16-bit words)
+        int tblentries;         // entries in seektbl (more than seekentries
+                                // if it was rebuilt by ScanSeekTable())
+        int tblscanned;         // set once ScanSeekTable() has been tried
+        off_t datastart;        // byte offset of the first block
+
+        FILE          *filetbl[2];// input and output file descriptors
+        int frameindex;           // current frame index
+        int seekable;             // the input can be repositioned (not a pipe)
+        off_t readpos;            // bytes read from the input file so far
+
+        const unsigned char *memsrc; // source data when decoding from memory
+        size_t memlen;            // size of memsrc in bytes
+        unsigned char *inbuf;     // input buffer (WAC_INBUF_SIZE bytes, files only)
+        const unsigned char *in;  // bytes the bit reader reads from (inbuf or memsrc)
+        size_t inpos;             // offset of next unread byte in in
+        size_t inlen;             // number of valid bytes in in
+        uint64_t bitacc;          // bit accumulator, next bit in the msb
+        int bitcount;             // number of valid bits in bitacc
+        int eof;                  // set once the input has run out
+        int padbits;              // zero bits FillBits() added past the end
+
+        short *pcm;               // decoded samples for one block (interleaved)
+        unsigned short codes[256];// Golomb codes of one frame, one channel after another
+        WacReconstructFn reconstruct; // kernel turning codes into samples
+        WacFrameCodesFn framecodes;   // code reader for the frame layout
+        int simd;                 // WAC_SIMD_xxx option
+        unsigned char *memout;    // if set, store samples here instead of writing
+        unsigned char *outbuf;    // converted samples for one block (see ConvertOutput())
+        int format;               // WAV sample format (WAC_FORMAT_xxx)
+        int chanmode;             // WAV channels (WAC_CHANNELS_xxx)
+        int convert;              // set while writing WAV data that needs converting
+        int outrate;              // WAV sample rate
+        WacResampler *rs;         // decimating filter if outrate < samplerate
+        int zeroframe;            // set by FrameDecode() for zero frames
+        int skipzero;             // if set, FrameDecode() does not store zero frames
+        int block;                // block FrameDecode() is in
+        int tag;                  // tag of that block (0 if none)
+        int gpsvalid;             // set once a GPS fix has been read
+        WacGps gpsfix;            // last GPS fix read by FrameDecode()
+
+        int streaming;            // set while wac_read() owns the input position
+        unsigned long streampos;  // samples per channel returned by wac_read()
+        int pcmpos;               // next sample of the frame held in pcm
+        int pcmlen;               // number of samples of that frame
+        WacWriteFn writefn;       // if set, output goes here instead of filetbl[1]
+        int pipeline;             // read, decode and write in separate threads
+        int truncated;            // decode WAV output up to the end of the input
+        int recover;              // resynchronize at damaged blocks
+        int fill;                 // zero frames FrameDecode() owes for damage
+        WacPipe *pipe;            // the reader and writer threads while running
+        void *writectx;           // context passed to writefn
+        int engine;               // WAC_ENGINE_FAST or WAC_ENGINE_REFERENCE
+        int threads;              // number of decoder threads for conversions
+        int usemmap;              // memory-map WAV output files
+        int triggers;             // WAC_TRIGGER_SPLIT or WAC_TRIGGER_INDEX
+
+        WacSegment *segments;     // triggered segments found by the last conversion
+        int nsegments;            // number of entries in segments
+        int segalloc;             // allocated entries in segments
+        WacGap *gaps;             // damage skipped by the last decode in recover mode
+        int ngaps;                // number of entries in gaps
+        int gapalloc;             // allocated entries in gaps
+
+        size_t cachesize;         // bytes for the wac_decode_range() cache
+        short *cachearena;        // samples of all of the cache slots
+        WacCacheSlot *slots;      // the cache slots
+        int *slotof;              // slot holding each seek table entry, or -1
+        int nslots;               // number of slots
+        int cachehead;            // most recently used slot
+        int cachetail;            // least recently used slot
+        int cacheused;            // slots holding an entry
+        unsigned long cachehits;  // entries found in the cache
+        unsigned long cachemisses;// entries decoded into it
+
+        int metrics;              // count code sizes and quotients (WacOptions.metrics)
+        WacMetrics stats;         // counters of the last operation (see wac_metrics())
+        double opstart;           // when that operation started
+        double waited;            // time in it not spent decoding (I/O, workers)
+        size_t inmark;            // position in memsrc counted in stats.bytesin
+        WacTracker *tracker;      // progress callback, shared with the workers
+        unsigned long reported;   // frames passed on to the tracker
+        unsigned long long reportedin; // input bytes passed on to the tracker
+
+        WacGps *gps;              // GPS fixes found by wac_probe()
+        int ngps;                 // number of entries in gps
+        int gpsalloc;             // allocated entries in gps
+        WacTagRange *tags;        // tag ranges found by wac_probe()
+        int ntags;                // number of entries in tags
+        int tagalloc;             // allocated entries in tags
+        void *srcmap;             // memory mapping of the source file, if any
+        size_t srcmaplen;         // length of srcmap
+
+        char *srcfile;            // source file name (reopened by workers)
+        int error;                // last error code
+        char errmsg[256];         // description of the last error
+};
+
+typedef struct WacState_s WacState;
+
+// Size of the input buffer the bit reader refills from
+#define WAC_INBUF_SIZE (1 << 20)
+
+// Size of the WAV header written ahead of the samples, and of the RF64 ds64
+// chunk (or the JUNK chunk holding its place) some files add to it
+#define WAV_HEADER_SIZE 44
+#define WAV_DS64_SIZE 36
+
+// Sample count for a WAV header whose length is not known yet
+#define WAV_UNKNOWN_LENGTH ((uint64_t) -1)
+
+// Forward declarations
+static int SetError(WacState *WP, int error, const char *fmt, ...);
+static int DecodeTriggered(WacState *WP, const char *destfile);
+static int DecodeAll(WacState *WP, unsigned char *out);
+static void FillBits(WacState *WP);
+static inline int ReadBits(WacState *WP, int _bits);
+static inline unsigned short ReadWord(WacState *WP);
+static int SeekEntry(WacState *WP, int entry);
+int FrameDecode(WacState *WP, short *out);
+static int ReadBlockHeader(WacState *WP, int block);
+static int ScanSeekTable(WacState *WP);
+static size_t FindBlock(const unsigned char *buf, size_t len, size_t i, size_t limit,
+                        unsigned long minblock, unsigned long nblocks, unsigned long *block);
+static int GrowArray(WacState *WP, void **array, int *alloc, int count, size_t size);
+static WacReconstructFn SelectReconstruct(int engine, int simd, int channelcount);
+static WacFrameCodesFn SelectFrameCodes(int engine, int channelcount);
+
+// Macros for read/write
+#define READ(WP, buf, len) ReadInput(WP, buf, len)
+#define WRITE(WP, buf, len) WriteOutput(WP, buf, len)
+
+// Sources and sinks
+//
+// The input is either a file or a caller-supplied block of memory.  The bit
+// reader reads from the in[] window: for files that is inbuf, refilled by
+// fread(), and for memory it is the caller's data itself, so nothing is
+// copied.  The output is a file, or a caller-supplied write callback (which
+// is also how WAV files are written to memory), unless samples are being
+// decoded straight into a caller buffer (memout).
+//
+// A file name of "-" is standard input or output.  Pipes cannot seek, so
+// readpos keeps count of the input read and SeekInput() can still skip
+// forward over the seek table by reading; anything that needs to jump
+// around the file (threads, seek table lookups) is turned off for them.
+//
+static size_t PipeRead(WacPipe *PP, void *buf, size_t len);
+static int PipeReadError(WacPipe *PP);
+static size_t PipeWrite(WacPipe *PP, const void *buf, size_t len);
+
+// Monotonic wall clock time in seconds (for the stage times of WacMetrics)
+static double Now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t ReadInput(WacState *WP, void *buf, size_t len)
+{
+        if (WP->memsrc == NULL)
+        {
+                double t = Now();
+                size_t want = len;
+
+                len = WP->pipe != NULL ? PipeRead(WP->pipe, buf, len) : fread(buf, 1, len, WP->filetbl[0]);
+                if (len < want && WP->pipe != NULL && PipeReadError(WP->pipe))
+                {
+                        SetError(WP, WAC_ERR_IO, "%s: Read error", WP->srcfile);
+                }
+                WP->readpos += len;
+                WP->stats.bytesin += len;
+                t = Now() - t;
+                WP->stats.readseconds += t;
+                WP->waited += t;
+                return len;
+        }
+        if (len > WP->inlen - WP->inpos)
+        {
+                len = WP->inlen - WP->inpos;
+        }
+        memcpy(buf, WP->in + WP->inpos, len);
+        WP->inpos += len;
+        return len;
+}
+
+static size_t WriteOutput(WacState *WP, const void *buf, size_t len)
+{
+        double t = Now();
+
+        if (WP->pipe != NULL)
+        {
+                len = PipeWrite(WP->pipe, buf, len);
+        }
+        else if (WP->writefn != NULL)
+        {
+                len = WP->writefn(WP->writectx, buf, len) == 0 ? len : 0;
+        }
+        else
+        {
+                len = fwrite(buf, 1, len, WP->filetbl[1]);
+        }
+        WP->stats.bytesout += len;
+        t = Now() - t;
+        WP->stats.writeseconds += t;
+        WP->waited += t;
+        return len;
+}
+
+// Pipelined I/O
+//
+// With the pipeline option, a file to file conversion runs in three
+// threads: a reader thread fread()s the source in large chunks ahead of the
+// decoder, the decoder works as usual, and a writer thread fwrite()s the
+// finished WAV data, so that waiting for the disk (or the network) overlaps
+// with decoding.  ReadInput() and WriteOutput() turn into copies from and to
+// the chunks.  The threads are connected by bounded single-producer,
+// single-consumer rings of chunks: each side only moves its own index, with
+// acquire/release ordering, and takes the lock only to sleep when the ring
+// is full or empty.
+//
+#define WAC_PIPE_SLOTS 4          // chunks in each ring
+#define WAC_PIPE_CHUNK (1 << 20)  // bytes per chunk
+
+typedef struct WacRing_s
+{
+        unsigned char *buf[WAC_PIPE_SLOTS];
+        size_t len[WAC_PIPE_SLOTS];
+        unsigned head;          // chunks filled, moved by the producer only
+        unsigned tail;          // chunks emptied, moved by the consumer only
+        int done;               // the producer has finished
+        int sleepers;           // threads waiting on cond
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+} WacRing;
+
+struct WacPipe_s
+{
+        WacRing in;             // source data: reader thread -> decoder
+        WacRing out;            // WAV data: decoder -> writer thread
+        size_t inpos;           // bytes of the current in chunk already read
+        size_t outlen;          // bytes in the out chunk being filled
+        FILE *src;
+        FILE *dest;
+        int stop;               // tells the reader to stop early
+        int readerr;            // set if an fread() failed
+        int writeerr;           // set if an fwrite() failed
+        pthread_t reader;
+        pthread_t writer;
+};
+
+#define RING_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define RING_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// Wake the other side of a ring after moving an index or setting a flag
+static void RingWake(WacRing *RP)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&RP->sleepers, __ATOMIC_SEQ_CST) != 0)
+        {
+                pthread_mutex_lock(&RP->lock);
+                pthread_cond_broadcast(&RP->cond);
+                pthread_mutex_unlock(&RP->lock);
+        }
+}
+
+// Wait until the producer has a free chunk (producer) or there is a filled
+// chunk (consumer), or until *flag is set.  The sleeper count is raised
+// before checking again so that a wake-up cannot be missed.
+static void RingWait(WacRing *RP, int producer, const int *flag)
+{
+        pthread_mutex_lock(&RP->lock);
+        __atomic_add_fetch(&RP->sleepers, 1, __ATOMIC_SEQ_CST);
+        for (;;)
+        {
+                unsigned used = RING_LOAD(RP->head) - RING_LOAD(RP->tail);
+
+                if ((producer ? used < WAC_PIPE_SLOTS : used > 0) || __atomic_load_n(flag, __ATOMIC_SEQ_CST))
+                {
+                        break;
+                }
+                pthread_cond_wait(&RP->cond, &RP->lock);
+        }
+        __atomic_sub_fetch(&RP->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&RP->lock);
+}
+
+static int RingInit(WacRing *RP)
+{
+        int i;
+
+        memset(RP, 0, sizeof(*RP));
+        pthread_mutex_init(&RP->lock, NULL);
+        pthread_cond_init(&RP->cond, NULL);
+        for (i = 0; i < WAC_PIPE_SLOTS; i++)
+        {
+                if ((RP->buf[i] = malloc(WAC_PIPE_CHUNK)) == NULL)
+                {
+                        return WAC_ERR_NOMEM;
+                }
+        }
+        return WAC_OK;
+}
+
+static void RingFree(WacRing *RP)
+{
+        int i;
+
+        for (i = 0; i < WAC_PIPE_SLOTS; i++)
+        {
+                free(RP->buf[i]);
+        }
+        pthread_mutex_destroy(&RP->lock);
+        pthread_cond_destroy(&RP->cond);
+}
+
+// Reader thread: fill the in ring until the end of the source, or until a
+// read error, which ReadInput() reports once the ring runs dry
+static void *PipeReader(void *arg)
+{
+        WacPipe *PP = arg;
+        WacRing *RP = &PP->in;
+
+        for (;;)
+        {
+                unsigned head = RP->head;
+                size_t n;
+
+                if (head - RING_LOAD(RP->tail) == WAC_PIPE_SLOTS)
+                {
+                        RingWait(RP, 1, &PP->stop);
+                }
+                if (__atomic_load_n(&PP->stop, __ATOMIC_SEQ_CST))
+                {
+                        break;
+                }
+                n = fread(RP->buf[head % WAC_PIPE_SLOTS], 1, WAC_PIPE_CHUNK, PP->src);
+                if (n == 0)
+                {
+                        if (ferror(PP->src))
+                        {
+                                __atomic_store_n(&PP->readerr, 1, __ATOMIC_SEQ_CST);
+                        }
+                        break;
+                }
+                RP->len[head % WAC_PIPE_SLOTS] = n;
+                RING_STORE(RP->head, head + 1);
+                RingWake(RP);
+        }
+        __atomic_store_n(&RP->done, 1, __ATOMIC_SEQ_CST);
+        RingWake(RP);
+        return NULL;
+}
+
+// Writer thread: write out the chunks of the out ring until the decoder is
+// done.  After a write error the data is dropped so the decoder never waits.
+static void *PipeWriter(void *arg)
+{
+        WacPipe *PP = arg;
+        WacRing *RP = &PP->out;
+
+        for (;;)
+        {
+                unsigned tail = RP->tail;
+                size_t len;
+
+                if (RING_LOAD(RP->head) == tail)
+                {
+                        RingWait(RP, 0, &RP->done);
+                        if (RING_LOAD(RP->head) == tail)
+                        {
+                                break;
+                        }
+                }
+                len = RP->len[tail % WAC_PIPE_SLOTS];
+                if (!PP->writeerr && fwrite(RP->buf[tail % WAC_PIPE_SLOTS], 1, len, PP->dest) != len)
+                {
+                        __atomic_store_n(&PP->writeerr, 1, __ATOMIC_SEQ_CST);
+                }
+                RING_STORE(RP->tail, tail + 1);
+                RingWake(RP);
+        }
+        return NULL;
+}
+
+// ReadInput() for the decoder: copy from the chunks of the in ring
+static size_t PipeRead(WacPipe *PP, void *buf, size_t len)
+{
+        WacRing *RP = &PP->in;
+        unsigned char *p = buf;
+        size_t got = 0;
+
+        while (got < len)
+        {
+                unsigned tail = RP->tail;
+                size_t n;
+
+                if (RING_LOAD(RP->head) == tail)
+                {
+                        RingWait(RP, 0, &RP->done);
+                        if (RING_LOAD(RP->head) == tail)
+                        {
+                                break; // end of the source
+                        }
+                }
+                n = RP->len[tail % WAC_PIPE_SLOTS] - PP->inpos;
+                if (n > len - got)
+                {
+                        n = len - got;
+                }
+                memcpy(p + got, RP->buf[tail % WAC_PIPE_SLOTS] + PP->inpos, n);
+                got += n;
+                PP->inpos += n;
+                if (PP->inpos == RP->len[tail % WAC_PIPE_SLOTS])
+                {
+                        PP->inpos = 0;
+                        RING_STORE(RP->tail, tail + 1);
+                        RingWake(RP);
+                }
+        }
+        return got;
+}
+
+// Whether the reader thread stopped on a read error rather than at the end
+// of the source
+static int PipeReadError(WacPipe *PP)
+{
+        return __atomic_load_n(&PP->readerr, __ATOMIC_SEQ_CST);
+}
+
+// Hand the out chunk being filled to the writer thread
+static void PipeFlush(WacPipe *PP)
+{
+        WacRing *RP = &PP->out;
+
+        if (PP->outlen > 0)
+        {
+                RP->len[RP->head % WAC_PIPE_SLOTS] = PP->outlen;
+                RING_STORE(RP->head, RP->head + 1);
+                RingWake(RP);
+                PP->outlen = 0;
+        }
+}
+
+// WriteOutput() for the decoder: copy into the chunks of the out ring
+static size_t PipeWrite(WacPipe *PP, const void *buf, size_t len)
+{
+        WacRing *RP = &PP->out;
+        const unsigned char *p = buf;
+        size_t put = 0;
+
+        if (__atomic_load_n(&PP->writeerr, __ATOMIC_SEQ_CST))
+        {
+                return 0;
+        }
+        while (put < len)
+        {
+                size_t n = WAC_PIPE_CHUNK - PP->outlen;
+
+                if (PP->outlen == 0 && RP->head - RING_LOAD(RP->tail) == WAC_PIPE_SLOTS)
+                {
+                        // Woken by a write error the ring is still full
+                        RingWait(RP, 1, &PP->writeerr);
+                        if (__atomic_load_n(&PP->writeerr, __ATOMIC_SEQ_CST))
+                        {
+                                return 0;
+                        }
+                }
+                if (n > len - put)
+                {
+                        n = len - put;
+                }
+                memcpy(RP->buf[RP->head % WAC_PIPE_SLOTS] + PP->outlen, p + put, n);
+                PP->outlen += n;
+                put += n;
+                if (PP->outlen == WAC_PIPE_CHUNK)
+                {
+                        PipeFlush(PP);
+                }
+        }
+        return len;
+}
+
+// Start the reader and writer threads.  The source must be positioned where
+// decoding starts and the WAV header already written.
+static int StartPipe(WacState *WP)
+{
+        WacPipe *PP = calloc(1, sizeof(WacPipe));
+        int err;
+
+        if (PP == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        // Both rings are set up even if one fails, so both can be freed
+        err = RingInit(&PP->in);
+        if (RingInit(&PP->out) != WAC_OK)
+        {
+                err = WAC_ERR_NOMEM;
+        }
+        if (err != WAC_OK)
+        {
+                RingFree(&PP->in);
+                RingFree(&PP->out);
+                free(PP);
+                return SetError(WP, err, "Out of memory");
+        }
+        PP->src = WP->filetbl[0];
+        PP->dest = WP->filetbl[1];
+        if (pthread_create(&PP->reader, NULL, PipeReader, PP) != 0)
+        {
+                RingFree(&PP->in);
+                RingFree(&PP->out);
+                free(PP);
+                return WAC_OK; // no threads: just convert without the pipeline
+        }
+        if (pthread_create(&PP->writer, NULL, PipeWriter, PP) != 0)
+        {
+                __atomic_store_n(&PP->stop, 1, __ATOMIC_SEQ_CST);
+                RingWake(&PP->in);
+                pthread_join(PP->reader, NULL);
+                RingFree(&PP->in);
+                RingFree(&PP->out);
+                free(PP);
+                return WAC_OK;
+        }
+        WP->pipe = PP;
+        return WAC_OK;
+}
+
+// Write out what is left, stop the threads and report any read or write
+// error
+static int StopPipe(WacState *WP)
+{
+        WacPipe *PP = WP->pipe;
+        int err = WAC_OK;
+
+        PipeFlush(PP);
+        __atomic_store_n(&PP->out.done, 1, __ATOMIC_SEQ_CST);
+        RingWake(&PP->out);
+        __atomic_store_n(&PP->stop, 1, __ATOMIC_SEQ_CST);
+        RingWake(&PP->in);
+        pthread_join(PP->writer, NULL);
+        pthread_join(PP->reader, NULL);
+        if (PP->readerr)
+        {
+                err = SetError(WP, WAC_ERR_IO, "%s: Read error", WP->srcfile);
+        }
+        if (PP->writeerr)
+        {
+                err = SetError(WP, WAC_ERR_IO, "Write error");
+        }
+        RingFree(&PP->in);
+        RingFree(&PP->out);
+        free(PP);
+        WP->pipe = NULL;
+        return err;
+}
+
+// Bit scan helper for the fast quotient decoder: number of leading zero bits
+// in a non-zero 64-bit value
+#if defined(__GNUC__) || defined(__clang__)
+#define CLZ64(x) __builtin_clzll(x)
+#else
+static inline int CLZ64(uint64_t x)
+{
+        int n = 0;
+        while (!(x & 0x8000000000000000ULL))
+        {
+                x <<= 1;
+                n++;
+        }
+        return n;
+}
+#endif
+
+// Error handling
+//
+// Nothing in the library prints or exits.  Failures are recorded in the
+// decoder handle (code and a description that callers can fetch with
+// wac_errmsg()) and the error code is returned up the call chain.
+//
+static int SetError(WacState *WP, int error, const char *fmt, ...)
+{
+        va_list ap;
+
+        // Keep the first error: later ones are usually consequences of it
+        if (WP->error == WAC_OK)
+        {
+                WP->error = error;
+                va_start(ap, fmt);
+                vsnprintf(WP->errmsg, sizeof(WP->errmsg), fmt, ap);
+                va_end(ap);
+        }
+        return error;
+}
+
+const char *wac_strerror(int error)
+{
+        switch (error)
+        {
+        case WAC_OK:         return "Success";
+        case WAC_ERR_FORMAT: return "Unsupported or invalid WAC file";
+        case WAC_ERR_OPEN:   return "File not found";
+        case WAC_ERR_EOF:    return "Unexpected EOF";
+        case WAC_ERR_BLOCK:  return "Bad block header";
+        case WAC_ERR_NOMEM:  return "Out of memory";
+        case WAC_ERR_IO:     return "I/O error";
+        case WAC_ERR_ARG:    return "Invalid argument";
+        case WAC_ERR_CANCEL: return "Cancelled";
+        }
+        return "Unknown error";
+}
+
+const char *wac_errmsg(const WacDecoder *D)
+{
+        if (D == NULL)
+        {
+                return wac_strerror(WAC_ERR_NOMEM);
+        }
+        return D->error == WAC_OK ? wac_strerror(WAC_OK) : D->errmsg;
+}
+
+// Metrics
+//
+// Every whole-file operation (the WAV writers, wac_decode_all(), wac_verify()
+// and the spectrograms) starts the counters afresh with MetricsStart() and
+// finishes them with MetricsStop(), and wac_metrics() returns what they
+// counted.  Frames, blocks and bytes are counted as they go by, and the time
+// spent in ReadInput() and WriteOutput() is taken out of the decode time.
+// Parallel workers count for themselves and are added up when they finish.
+// The histograms of code sizes and quotient lengths cost a pass over every
+// frame's codes, so they are only kept with the metrics option.
+//
+// The progress callback is called from FrameDecode() at block headers, at
+// most every interval seconds, with the frames and input of the decoder and
+// all of its workers so far, and once more at the end of a successful
+// operation.  Workers share the tracker under its lock, so the callback may
+// be called from any of the decoder's threads but never from two at once.
+//
+struct WacTracker_s
+{
+        pthread_mutex_t lock;
+        WacProgressFn fn;       // the callback
+        void *ctx;              // context passed to fn
+        double interval;        // seconds between calls
+        double next;            // time the next call is due
+        double start;           // time the operation started
+        WacProgress now;        // totals over the decoder and its workers
+        int active;             // set during a whole-file operation
+        int cancel;             // set once fn has asked to stop
+};
+
+// Memory sources are read in place, so count the input that the bit reader
+// has moved past since the last count
+static void CountInput(WacState *WP)
+{
+        if (WP->memsrc != NULL)
+        {
+                WP->stats.bytesin += WP->inpos > WP->inmark ? WP->inpos - WP->inmark : 0;
+                WP->inmark = WP->inpos;
+        }
+}
+
+// Start the counters (and the progress reports) of a whole-file operation
+static void MetricsStart(WacState *WP)
+{
+        WacTracker *TP = WP->tracker;
+
+        memset(&WP->stats, 0, sizeof(WP->stats));
+        WP->opstart = Now();
+        WP->waited = 0;
+        WP->inmark = WP->inpos;
+        WP->reported = 0;
+        WP->reportedin = 0;
+        if (TP != NULL)
+        {
+                memset(&TP->now, 0, sizeof(TP->now));
+                TP->now.total = WP->samplecount;
+                TP->start = WP->opstart;
+                TP->next = WP->opstart + TP->interval;
+                TP->cancel = 0;
+                TP->active = 1;
+        }
+}
+
+// Pass the frames and input decoded since the last report to the tracker and
+// call the progress callback if it is due (or final is set).  Returns
+// WAC_ERR_CANCEL once the callback has asked to stop.
+static int Progress(WacState *WP, int final)
+{
+        WacTracker *TP = WP->tracker;
+        double now = Now();
+        int cancel;
+
+        CountInput(WP);
+        pthread_mutex_lock(&TP->lock);
+        TP->now.samples += (WP->stats.frames - WP->reported) * WP->framesize;
+        TP->now.bytesin += WP->stats.bytesin - WP->reportedin;
+        WP->reported = WP->stats.frames;
+        WP->reportedin = WP->stats.bytesin;
+        if (!TP->cancel && (final || now >= TP->next))
+        {
+                WacProgress P = TP->now;
+
+                // The last frame may be partial
+                if (P.total > 0 && P.samples > P.total)
+                {
+                        P.samples = P.total;
+                }
+                P.seconds = now - TP->start;
+                TP->cancel = TP->fn(TP->ctx, &P) != 0 && !final;
+                TP->next = now + TP->interval;
+        }
+        cancel = TP->cancel;
+        pthread_mutex_unlock(&TP->lock);
+        return cancel ? SetError(WP, WAC_ERR_CANCEL, "Cancelled") : WAC_OK;
+}
+
+// Add the counters of a parallel worker to those of its parent
+static void MetricsAdd(WacState *WP, const WacState *W)
+{
+        WacMetrics *M = &WP->stats;
+        const WacMetrics *A = &W->stats;
+        int i;
+
+        M->frames += A->frames;
+        M->zeroframes += A->zeroframes;
+        M->blocks += A->blocks;
+        M->bytesin += A->bytesin;
+        M->bytesout += A->bytesout;
+        M->readseconds += A->readseconds;
+        M->decodeseconds += A->decodeseconds;
+        M->writeseconds += A->writeseconds;
+        for (i = 0; i < 16; i++)
+        {
+                M->codesizes[0][i] += A->codesizes[0][i];
+                M->codesizes[1][i] += A->codesizes[1][i];
+        }
+        for (i = 0; i < WAC_METRICS_QUOTIENTS; i++)
+        {
+                M->quotients[i] += A->quotients[i];
+        }
+
+        // What the worker has reported is already in the tracker
+        WP->reported += W->reported;
+        WP->reportedin += W->reportedin;
+}
+
+// Finish the counters of a whole-file operation that returned err, and
+// return err
+static int MetricsStop(WacState *WP, int err)
+{
+        CountInput(WP);
+        WP->stats.seconds = Now() - WP->opstart;
+        WP->stats.decodeseconds += WP->stats.seconds - WP->waited;
+        if (WP->tracker != NULL)
+        {
+                if (err == WAC_OK)
+                {
+                        Progress(WP, 1);
+                }
+                WP->tracker->active = 0;
+        }
+        return err;
+}
+
+// Return the counters of the last whole-file operation
+void wac_metrics(const WacDecoder *D, WacMetrics *metrics)
+{
+        *metrics = D->stats;
+}
+
+// wac_set_progress
+//
+// Call fn with the progress of each whole-file operation, at most every
+// interval seconds (0 = every half second) and once at the end.  A NULL fn
+// turns the calls off.
+//
+int wac_set_progress(WacDecoder *D, WacProgressFn fn, void *ctx, double interval)
+{
+        if (fn == NULL)
+        {
+                if (D->tracker != NULL)
+                {
+                        pthread_mutex_destroy(&D->tracker->lock);
+                        free(D->tracker);
+                        D->tracker = NULL;
+                }
+                return WAC_OK;
+        }
+        if (D->tracker == NULL)
+        {
+                if ((D->tracker = calloc(1, sizeof(WacTracker))) == NULL)
+                {
+                        return SetError(D, WAC_ERR_NOMEM, "Out of memory");
+                }
+                pthread_mutex_init(&D->tracker->lock, NULL);
+        }
+        D->tracker->fn = fn;
+        D->tracker->ctx = ctx;
+        D->tracker->interval = interval > 0 ? interval : 0.5;
+        return WAC_OK;
+}
+
+// Number of blocks in the file
+static unsigned long BlockCount(const WacState *WP)
+{
+        unsigned long frames = (WP->samplecount + WP->framesize - 1) / WP->framesize;
+        return (frames + WP->blocksize - 1) / WP->blocksize;
+}
+
+// SeekTableUsable
+//
+// Check that the seek table has an entry for every seeksize blocks and that
+// the offsets are strictly increasing and point past the seek table itself.
+// Recorders that did not fill in the table leave zeros here.
+//
+static int SeekTableUsable(const WacState *WP)
+{
+        unsigned long needed;
+        uint32_t prev;
+        int i;
+
+        // A pipe can only be read in order, so its seek table is no use
+        if (!WP->seekable || WP->seeksize <= 0 || WP->tblentries <= 0)
+        {
+                return 0;
+        }
+        needed = (BlockCount(WP) + WP->seeksize - 1) / WP->seeksize;
+        if ((unsigned long) WP->tblentries < needed)
+        {
+                return 0;
+        }
+        prev = WP->datastart / 2 - 1;
+        for (i = 0; i < (int) needed; i++)
+        {
+                if (WP->seektbl[i] <= prev)
+                {
+                        return 0;
+                }
+                prev = WP->seektbl[i];
+        }
+        return 1;
+}
+
+// Position the input at byte offset pos, which holds the header of the block
+// containing frame frameindex, discarding anything buffered by the bit reader.
+// A pipe can only be skipped forward, which is enough to start decoding
+// after the header and seek table.
+static int SeekInput(WacState *WP, off_t pos, int frameindex)
+{
+        if (WP->memsrc != NULL)
+        {
+                CountInput(WP);
+                WP->in = WP->memsrc;
+                WP->inlen = WP->memlen;
+                WP->inpos = (size_t) pos < WP->memlen ? (size_t) pos : WP->memlen;
+                WP->inmark = WP->inpos;
+        }
+        else if (WP->seekable && fseeko(WP->filetbl[0], pos, SEEK_SET) != 0)
+        {
+                return SetError(WP, WAC_ERR_IO, "%s: Seek failed", WP->srcfile);
+        }
+        else
+        {
+                if (WP->seekable)
+                {
+                        WP->readpos = pos;
+                }
+                while (!WP->seekable && WP->readpos < pos)
+                {
+                        size_t n = pos - WP->readpos < WAC_INBUF_SIZE ? pos - WP->readpos : WAC_INBUF_SIZE;
+                        if (READ(WP, WP->inbuf, n) != n)
+                        {
+                                return SetError(WP, WAC_ERR_EOF, "%s: Unexpected EOF", WP->srcfile);
+                        }
+                }
+                if (!WP->seekable && WP->readpos != pos)
+                {
+                        return SetError(WP, WAC_ERR_IO, "%s: Cannot seek back in a pipe", WP->srcfile);
+                }
+                WP->in = WP->inbuf;
+                WP->inpos = WP->inlen = 0;
+        }
+        WP->bitacc = 0;
+        WP->bitcount = 0;
+        WP->eof = 0;
+        WP->padbits = 0;
+        WP->fill = 0;
+        WP->frameindex = frameindex;
+        WP->streaming = 0;
+        return WAC_OK;
+}
+
+// Position the input at the block that seek table entry starts
+static int SeekEntry(WacState *WP, int entry)
+{
+        return SeekInput(WP, 2 * (off_t) WP->seektbl[entry], entry * WP->seeksize * WP->blocksize);
+}
+
+// Output formats
+//
+// WAV output can be 32-bit float instead of 16-bit integers and can keep one
+// channel of a stereo file or mix the two down to one.  The conversion is
+// done a block at a time as the frames are decoded, while they are still in
+// the cache, rather than as a second pass over the output.  It only applies
+// to WAV output (the convert flag is set by the WAV writers): the sample
+// APIs (wac_decode_all() etc.) always return the recorded 16-bit samples.
+//
+
+// Number of channels and bytes per sample in the WAV output
+static int OutChannels(const WacState *WP)
+{
+        return WP->chanmode != WAC_CHANNELS_ALL ? 1 : WP->channelcount;
+}
+
+static int OutBytes(const WacState *WP)
+{
+        return WP->format == WAC_FORMAT_FLOAT ? 4 : 2;
+}
+
+// Number of WAV samples per channel for n recorded samples
+static unsigned long OutCount(const WacState *WP, unsigned long n);
+static size_t WavHeaderSize(const WacState *WP);
+static void ResetResampler(WacResampler *RP);
+
+// Select the output stage for a WAV writer (wav set) or a sample API
+static void OutputStage(WacState *WP, int wav)
+{
+        WP->convert = wav && (WP->format != WAC_FORMAT_PCM16 || WP->chanmode != WAC_CHANNELS_ALL || WP->rs != NULL);
+        if (WP->convert && WP->rs != NULL)
+        {
+                ResetResampler(WP->rs);
+        }
+}
+
+// Whether a full decode can be split between threads.  Resampled output
+// depends on the samples before each point, so it is decoded in one pass.
+// If the seek table is missing or zeroed, we try to rebuild it.
+static int UseThreads(WacState *WP)
+{
+        return WP->threads > 1 && !(WP->convert && WP->rs != NULL) &&
+                (SeekTableUsable(WP) || ScanSeekTable(WP));
+}
+
+// Convert n samples per channel at in to the WAV output format at out
+static void ConvertOutput(const WacState *WP, const short *in, unsigned long n, unsigned char *out)
+{
+        // Samples are already shifted up by the lossy bits, so full scale for
+        // float output is always 32768
+        const float scale = 1.0f / 32768;
+        int ch = WP->channelcount;
+        int c = WP->chanmode == WAC_CHANNELS_RIGHT ? 1 : 0;
+        short *s = (short *) out;
+        float *f = (float *) out;
+        unsigned long i;
+
+        if (WP->chanmode == WAC_CHANNELS_ALL)
+        {
+                for (i = 0; i < n * ch; i++)
+                {
+                        f[i] = in[i] * scale;
+                }
+        }
+        else if (WP->chanmode == WAC_CHANNELS_MIX && ch == 2)
+        {
+                if (WP->format == WAC_FORMAT_FLOAT)
+                {
+                        for (i = 0; i < n; i++)
+                        {
+                                f[i] = (in[2 * i] + in[2 * i + 1]) * (0.5f * scale);
+                        }
+                }
+                else
+                {
+                        for (i = 0; i < n; i++)
+                        {
+                                s[i] = (short) ((in[2 * i] + in[2 * i + 1]) >> 1);
+                        }
+                }
+        }
+        else if (WP->format == WAC_FORMAT_FLOAT)
+        {
+                for (i = 0; i < n; i++)
+                {
+                        f[i] = in[i * ch + c] * scale;
+                }
+        }
+        else
+        {
+                for (i = 0; i < n; i++)
+                {
+                        s[i] = in[i * ch + c];
+                }
+        }
+}
+
+// Resampling
+//
+// If a lower output rate is asked for, the WAV output goes through a
+// polyphase decimating FIR filter.  The ratio of the rates is reduced to
+// up/down (e.g. 3/16 for 256 kHz to 48 kHz) and a Kaiser-windowed sinc
+// low-pass prototype of up * taps coefficients is split into up phases of
+// taps coefficients, so each output sample costs taps multiply-adds per
+// channel and the input is never upsampled.  The filter runs on the
+// selected channels in float as each block is decoded.  Its delay is
+// taken out so that output sample k is centred on input sample
+// k * down / up, and the end of the input is padded with silence to give
+// ceil(n * up / down) output samples for n input samples.
+//
+#define WAC_RS_ZEROS 16          // sinc zero crossings each side of the centre
+#define WAC_RS_CUTOFF 0.9        // passband edge as a fraction of output Nyquist
+#define WAC_RS_BETA 8.0          // Kaiser window shape (about 80 dB stopband)
+#define WAC_RS_MAXCOEF (1 << 22) // largest filter we are willing to build
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct WacResampler_s
+{
+        int up;                 // output rate / input rate = up / down
+        int down;
+        int taps;               // coefficients per phase
+        int channels;           // channels being filtered
+        int cap;                // input samples per channel per call
+        float *coef;            // up phases of taps coefficients, each reversed
+        float *hist;            // per channel: taps - 1 samples of history + cap
+        int have;               // valid samples per channel in hist
+        long long base;         // input sample number of hist[0]
+        long long next;         // newest input sample needed by the next output
+        int phase;              // filter phase of the next output
+        unsigned long long fed; // input samples per channel so far
+        unsigned long long made;// output samples per channel so far
+};
+
+// Modified Bessel function of the first kind, order 0 (for the window)
+static double BesselI0(double x)
+{
+        double sum = 1, term = 1;
+        int k;
+
+        for (k = 1; k < 50; k++)
+        {
+                term *= (x / (2 * k)) * (x / (2 * k));
+                sum += term;
+        }
+        return sum;
+}
+
+static void ResetResampler(WacResampler *RP)
+{
+        long long delay = ((long long) RP->up * RP->taps - 1) / 2;
+
+        memset(RP->hist, 0, (size_t) RP->channels * (RP->taps - 1 + RP->cap) * sizeof(float));
+        RP->have = RP->taps - 1;
+        RP->base = -(RP->taps - 1);
+        RP->next = delay / RP->up;
+        RP->phase = (int) (delay % RP->up);
+        RP->fed = 0;
+        RP->made = 0;
+}
+
+static void FreeResampler(WacResampler *RP)
+{
+        if (RP != NULL)
+        {
+                free(RP->coef);
+                free(RP->hist);
+                free(RP);
+        }
+}
+
+// Build the filter for converting rate in to rate out on channels channels,
+// taking up to cap input samples at a time
+static int NewResampler(WacState *WP, int in, int out, int channels, int cap)
+{
+        WacResampler *RP;
+        int a = in, b = out;
+        double fc;
+        int n, p, j;
+
+        while (b != 0)
+        {
+                int t = a % b;
+                a = b;
+                b = t;
+        }
+        if ((WP->rs = RP = calloc(1, sizeof(WacResampler))) == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        RP->up = out / a;
+        RP->down = in / a;
+        RP->channels = channels;
+        RP->cap = cap;
+
+        // Cutoff in cycles per sample at the upsampled rate in * up
+        fc = 0.5 * WAC_RS_CUTOFF / RP->down;
+        RP->taps = (int) ((WAC_RS_ZEROS / fc) / RP->up) + 1;
+        if ((double) RP->up * RP->taps > WAC_RS_MAXCOEF)
+        {
+                return SetError(WP, WAC_ERR_ARG, "%s: Cannot resample %d Hz to %d Hz", WP->srcfile, in, out);
+        }
+        n = RP->up * RP->taps;
+        RP->coef = malloc((size_t) n * sizeof(float));
+        RP->hist = malloc((size_t) channels * (RP->taps - 1 + cap) * sizeof(float));
+        if (RP->coef == NULL || RP->hist == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+
+        // Phase p holds prototype coefficients p, p + up, p + 2 up... in reverse
+        // order so each output is a dot product with consecutive input samples.
+        // Each phase is normalized to unity gain at DC.
+        for (p = 0; p < RP->up; p++)
+        {
+                float *c = RP->coef + (size_t) p * RP->taps;
+                double sum = 0;
+
+                for (j = 0; j < RP->taps; j++)
+                {
+                        int m = p + j * RP->up;
+                        double t = m - (n - 1) / 2.0;
+                        double w = 2.0 * t / (n - 1);
+                        double h = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+
+                        h *= BesselI0(WAC_RS_BETA * sqrt(w * w < 1 ? 1 - w * w : 0)) / BesselI0(WAC_RS_BETA);
+                        c[RP->taps - 1 - j] = (float) h;
+                        sum += h;
+                }
+                for (j = 0; j < RP->taps; j++)
+                {
+                        c[j] = (float) (c[j] / sum);
+                }
+        }
+        ResetResampler(RP);
+        return WAC_OK;
+}
+
+static unsigned long OutCount(const WacState *WP, unsigned long n)
+{
+        if (WP->rs == NULL)
+        {
+                return n;
+        }
+        return (unsigned long) (((unsigned long long) n * WP->rs->up + WP->rs->down - 1) / WP->rs->down);
+}
+
+// Feed n samples per channel at pcm (or silence if pcm is NULL) through the
+// filter and store the output samples at out in the WAV format, up to limit
+// samples per channel in total.  Returns the number of samples per channel
+// stored.
+static unsigned long Resample(WacState *WP, const short *pcm, unsigned long n,
+                              unsigned char *out, unsigned long long limit)
+{
+        WacResampler *RP = WP->rs;
+        int hs = RP->taps - 1 + RP->cap;
+        int ch = WP->channelcount;
+        int c = WP->chanmode == WAC_CHANNELS_RIGHT ? 1 : 0;
+        short *s = (short *) out;
+        float *f = (float *) out;
+        unsigned long made = 0;
+        unsigned long i;
+        int k;
+
+        // Append the input to the history, selecting or mixing the channels
+        for (k = 0; k < RP->channels; k++)
+        {
+                float *h = RP->hist + (size_t) k * hs + RP->have;
+
+                for (i = 0; i < n; i++)
+                {
+                        if (pcm == NULL)
+                        {
+                                h[i] = 0;
+                        }
+                        else if (WP->chanmode == WAC_CHANNELS_MIX && ch == 2)
+                        {
+                                h[i] = (pcm[2 * i] + pcm[2 * i + 1]) * (0.5f / 32768);
+                        }
+                        else
+                        {
+                                h[i] = pcm[i * ch + (RP->channels > 1 ? k : c)] * (1.0f / 32768);
+                        }
+                }
+        }
+        RP->have += (int) n;
+        RP->fed += n;
+
+        // Produce every output whose newest input sample we now have
+        while (RP->next < RP->base + RP->have && RP->made < limit)
+        {
+                const float *cp = RP->coef + (size_t) RP->phase * RP->taps;
+                long first = (long) (RP->next - RP->base) - (RP->taps - 1);
+
+                for (k = 0; k < RP->channels; k++)
+                {
+                        const float *x = RP->hist + (size_t) k * hs + first;
+                        float y = 0;
+                        int j;
+
+                        for (j = 0; j < RP->taps; j++)
+                        {
+                                y += cp[j] * x[j];
+                        }
+                        if (WP->format == WAC_FORMAT_FLOAT)
+                        {
+                                *f++ = y;
+                        }
+                        else
+                        {
+                                y *= 32768;
+                                *s++ = y >= 32767 ? 32767 : y <= -32768 ? -32768 : (short) lrintf(y);
+                        }
+                }
+                made++;
+                RP->made++;
+                RP->phase += RP->down;
+                RP->next += RP->phase / RP->up;
+                RP->phase %= RP->up;
+        }
+
+        // Keep the last taps - 1 samples as history for the next call
+        for (k = 0; k < RP->channels; k++)
+        {
+                float *h = RP->hist + (size_t) k * hs;
+                memmove(h, h + RP->have - (RP->taps - 1), (RP->taps - 1) * sizeof(float));
+        }
+        RP->base += RP->have - (RP->taps - 1);
+        RP->have = RP->taps - 1;
+        return made;
+}
+
+// Run n samples per channel at pcm through the output stage into out and
+// return the number of bytes stored
+static size_t OutputFrames(WacState *WP, const short *pcm, unsigned long n, unsigned char *out)
+{
+        if (WP->rs != NULL)
+        {
+                n = Resample(WP, pcm, n, out, ~0ULL);
+        }
+        else
+        {
+                ConvertOutput(WP, pcm, n, out);
+        }
+        return n * OutChannels(WP) * OutBytes(WP);
+}
+
+// Write n samples per channel from pcm to the output in the WAV format
+static int WriteSamples(WacState *WP, const short *pcm, unsigned long n)
+{
+        size_t len = n * OutChannels(WP) * OutBytes(WP);
+
+        if (WP->convert)
+        {
+                len = OutputFrames(WP, pcm, n, WP->outbuf);
+                pcm = (const short *) WP->outbuf;
+        }
+        if (WRITE(WP, pcm, len) != len)
+        {
+                return SetError(WP, WAC_ERR_IO, "Write error");
+        }
+        return WAC_OK;
+}
+
+// At the end of the input, run silence through the filter until all of the
+// output samples have been produced.  Output goes to memout if it is set.
+static int FlushResampler(WacState *WP)
+{
+        WacResampler *RP = WP->rs;
+        unsigned long long total;
+
+        if (!WP->convert || RP == NULL)
+        {
+                return WAC_OK;
+        }
+        total = (RP->fed * RP->up + RP->down - 1) / RP->down;
+        while (RP->made < total)
+        {
+                unsigned char *out = WP->memout != NULL ? WP->memout : WP->outbuf;
+                size_t len = Resample(WP, NULL, RP->cap, out, total) * OutChannels(WP) * OutBytes(WP);
+
+                if (WP->memout != NULL)
+                {
+                        WP->memout += len;
+                }
+                else if (WRITE(WP, out, len) != len)
+                {
+                        return SetError(WP, WAC_ERR_IO, "Write error");
+                }
+        }
+        RP->fed = 0;
+        RP->made = 0;
+        return WAC_OK;
+}
+
+// DecodeSamples
+//
+// Decode count samples per channel starting at the current input position
+// (which must be the start of block frameindex / blocksize) and write them
+// to the output a block at a time, or store them at memout if it is set.
+//
+static int DecodeSamples(WacState *WP, unsigned long count)
+{
+        int i;
+        int err;
+
+        // When decoding to memory, frames go straight to their final place.  Only
+        // a partial final frame has to go through the sample buffer.
+        if (WP->memout != NULL)
+        {
+                unsigned char *start = WP->memout;
+
+                while (count > 0)
+                {
+                        unsigned long step = count < (unsigned long) WP->framesize ?
+                                count : (unsigned long) WP->framesize;
+
+                        if (WP->convert)
+                        {
+                                if ((err = FrameDecode(WP, WP->pcm)) != WAC_OK)
+                                {
+                                        return err;
+                                }
+                                WP->memout += OutputFrames(WP, WP->pcm, step, WP->memout);
+                        }
+                        else if (step < (unsigned long) WP->framesize)
+                        {
+                                if ((err = FrameDecode(WP, WP->pcm)) != WAC_OK)
+                                {
+                                        return err;
+                                }
+                                memcpy(WP->memout, WP->pcm, step * WP->channelcount * sizeof(short));
+                        }
+                        else if ((err = FrameDecode(WP, (short *) WP->memout)) != WAC_OK)
+                        {
+                                return err;
+                        }
+                        if (!WP->convert)
+                        {
+                                WP->memout += step * WP->channelcount * sizeof(short);
+                        }
+                        count -= step;
+                }
+                err = FlushResampler(WP);
+                WP->stats.bytesout += WP->memout - start;
+                return err;
+        }
+
+        // Decode a block of frames at a time into the sample buffer and WRITE
+        // each block out in one go.  The final frame may be partial if the
+        // sample count is not a multiple of the frame size.
+        while (count > 0)
+        {
+                unsigned long n = 0; // samples per channel in buffer
+
+                for (i = 0; i < WP->blocksize && count > 0; i++)
+                {
+                        unsigned long step = count < (unsigned long) WP->framesize ?
+                                count : (unsigned long) WP->framesize;
+
+                        if ((err = FrameDecode(WP, WP->pcm + n * WP->channelcount)) != WAC_OK)
+                        {
+                                return err;
+                        }
+                        n += step;
+                        count -= step;
+                }
+                if ((err = WriteSamples(WP, WP->pcm, n)) != WAC_OK)
+                {
+                        return err;
+                }
+        }
+        return FlushResampler(WP);
+}
+
+// Parallel decoding
+//
+// The frames are independent of each other (the running sum is reset at the
+// start of every frame) and every seek table entry points at a block header,
+// so each run of seek table entries can be decoded on its own.  Each worker
+// opens its own handles on the source and destination files, seeks the
+// source to the first entry of its run and the destination to the WAV
+// offset of the first sample of that run, and decodes from there.  When
+// decoding to memory, the worker stores its samples at the matching offset
+// in the caller's buffer instead.
+//
+typedef struct WacWorker_s
+{
+        WacState W;             // private decoder state
+        const WacState *parent; // header information shared by all workers
+        const char *destfile;   // WAV file to write, or NULL to decode to memout
+        unsigned char *memout;  // start of the caller's sample buffer
+        off_t dataoffset;       // byte offset in destfile of the first sample
+        int firstentry;         // first seek table entry to decode
+        int entries;            // number of seek table entries to decode
+        int status;             // WAC_OK on success
+        pthread_t thread;
+} WacWorker;
+
+static void *DecodeWorker(void *arg)
+{
+        WacWorker *JP = arg;
+        WacState *WP = &JP->W;
+        const WacState *PP = JP->parent;
+        unsigned long spe = (unsigned long) PP->seeksize * PP->blocksize * PP->framesize;
+        unsigned long first = JP->firstentry * spe;
+        unsigned long last = (JP->firstentry + JP->entries) * spe;
+
+        // Share the header information and the seek table, but nothing else
+        *WP = *PP;
+        WP->filetbl[0] = WP->filetbl[1] = NULL;
+        WP->gaps = NULL;
+        WP->ngaps = WP->gapalloc = 0;
+        WP->error = WAC_OK;
+        memset(&WP->stats, 0, sizeof(WP->stats));
+        WP->opstart = Now();
+        WP->waited = 0;
+        WP->reported = 0;
+        WP->reportedin = 0;
+        WP->inbuf = WP->memsrc == NULL ? malloc(WAC_INBUF_SIZE) : NULL;
+        WP->pcm = malloc((size_t) WP->blocksize * WP->framesize * WP->channelcount * sizeof(short));
+        WP->outbuf = NULL;
+        if (WP->convert && (WP->outbuf = malloc((size_t) WP->blocksize * WP->framesize * WP->channelcount * sizeof(float))) == NULL)
+        {
+                free(WP->pcm);
+                WP->pcm = NULL;
+        }
+        if (last > PP->samplecount)
+        {
+                last = PP->samplecount;
+        }
+
+        if ((WP->inbuf == NULL && WP->memsrc == NULL) || WP->pcm == NULL)
+        {
+                JP->status = SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        else if (WP->memsrc == NULL && (WP->filetbl[0] = fopen(WP->srcfile, "rb")) == NULL)
+        {
+                JP->status = SetError(WP, WAC_ERR_OPEN, "%s: File not found", WP->srcfile);
+        }
+        else if (JP->destfile == NULL)
+        {
+                WP->memout = JP->memout + first * OutChannels(WP) * OutBytes(WP);
+                if ((JP->status = SeekEntry(WP, JP->firstentry)) == WAC_OK)
+                {
+                        JP->status = DecodeSamples(WP, last - first);
+                }
+        }
+        else if ((WP->filetbl[1] = fopen(JP->destfile, "r+b")) == NULL)
+        {
+                JP->status = SetError(WP, WAC_ERR_OPEN, "%s: Cannot open file", JP->destfile);
+        }
+        else if ((JP->status = SeekEntry(WP, JP->firstentry)) == WAC_OK)
+        {
+                if (fseeko(WP->filetbl[1], JP->dataoffset + (off_t) first * OutChannels(WP) * OutBytes(WP), SEEK_SET) != 0)
+                {
+                        JP->status = SetError(WP, WAC_ERR_IO, "%s: Seek failed", JP->destfile);
+                }
+                else
+                {
+                        JP->status = DecodeSamples(WP, last - first);
+                }
+        }
+
+        // The run must end at the block header the next run starts from, as
+        // the serial decoder would check, so that damage in the last block of
+        // a run is not missed (in recover mode the next run deals with it)
+        if (JP->status == WAC_OK && last < PP->samplecount && !WP->recover)
+        {
+                JP->status = ReadBlockHeader(WP, WP->frameindex / WP->blocksize);
+        }
+
+        if (WP->filetbl[0] != NULL)
+        {
+                fclose(WP->filetbl[0]);
+        }
+        if (WP->filetbl[1] != NULL && fclose(WP->filetbl[1]) != 0 && JP->status == WAC_OK)
+        {
+                JP->status = SetError(WP, WAC_ERR_IO, "Write error");
+        }
+        CountInput(WP);
+        WP->stats.decodeseconds = Now() - WP->opstart - WP->waited;
+        free(WP->inbuf);
+        free(WP->pcm);
+        free(WP->outbuf);
+        return NULL;
+}
+
+// Decode the whole file with up to nthreads workers, each taking an equal
+// share of the seek table entries.  The WAV header must already have been
+// written to destfile.  If destfile is NULL, the samples are stored in memout
+// instead.
+static int DecodeParallel(WacState *WP, const char *destfile, unsigned char *memout, int nthreads)
+{
+        int entries = (BlockCount(WP) + WP->seeksize - 1) / WP->seeksize;
+        double start = Now();
+        WacWorker *workers;
+        int status = WAC_OK;
+        int i;
+
+        if (nthreads > entries)
+        {
+                nthreads = entries;
+        }
+        workers = calloc(nthreads, sizeof(WacWorker));
+        if (workers == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+                workers[i].parent = WP;
+                workers[i].destfile = destfile;
+                workers[i].memout = memout;
+                workers[i].dataoffset = WavHeaderSize(WP);
+                workers[i].firstentry = (int) ((long long) entries * i / nthreads);
+                workers[i].entries = (int) ((long long) entries * (i + 1) / nthreads) - workers[i].firstentry;
+                if (pthread_create(&workers[i].thread, NULL, DecodeWorker, &workers[i]) != 0)
+                {
+                        // Could not start a thread: decode this share here
+                        DecodeWorker(&workers[i]);
+                        workers[i].thread = pthread_self();
+                }
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+                WacState *W = &workers[i].W;
+                unsigned long end = (unsigned long) (workers[i].firstentry + workers[i].entries) *
+                        WP->seeksize * WP->blocksize * WP->framesize;
+                int k;
+
+                if (!pthread_equal(workers[i].thread, pthread_self()))
+                {
+                        pthread_join(workers[i].thread, NULL);
+                }
+                MetricsAdd(WP, W);
+                if (workers[i].status != WAC_OK && status == WAC_OK)
+                {
+                        status = SetError(WP, workers[i].status, "%s", W->errmsg);
+                }
+
+                // Collect the gaps in file order, up to the end of each run (the
+                // next run has its own view of what follows)
+                for (k = 0; k < W->ngaps && status == WAC_OK; k++)
+                {
+                        if (GrowArray(WP, (void **) &WP->gaps, &WP->gapalloc, WP->ngaps, sizeof(WacGap)) != WAC_OK)
+                        {
+                                status = WP->error;
+                                break;
+                        }
+                        WP->gaps[WP->ngaps] = W->gaps[k];
+                        if (W->gaps[k].sample + W->gaps[k].length > end)
+                        {
+                                WP->gaps[WP->ngaps].length = end - W->gaps[k].sample;
+                        }
+                        WP->ngaps++;
+                }
+                free(W->gaps);
+        }
+        free(workers);
+
+        // The workers' time is in their own counters
+        WP->waited += Now() - start;
+        return status;
+}
+
+// Seek table rebuilding
+//
+// A recorder that lost power before closing a file leaves its seek table
+// zeroed, and some files have none, which would leave them to one thread.
+// The block headers are easy to find again (the pattern cannot occur in the
+// bitstream), so the data is split into equal byte ranges and a thread scans
+// each one with the probe's FindBlock() for the headers that start seek
+// table entries.  That runs at the speed of memchr() and the disk, and the
+// file is then decoded in parallel as usual.  If some entry cannot be found
+// (its header is damaged) the table stays unusable.
+//
+typedef struct WacScanner_s
+{
+        WacState *WP;
+        off_t start;            // byte range to scan for headers (even offsets)
+        off_t end;
+        pthread_t thread;
+} WacScanner;
+
+static void *ScanWorker(void *arg)
+{
+        WacScanner *SP = arg;
+        WacState *WP = SP->WP;
+        unsigned long nblocks = BlockCount(WP);
+        unsigned long block = 0;
+        const unsigned char *buf = NULL;
+        unsigned char *inbuf = NULL;
+        FILE *fp = NULL;
+        off_t pos = SP->start;
+
+        if (WP->memsrc == NULL &&
+            ((inbuf = malloc(WAC_INBUF_SIZE)) == NULL || (fp = fopen(WP->srcfile, "rb")) == NULL ||
+             fseeko(fp, pos, SEEK_SET) != 0))
+        {
+                pos = SP->end;
+        }
+        while (pos < SP->end && block < nblocks)
+        {
+                size_t len, limit, c, i = 0;
+
+                // Headers must start in the range but may end after it.  Files are
+                // read a buffer at a time; a header cut off by the end of a buffer
+                // is found at the start of the next one.
+                if (WP->memsrc != NULL)
+                {
+                        buf = WP->memsrc + pos;
+                        len = WP->memlen - pos;
+                        limit = (size_t) (SP->end - pos);
+                }
+                else
+                {
+                        len = SP->end - pos + 8 < WAC_INBUF_SIZE ? (size_t) (SP->end - pos + 8) : WAC_INBUF_SIZE;
+                        len = fread(inbuf, 1, len, fp);
+                        limit = len < (size_t) (SP->end - pos) ? len : (size_t) (SP->end - pos);
+                        if (len == WAC_INBUF_SIZE && limit > len - 8)
+                        {
+                                limit = len - 8;
+                        }
+                        buf = inbuf;
+                }
+                while ((c = FindBlock(buf, len, i, limit, block, nblocks, &block)) < limit)
+                {
+                        if (block % WP->seeksize == 0)
+                        {
+                                WP->seektbl[block / WP->seeksize] = (uint32_t) ((pos + c) / 2);
+                        }
+                        block++;
+                        i = c + 8;
+                }
+                if (limit == 0)
+                {
+                        break;
+                }
+                pos += limit;
+                if (fp != NULL && fseeko(fp, pos, SEEK_SET) != 0)
+                {
+                        break;
+                }
+        }
+        if (fp != NULL)
+        {
+                fclose(fp);
+        }
+        free(inbuf);
+        return NULL;
+}
+
+// Rebuild the seek table, once, with up to threads scanners.  Returns
+// whether the table is usable now.
+static int ScanSeekTable(WacState *WP)
+{
+        unsigned long needed;
+        off_t size, range;
+        WacScanner *scanners;
+        uint32_t *tbl;
+        struct stat st;
+        int n = WP->threads > 1 ? WP->threads : 1;
+        int i;
+
+        if (WP->tblscanned || !WP->seekable || WP->seeksize <= 0 || BlockCount(WP) == 0)
+        {
+                return 0;
+        }
+        WP->tblscanned = 1;
+        needed = (BlockCount(WP) + WP->seeksize - 1) / WP->seeksize;
+        if (WP->memsrc != NULL)
+        {
+                size = (off_t) WP->memlen;
+        }
+        else if (fstat(fileno(WP->filetbl[0]), &st) == 0)
+        {
+                size = st.st_size;
+        }
+        else
+        {
+                return 0;
+        }
+        if (size <= WP->datastart || (tbl = realloc(WP->seektbl, (needed + 1) * sizeof(uint32_t))) == NULL)
+        {
+                return 0;
+        }
+        WP->seektbl = tbl;
+        WP->tblentries = (int) needed;
+        memset(tbl, 0, needed * sizeof(uint32_t));
+        if ((scanners = calloc(n, sizeof(WacScanner))) == NULL)
+        {
+                WP->tblentries = 0;
+                return 0;
+        }
+        range = ((size - WP->datastart) / n + 1) & ~(off_t) 1;
+        for (i = 0; i < n; i++)
+        {
+                scanners[i].WP = WP;
+                scanners[i].start = WP->datastart + i * range;
+                scanners[i].end = i == n - 1 ? size : scanners[i].start + range;
+                if (scanners[i].start > size)
+                {
+                        scanners[i].start = size;
+                }
+                if (scanners[i].end > size)
+                {
+                        scanners[i].end = size;
+                }
+                if (pthread_create(&scanners[i].thread, NULL, ScanWorker, &scanners[i]) != 0)
+                {
+                        ScanWorker(&scanners[i]);
+                        scanners[i].thread = pthread_self();
+                }
+        }
+        for (i = 0; i < n; i++)
+        {
+                if (!pthread_equal(scanners[i].thread, pthread_self()))
+                {
+                        pthread_join(scanners[i].thread, NULL);
+                }
+        }
+        free(scanners);
+        if (!SeekTableUsable(WP))
+        {
+                WP->tblentries = 0;
+                return 0;
+        }
+        return 1;
+}
+
+// ReadHeader
+//
+// Parse and validate the WAC header, read the seek table and allocate the
+// decode buffers.
+//
+static int ReadHeader(WacState *WP)
+{
+        int i;
+        size_t sz;
+        unsigned char hdr[24];
+
+        // Parse WAC header and validate supported formats
+        if ((sz = READ(WP, hdr, 24)) != 24)
+        {
+                return SetError(WP, WAC_ERR_EOF, "%s: Unexpected eof", WP->srcfile);
+        }
+
+        // Verify "magic" header
+        if (   hdr[0] != 'W'
+               || hdr[1] != 'A'
+               || hdr[2] != 'a'
+               || hdr[3] != 'c'
+               )
+        {
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Input not a WAC file", WP->srcfile);
+        }
+
+        // Check version
+        WP->version = hdr[4];
+        if (WP->version > 4)
+        {
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Input version %d not supported", WP->srcfile, WP->version);
+        }
+
+        // Read channel count and frame size
+        WP->channelcount = hdr[5];
+        WP->framesize = hdr[6] | (hdr[7] << 8);
+
+        // All Wildlife Acoustics WAC files have 512-byte (256-sample mono or
+        // 128 sample stereo) frames.
+        if (WP->channelcount * WP->framesize != 256)
+        {
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Unsupported block size %d", WP->srcfile, WP->channelcount*WP->framesize);
+        }
+
+        // All Wildlife Acoustics WAC files have 1 or 2 channels
+        if (WP->channelcount > 2)
+        {
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Unsupported channel count %d", WP->srcfile, WP->channelcount);
+        }
+
+        // Pick the decode kernels for this layout
+        WP->framecodes = SelectFrameCodes(WP->engine, WP->channelcount);
+        WP->reconstruct = SelectReconstruct(WP->engine, WP->simd, WP->channelcount);
+
+        // Read flags
+        WP->flags = hdr[10] | (hdr[11] << 8);
+
+        // If any special "zero frames" are present (triggered WAC mode), bit 0x10
+        // will be set.  For non-triggered recordings, this bit will be clear.  See
+        // FrameDecode() logic below about triggered WAC mode and DecodeTriggered()
+        // for how these files are converted.
+
+        // Parse additional fields from the WAC header
+        WP->blocksize = hdr[8] | (hdr[9] << 8);
+        WP->samplerate = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16) | (hdr[15] << 24);
+        WP->samplecount = hdr[16] | (hdr[17] << 8) | (hdr[18] << 16) | ((unsigned long) hdr[19] << 24);
+        WP->seeksize = hdr[20] | (hdr[21] << 8);
+        WP->seekentries = hdr[22] | (hdr[23] << 8);
+        WP->datastart = 24 + 4 * (off_t) WP->seekentries;
+        if (WP->blocksize == 0)
+        {
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Invalid block size", WP->srcfile);
+        }
+        if (WP->seeksize == 0 && (WP->flags & 0x20))
+        {
+                // GPS fixes are at every seek size blocks
+                return SetError(WP, WAC_ERR_FORMAT, "%s: Invalid seek size", WP->srcfile);
+        }
+
+        // Read the seek table (used to split the file up for parallel decoding
+        // and to jump to a position in the file)
+        WP->seektbl = malloc((WP->seekentries + 1) * sizeof(uint32_t));
+        if (WP->seektbl == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        for (i = 0; i < WP->seekentries; i++)
+        {
+                if ((sz = READ(WP, hdr, 4)) != 4)
+                {
+                        return SetError(WP, WAC_ERR_EOF, "%s: Unexpected EOF", WP->srcfile);
+                }
+                WP->seektbl[i] = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t) hdr[3] << 24);
+        }
+        WP->tblentries = WP->seekentries;
+
+        // Allocate the input buffer (not needed when decoding from memory) and
+        // the sample buffer for one block of frames
+        WP->inbuf = WP->memsrc == NULL ? malloc(WAC_INBUF_SIZE) : NULL;
+        WP->pcm = malloc((size_t) WP->blocksize * WP->framesize * WP->channelcount * sizeof(short));
+        if ((WP->inbuf == NULL && WP->memsrc == NULL) || WP->pcm == NULL)
+        {
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+
+        // Check the output format options and allocate the conversion buffer
+        if (WP->chanmode == WAC_CHANNELS_RIGHT && WP->channelcount < 2)
+        {
+                return SetError(WP, WAC_ERR_ARG, "%s: No second channel to select", WP->srcfile);
+        }
+        if (WP->outrate <= 0 || WP->outrate == WP->samplerate)
+        {
+                WP->outrate = WP->samplerate;
+        }
+        else if (WP->outrate > WP->samplerate)
+        {
+                return SetError(WP, WAC_ERR_ARG, "%s: Cannot resample %d Hz up to %d Hz", WP->srcfile, WP->samplerate, WP->outrate);
+        }
+        else if (NewResampler(WP, WP->samplerate, WP->outrate, OutChannels(WP), WP->blocksize * WP->framesize) != WAC_OK)
+        {
+                return WP->error;
+        }
+        if (WP->format != WAC_FORMAT_PCM16 || WP->chanmode != WAC_CHANNELS_ALL || WP->rs != NULL)
+        {
+                WP->outbuf = malloc((size_t) WP->blocksize * WP->framesize * WP->channelcount * sizeof(float));
+                if (WP->outbuf == NULL)
+                {
+                        return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+                }
+        }
+        return WAC_OK;
+}
+
+// wac_open
+//
+// Open srcfile and read its header.  On success *decoder is set to a new
+// decoder handle.  On failure the error code is returned and *decoder is
+// still set (unless we ran out of memory creating it) so that wac_errmsg()
+// can describe the problem; it must be released with wac_close() either way.
+//
+static WacState *NewDecoder(const char *name, const WacOptions *opts)
+{
+        WacState *WP = calloc(1, sizeof(WacState));
+
+        if (WP == NULL)
+        {
+                return NULL;
+        }
+        WP->engine = opts != NULL ? opts->engine : WAC_ENGINE_FAST;
+        WP->simd = opts != NULL ? opts->simd : WAC_SIMD_AUTO;
+        WP->threads = opts != NULL && opts->threads > 1 ? opts->threads : 1;
+        WP->usemmap = opts != NULL && opts->mmap;
+        WP->triggers = opts != NULL ? opts->triggers : WAC_TRIGGER_SPLIT;
+        WP->format = opts != NULL ? opts->format : WAC_FORMAT_PCM16;
+        WP->chanmode = opts != NULL ? opts->channels : WAC_CHANNELS_ALL;
+        WP->outrate = opts != NULL ? opts->rate : 0;
+        WP->pipeline = opts != NULL && opts->pipeline;
+        WP->truncated = opts != NULL && opts->truncated;
+        WP->recover = opts != NULL && opts->recover;
+        WP->cachesize = opts != NULL ? opts->cache : 0;
+        WP->metrics = opts != NULL && opts->metrics;
+        WP->srcfile = malloc(strlen(name) + 1);
+        if (WP->srcfile == NULL)
+        {
+                free(WP);
+                return NULL;
+        }
+        strcpy(WP->srcfile, name);
+        return WP;
+}
+
+int wac_open(WacDecoder **decoder, const char *srcfile, const WacOptions *opts)
+{
+        WacState *WP;
+
+        *decoder = WP = NewDecoder(strcmp(srcfile, "-") == 0 ? "<stdin>" : srcfile, opts);
+        if (WP == NULL)
+        {
+                return WAC_ERR_NOMEM;
+        }
+        WP->filetbl[0] = strcmp(srcfile, "-") == 0 ? stdin : fopen(srcfile, "rb");
+        if (WP->filetbl[0] == NULL)
+        {
+                return SetError(WP, WAC_ERR_OPEN, "%s: File not found", srcfile);
+        }
+
+        // Standard input cannot be reopened by worker threads even if it is
+        // redirected from a file, so treat it as a pipe
+        WP->seekable = WP->filetbl[0] != stdin && fseeko(WP->filetbl[0], 0, SEEK_CUR) == 0;
+
+#ifdef WAC_HAVE_MMAP
+        // In mmap mode, map the whole file and decode it as a memory source.  If
+        // the file cannot be mapped (e.g. it is empty or a pipe), just read it.
+        if (WP->usemmap && WP->seekable)
+        {
+                struct stat st;
+                int fd = fileno(WP->filetbl[0]);
+
+                if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+                {
+                        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (map != MAP_FAILED)
+                        {
+                                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                                WP->srcmap = map;
+                                WP->srcmaplen = st.st_size;
+                                WP->memsrc = map;
+                                WP->memlen = st.st_size;
+                                WP->in = WP->memsrc;
+                                WP->inlen = WP->memlen;
+                                WP->inpos = 0;
+                                fclose(WP->filetbl[0]);
+                                WP->filetbl[0] = NULL;
+                        }
+                }
+        }
+#endif
+        return ReadHeader(WP);
+}
+
+// wac_open_mem
+//
+// As wac_open(), but decode the WAC file held in memory at data (len bytes).
+// The data is read in place and must stay valid until wac_close().
+//
+int wac_open_mem(WacDecoder **decoder, const void *data, size_t len, const WacOptions *opts)
+{
+        WacState *WP;
+
+        *decoder = WP = NewDecoder("<memory>", opts);
+        if (WP == NULL)
+        {
+                return WAC_ERR_NOMEM;
+        }
+        WP->memsrc = data;
+        WP->memlen = len;
+        WP->in = WP->memsrc;
+        WP->inlen = len;
+        WP->inpos = 0;
+        WP->seekable = 1;
+        return ReadHeader(WP);
+}
+
+// Close the files and free everything owned by a decoder handle
+void wac_close(WacDecoder *D)
+{
+        if (D == NULL)
+        {
+                return;
+        }
+        if (D->filetbl[0] != NULL && D->filetbl[0] != stdin)
+        {
+                fclose(D->filetbl[0]);
+        }
+        if (D->filetbl[1] != NULL && D->filetbl[1] != stdout)
+        {
+                fclose(D->filetbl[1]);
+        }
+#ifdef WAC_HAVE_MMAP
+        if (D->srcmap != NULL)
+        {
+                munmap(D->srcmap, D->srcmaplen);
+        }
+#endif
+        free(D->inbuf);
+        free(D->pcm);
+        free(D->outbuf);
+        FreeResampler(D->rs);
+        free(D->seektbl);
+        free(D->segments);
+        free(D->gaps);
+        wac_set_progress(D, NULL, NULL, 0);
+        free(D->cachearena);
+        free(D->slots);
+        free(D->slotof);
+        free(D->gps);
+        free(D->tags);
+        free(D->srcfile);
+        free(D);
+}
+
+// Return the WAC header information
+void wac_info(const WacDecoder *D, WacInfo *info)
+{
+        info->version = D->version;
+        info->channelcount = D->channelcount;
+        info->framesize = D->framesize;
+        info->blocksize = D->blocksize;
+        info->flags = D->flags;
+        info->samplerate = D->samplerate;
+        info->samplecount = D->samplecount;
+        info->seeksize = D->seeksize;
+        info->seekentries = D->seekentries;
+}
+
+// Store the n-byte little-endian value v at p
+static unsigned char *PutLE(unsigned char *p, uint64_t v, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                p[i] = (v >> (8*i)) & 0xff;
+        }
+        return p + n;
+}
+
+// Largest data chunk a plain RIFF file can describe (the RIFF size, which
+// also counts the rest of the header, is 32 bits)
+#define WAV_MAX_DATA (0xffffffffULL - (WAV_HEADER_SIZE - 8))
+
+// Size of the WAV header for output of samples samples per channel.  Output
+// that could outgrow a 32-bit RIFF file (including a truncated file of
+// unknown length) gets room for an RF64 ds64 chunk, which is left as a JUNK
+// chunk when the final size turns out to fit after all.
+static size_t WavHeaderSizeFor(const WacState *WP, uint64_t samples)
+{
+        uint64_t bytes = samples * OutChannels(WP) * OutBytes(WP);
+
+        return (WP->truncated && WP->samplecount == 0) || bytes > WAV_MAX_DATA ?
+                WAV_HEADER_SIZE + WAV_DS64_SIZE : WAV_HEADER_SIZE;
+}
+
+// Size of the WAV header for this file
+static size_t WavHeaderSize(const WacState *WP)
+{
+        return WavHeaderSizeFor(WP, OutCount(WP, WP->samplecount));
+}
+
+// Write a WAV file header of size bytes from WAC header information for a
+// file holding samples samples per channel.  For WAV_UNKNOWN_LENGTH the RIFF
+// and data sizes are 0xffffffff, which streaming readers take as "up to the
+// end".  Data over 4 GB is written as RF64 (EBU Tech 3306), whose ds64 chunk
+// holds the 64-bit sizes.
+static void WriteWavHeaderSized(WacState *WP, uint64_t samples, size_t size)
+{
+        unsigned char hdr[WAV_HEADER_SIZE + WAV_DS64_SIZE];
+        unsigned char *p = hdr;
+        int channels = OutChannels(WP);
+        int bytes = OutBytes(WP);
+        uint64_t data = samples * channels * bytes;
+        int rf64 = samples != WAV_UNKNOWN_LENGTH && data > 0xffffffffULL - (size - 8);
+
+        memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+        p = PutLE(p + 4, rf64 || samples == WAV_UNKNOWN_LENGTH ? 0xffffffff : size - 8 + data, 4);
+        memcpy(p, "WAVE", 4);
+        p += 4;
+        if (size > WAV_HEADER_SIZE)
+        {
+                memset(p, 0, WAV_DS64_SIZE);
+                memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+                p = PutLE(p + 4, WAV_DS64_SIZE - 8, 4);
+                if (rf64)
+                {
+                        PutLE(p, size - 8 + data, 8);       // RIFF size
+                        PutLE(p + 8, data, 8);              // data size
+                        PutLE(p + 16, samples, 8);          // sample count
+                }
+                p += WAV_DS64_SIZE - 8;
+        }
+        memcpy(p, "fmt ", 4);
+        p = PutLE(p + 4, 16, 4);
+        p = PutLE(p, WP->format == WAC_FORMAT_FLOAT ? 3 : 1, 2); // tag: IEEE float or PCM
+        p = PutLE(p, channels, 2);
+        p = PutLE(p, WP->outrate, 4);
+        p = PutLE(p, (uint64_t) WP->outrate * channels * bytes, 4); // bytes per second
+        p = PutLE(p, bytes*channels, 2); // bytes per sample
+        p = PutLE(p, 8*bytes, 2); // bits per sample
+        memcpy(p, "data", 4);
+        p = PutLE(p + 4, rf64 || samples == WAV_UNKNOWN_LENGTH ? 0xffffffff : data, 4);
+        WRITE(WP, hdr, p - hdr);
+}
+
+// The same with the header size for this file
+static void WriteWavHeader(WacState *WP, uint64_t samples)
+{
+        WriteWavHeaderSized(WP, samples, WavHeaderSize(WP));
+}
+
+// Size in bytes of the WAV file wac_write_wav() produces.  This can be more
+// than a size_t holds on 32-bit systems.
+unsigned long long wac_wav_size(const WacDecoder *D)
+{
+        return WavHeaderSize(D) + (unsigned long long) OutCount(D, D->samplecount) * OutChannels(D) * OutBytes(D);
+}
+
+// wac_write_wav_cb
+//
+// Decode the whole file as a WAV file passed in pieces, in order, to writefn.
+// The callback returns 0 to continue or anything else to stop with
+// WAC_ERR_IO.
+//
+int wac_write_wav_cb(WacDecoder *D, WacWriteFn writefn, void *ctx)
+{
+        int err;
+
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        MetricsStart(D);
+        OutputStage(D, 1);
+        D->writefn = writefn;
+        D->writectx = ctx;
+        WriteWavHeader(D, OutCount(D, D->samplecount));
+        err = SeekInput(D, D->datastart, 0);
+        if (err == WAC_OK)
+        {
+                err = DecodeSamples(D, D->samplecount);
+        }
+        D->writefn = NULL;
+        D->writectx = NULL;
+        return MetricsStop(D, err);
+}
+
+// Write callback state for wac_write_wav_mem()
+typedef struct WacMemSink_s
+{
+        unsigned char *buf;
+        size_t size;
+        size_t used;
+} WacMemSink;
+
+static int MemSinkWrite(void *ctx, const void *data, size_t len)
+{
+        WacMemSink *MP = ctx;
+
+        if (len > MP->size - MP->used)
+        {
+                return 1;
+        }
+        memcpy(MP->buf + MP->used, data, len);
+        MP->used += len;
+        return 0;
+}
+
+// wac_write_wav_mem
+//
+// Decode the whole file as a WAV file into buf, which must be at least
+// wac_wav_size() bytes.  The samples are decoded in place after the header
+// (split between threads as for wac_write_wav()).
+//
+static int WriteWavMem(WacState *D, void *buf, size_t size)
+{
+        WacMemSink M;
+        int err;
+
+        if (wac_wav_size(D) > (size_t) -1)
+        {
+                return SetError(D, WAC_ERR_NOMEM, "%s: WAV file too large for memory", D->srcfile);
+        }
+        if (size < wac_wav_size(D))
+        {
+                return SetError(D, WAC_ERR_ARG, "WAV buffer too small");
+        }
+        M.buf = buf;
+        M.size = WavHeaderSize(D);
+        M.used = 0;
+        D->writefn = MemSinkWrite;
+        D->writectx = &M;
+        WriteWavHeader(D, OutCount(D, D->samplecount));
+        D->writefn = NULL;
+        D->writectx = NULL;
+        OutputStage(D, 1);
+        err = DecodeAll(D, (unsigned char *) buf + WavHeaderSize(D));
+        return err;
+}
+
+int wac_write_wav_mem(WacDecoder *D, void *buf, size_t size)
+{
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        MetricsStart(D);
+        return MetricsStop(D, WriteWavMem(D, buf, size));
+}
+
+// Spectrograms
+//
+// wac_spectrogram() feeds the decoded frames straight into a short-time
+// Fourier transform, so that a WAC file can be analysed without writing
+// and re-reading a WAV file.  Each channel (or the channel selected or
+// mixed by the channels option) keeps the last window of samples; every hop
+// samples the window is weighted and transformed.  The window is real, so
+// its even and odd samples are packed into one complex sequence of half the
+// length, run through a radix-2 FFT and separated again, which halves the
+// work of a complex FFT of the whole window.  Windows that would run past
+// the end of the recording are left out.  The analysis is at the recorded
+// sample rate (the rate option does not apply).
+//
+// wac_write_spectrogram() writes the same data to a file with a 32-byte
+// little-endian header:
+//
+//   "WSPC", uint16 version (1), uint16 format (WAC_SPEC_xxx),
+//   uint32 channels, bins, columns, sample rate, fftsize and hop
+//
+// followed by the columns in order, each holding channels * bins values.
+//
+#define WAC_SPEC_HEADER_SIZE 32
+
+typedef struct WacSpec_s
+{
+        int n;                  // FFT length
+        int hop;                // samples from one window to the next
+        int format;             // WAC_SPEC_xxx
+        int channels;           // channels analysed
+        int bins;               // n / 2 + 1
+        float *window;          // n window coefficients
+        float *cosine;          // twiddle factors e^(-2 pi i k / n), k < n / 2
+        float *sine;
+        int *rev;               // bit-reversed index of each of n / 2 points
+        float *hist;            // last n samples of each channel
+        float *re;              // FFT work space
+        float *im;
+        float norm;             // magnitude scale: 2 / sum of the window
+        int have;               // samples per channel in hist
+        unsigned long skip;     // samples to drop before the next window
+        unsigned char *col;     // one column in the output format
+        size_t colsize;         // bytes per column
+        unsigned char *out;     // where the next column goes, or NULL to WRITE it
+} WacSpec;
+
+// Check the options and work out the spectrogram layout
+static int SpecLayout(const WacState *WP, const WacSpecOptions *opts, WacSpecOptions *o, WacSpecInfo *info)
+{
+        memset(o, 0, sizeof(*o));
+        if (opts != NULL)
+        {
+                *o = *opts;
+        }
+        o->fftsize = o->fftsize > 0 ? o->fftsize : 256;
+        o->hop = o->hop > 0 ? o->hop : o->fftsize / 2;
+        if (o->fftsize < 16 || o->fftsize > 65536 || (o->fftsize & (o->fftsize - 1)) != 0 ||
+            o->window < WAC_WINDOW_HANN || o->window > WAC_WINDOW_RECT ||
+            o->format < WAC_SPEC_MAGNITUDE || o->format > WAC_SPEC_DB8)
+        {
+                return WAC_ERR_ARG;
+        }
+        info->columns = WP->samplecount >= (unsigned long) o->fftsize ?
+                1 + (WP->samplecount - o->fftsize) / o->hop : 0;
+        info->channels = OutChannels(WP);
+        info->bins = o->fftsize / 2 + 1;
+        info->size = (size_t) info->columns * info->channels * info->bins *
+                (o->format == WAC_SPEC_DB8 ? 1 : sizeof(float));
+        return WAC_OK;
+}
+
+static void SpecFree(WacSpec *SP)
+{
+        free(SP->window);
+        free(SP->cosine);
+        free(SP->sine);
+        free(SP->rev);
+        free(SP->hist);
+        free(SP->re);
+        free(SP->im);
+        free(SP->col);
+}
+
+static int SpecInit(WacState *WP, WacSpec *SP, const WacSpecOptions *o, const WacSpecInfo *info)
+{
+        const double pi = 3.14159265358979323846;
+        double sum = 0;
+        int n = o->fftsize;
+        int bits = 0;
+        int i;
+
+        memset(SP, 0, sizeof(*SP));
+        SP->n = n;
+        SP->hop = o->hop;
+        SP->format = o->format;
+        SP->channels = info->channels;
+        SP->bins = info->bins;
+        SP->colsize = (size_t) SP->channels * SP->bins * (o->format == WAC_SPEC_DB8 ? 1 : sizeof(float));
+        SP->window = malloc(n * sizeof(float));
+        SP->cosine = malloc(n / 2 * sizeof(float));
+        SP->sine = malloc(n / 2 * sizeof(float));
+        SP->rev = malloc(n / 2 * sizeof(int));
+        SP->hist = malloc((size_t) SP->channels * n * sizeof(float));
+        SP->re = malloc(n / 2 * sizeof(float));
+        SP->im = malloc(n / 2 * sizeof(float));
+        SP->col = malloc((size_t) SP->channels * SP->bins * sizeof(float));
+        if (SP->window == NULL || SP->cosine == NULL || SP->sine == NULL || SP->rev == NULL ||
+            SP->hist == NULL || SP->re == NULL || SP->im == NULL || SP->col == NULL)
+        {
+                SpecFree(SP);
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        for (i = 0; i < n; i++)
+        {
+                double c = cos(2 * pi * i / n);
+                SP->window[i] = o->window == WAC_WINDOW_HANN ? 0.5 - 0.5 * c :
+                        o->window == WAC_WINDOW_HAMMING ? 0.54 - 0.46 * c : 1.0;
+                sum += SP->window[i];
+        }
+        SP->norm = (float) (2 / sum);
+        for (i = 0; i < n / 2; i++)
+        {
+                SP->cosine[i] = (float) cos(2 * pi * i / n);
+                SP->sine[i] = (float) sin(2 * pi * i / n);
+        }
+        while ((2 << bits) < n)
+        {
+                bits++;
+        }
+        for (i = 0; i < n / 2; i++)
+        {
+                int j, r = 0;
+                for (j = 0; j < bits; j++)
+                {
+                        r |= ((i >> j) & 1) << (bits - 1 - j);
+                }
+                SP->rev[i] = r;
+        }
+        return WAC_OK;
+}
+
+// In-place iterative radix-2 FFT of n / 2 points
+static void Fft(const WacSpec *SP, float *re, float *im)
+{
+        int n = SP->n / 2;
+        int len, i, j;
+
+        for (i = 0; i < n; i++)
+        {
+                j = SP->rev[i];
+                if (j > i)
+                {
+                        float t = re[i];
+                        re[i] = re[j];
+                        re[j] = t;
+                        t = im[i];
+                        im[i] = im[j];
+                        im[j] = t;
+                }
+        }
+        for (len = 2; len <= n; len <<= 1)
+        {
+                int half = len / 2;
+                int step = 2 * n / len; // twiddles are for n * 2 points
+
+                for (i = 0; i < n; i += len)
+                {
+                        float *ar = re + i;
+                        float *ai = im + i;
+
+                        for (j = 0; j < half; j++)
+                        {
+                                float wr = SP->cosine[j * step];
+                                float wi = -SP->sine[j * step];
+                                float br = ar[j + half] * wr - ai[j + half] * wi;
+                                float bi = ar[j + half] * wi + ai[j + half] * wr;
+
+                                ar[j + half] = ar[j] - br;
+                                ai[j + half] = ai[j] - bi;
+                                ar[j] += br;
+                                ai[j] += bi;
+                        }
+                }
+        }
+}
+
+// Transform the windows in hist into one column of output
+static int SpecColumn(WacState *WP, WacSpec *SP)
+{
+        float *f = (float *) SP->col;
+        unsigned char *q = SP->col;
+        int half = SP->n / 2;
+        int c, k;
+
+        for (c = 0; c < SP->channels; c++)
+        {
+                const float *x = SP->hist + (size_t) c * SP->n;
+
+                for (k = 0; k < half; k++)
+                {
+                        SP->re[k] = x[2 * k] * SP->window[2 * k];
+                        SP->im[k] = x[2 * k + 1] * SP->window[2 * k + 1];
+                }
+                Fft(SP, SP->re, SP->im);
+                for (k = 0; k < SP->bins; k++)
+                {
+                        // Split Z = FFT(even + i odd) into the spectra of the even
+                        // samples E = (Z[k] + Z*[-k]) / 2 and the odd samples
+                        // D = (Z[k] - Z*[-k]) / 2i, then X[k] = E + e^(-2 pi i k / n) D
+                        int a = k < half ? k : 0;
+                        int b = k > 0 ? half - k : 0;
+                        float er = (SP->re[a] + SP->re[b]) / 2;
+                        float ei = (SP->im[a] - SP->im[b]) / 2;
+                        float dr = (SP->im[a] + SP->im[b]) / 2;
+                        float di = (SP->re[b] - SP->re[a]) / 2;
+                        float wr = k < half ? SP->cosine[k] : -1;
+                        float wi = k < half ? -SP->sine[k] : 0;
+                        float xr = er + wr * dr - wi * di;
+                        float xi = ei + wr * di + wi * dr;
+                        float m = sqrtf(xr * xr + xi * xi) * SP->norm;
+                        float db;
+
+                        // 0 Hz and the Nyquist bin have no mirror image
+                        m = k == 0 || k == half ? m / 2 : m;
+                        if (SP->format == WAC_SPEC_MAGNITUDE)
+                        {
+                                *f++ = m;
+                                continue;
+                        }
+                        db = m > 1e-10f ? 20 * log10f(m) : -200;
+                        if (SP->format == WAC_SPEC_DB)
+                        {
+                                *f++ = db;
+                        }
+                        else
+                        {
+                                db = (db + 120) * (255.0f / 120);
+                                *q++ = db <= 0 ? 0 : db >= 255 ? 255 : (unsigned char) (db + 0.5f);
+                        }
+                }
+        }
+        if (SP->out != NULL)
+        {
+                memcpy(SP->out, SP->col, SP->colsize);
+                SP->out += SP->colsize;
+                WP->stats.bytesout += SP->colsize;
+        }
+        else if (WRITE(WP, SP->col, SP->colsize) != SP->colsize)
+        {
+                return SetError(WP, WAC_ERR_IO, "Write error");
+        }
+        return WAC_OK;
+}
+
+// Add n samples per channel from pcm to the windows, putting out a column
+// each time one fills up
+static int SpecFeed(WacState *WP, WacSpec *SP, const short *pcm, unsigned long n)
+{
+        const float scale = 1.0f / 32768;
+        int ch = WP->channelcount;
+        int first = WP->chanmode == WAC_CHANNELS_RIGHT ? 1 : 0;
+        int mix = WP->chanmode == WAC_CHANNELS_MIX && ch == 2;
+        int err;
+
+        while (n > 0)
+        {
+                unsigned long m;
+                int c;
+
+                if (SP->skip > 0)
+                {
+                        m = SP->skip < n ? SP->skip : n;
+                        SP->skip -= m;
+                        pcm += m * ch;
+                        n -= m;
+                        continue;
+                }
+                m = (unsigned long) (SP->n - SP->have) < n ? (unsigned long) (SP->n - SP->have) : n;
+                for (c = 0; c < SP->channels; c++)
+                {
+                        float *x = SP->hist + (size_t) c * SP->n + SP->have;
+                        const short *in = pcm + first + c;
+                        unsigned long i;
+
+                        for (i = 0; i < m; i++)
+                        {
+                                x[i] = mix ? (in[i * ch] + in[i * ch + 1]) * (scale / 2) : in[i * ch] * scale;
+                        }
+                }
+                SP->have += (int) m;
+                pcm += m * ch;
+                n -= m;
+                if (SP->have == SP->n)
+                {
+                        if ((err = SpecColumn(WP, SP)) != WAC_OK)
+                        {
+                                return err;
+                        }
+                        if (SP->hop < SP->n)
+                        {
+                                for (c = 0; c < SP->channels; c++)
+                                {
+                                        float *x = SP->hist + (size_t) c * SP->n;
+                                        memmove(x, x + SP->hop, (SP->n - SP->hop) * sizeof(float));
+                                }
+                                SP->have = SP->n - SP->hop;
+                        }
+                        else
+                        {
+                                SP->have = 0;
+                                SP->skip = SP->hop - SP->n;
+                        }
+                }
+        }
+        return WAC_OK;
+}
+
+// Decode the file a frame at a time into the spectrogram, with out set as
+// for SpecColumn()
+static int SpecDecode(WacState *WP, const WacSpecOptions *opts, unsigned char *out, int header)
+{
+        WacSpecOptions o;
+        WacSpecInfo info;
+        WacSpec S;
+        unsigned long left = WP->samplecount;
+        int err;
+
+        WP->error = WAC_OK;
+        WP->ngaps = 0;
+        if (SpecLayout(WP, opts, &o, &info) != WAC_OK)
+        {
+                return SetError(WP, WAC_ERR_ARG, "Bad spectrogram options");
+        }
+        if ((err = SpecInit(WP, &S, &o, &info)) != WAC_OK)
+        {
+                return err;
+        }
+        S.out = out;
+        if (header)
+        {
+                unsigned char hdr[WAC_SPEC_HEADER_SIZE];
+                unsigned char *p = hdr;
+
+                memcpy(p, "WSPC", 4);
+                p = PutLE(p + 4, 1, 2);
+                p = PutLE(p, o.format, 2);
+                p = PutLE(p, info.channels, 4);
+                p = PutLE(p, info.bins, 4);
+                p = PutLE(p, info.columns, 4);
+                p = PutLE(p, WP->samplerate, 4);
+                p = PutLE(p, o.fftsize, 4);
+                PutLE(p, o.hop, 4);
+                if (WRITE(WP, hdr, sizeof(hdr)) != sizeof(hdr))
+                {
+                        SpecFree(&S);
+                        return SetError(WP, WAC_ERR_IO, "Write error");
+                }
+        }
+        err = SeekInput(WP, WP->datastart, 0);
+        while (err == WAC_OK && left > 0)
+        {
+                unsigned long step = left < (unsigned long) WP->framesize ? left : (unsigned long) WP->framesize;
+
+                if ((err = FrameDecode(WP, WP->pcm)) == WAC_OK)
+                {
+                        err = SpecFeed(WP, &S, WP->pcm, step);
+                }
+                left -= step;
+        }
+        SpecFree(&S);
+        return err;
+}
+
+// wac_spectrogram_info
+//
+// Check the spectrogram options and return the layout and size of the
+// spectrogram of the file.  Returns WAC_ERR_ARG for bad options.
+//
+int wac_spectrogram_info(const WacDecoder *D, const WacSpecOptions *opts, WacSpecInfo *info)
+{
+        WacSpecOptions o;
+
+        return SpecLayout(D, opts, &o, info);
+}
+
+// wac_spectrogram
+//
+// Decode the whole file into a spectrogram at out, which must have room for
+// the size given by wac_spectrogram_info().  Each column holds the bins of
+// each channel in turn, as floats or bytes depending on the format.
+//
+int wac_spectrogram(WacDecoder *D, const WacSpecOptions *opts, void *out)
+{
+        MetricsStart(D);
+        return MetricsStop(D, SpecDecode(D, opts, out, 0));
+}
+
+// wac_write_spectrogram
+//
+// Decode the whole file into a spectrogram file (see above; "-" for standard
+// output), a column at a time.
+//
+int wac_write_spectrogram(WacDecoder *D, const WacSpecOptions *opts, const char *destfile)
+{
+        int tostdout = strcmp(destfile, "-") == 0;
+        int err;
+
+        MetricsStart(D);
+        D->filetbl[1] = tostdout ? stdout : fopen(destfile, "wb");
+        if (D->filetbl[1] == NULL)
+        {
+                return MetricsStop(D, SetError(D, WAC_ERR_OPEN, "%s: Cannot create file", destfile));
+        }
+        err = SpecDecode(D, opts, NULL, 1);
+        if ((tostdout ? fflush(stdout) | ferror(stdout) : fclose(D->filetbl[1])) != 0 && err == WAC_OK)
+        {
+                err = SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+        }
+        D->filetbl[1] = NULL;
+        return MetricsStop(D, err);
+}
+
+// Triggered files
+//
+// Triggered WAC files contain zero frames (every channel has a zero code
+// size) for the untriggered time between recordings.  Rather than expanding
+// these into silence, wac_write_wav() writes each run of non-zero frames (a
+// segment) to its own WAV file named after destfile (WAC_TRIGGER_SPLIT), or
+// all of the segments back to back to destfile along with a CSV index of
+// where each one starts in the recording (WAC_TRIGGER_INDEX).  Zero frames
+// are skipped without storing any samples.  The segments found are also
+// available from wac_segments().
+//
+
+// Build the name of segment file index (or of the index file if index < 0)
+// from the WAV file name destfile.  Fails if it does not fit in name.
+static int SegmentName(WacState *WP, char *name, size_t size, const char *destfile, int index)
+{
+        int len = (int) strlen(destfile);
+        int n;
+
+        if (   len >= 4
+            && destfile[len - 4] == '.'
+            && (destfile[len - 3] | 0x20) == 'w'
+            && (destfile[len - 2] | 0x20) == 'a'
+            && (destfile[len - 1] | 0x20) == 'v'
+            )
+        {
+                len -= 4;
+        }
+        if (index < 0)
+        {
+                n = snprintf(name, size, "%.*s_segments.csv", len, destfile);
+        }
+        else
+        {
+                n = snprintf(name, size, "%.*s_%04d.wav", len, destfile, index);
+        }
+        if (n < 0 || (size_t) n >= size)
+        {
+                return SetError(WP, WAC_ERR_ARG, "%s: File name too long", destfile);
+        }
+        return WAC_OK;
+}
+
+// Create a WAV file and write a placeholder header, to be fixed up by
+// FinishWav() once the number of samples is known
+static int CreateWav(WacState *WP, const char *name)
+{
+        WP->filetbl[1] = fopen(name, "wb");
+        if (WP->filetbl[1] == NULL)
+        {
+                return SetError(WP, WAC_ERR_OPEN, "%s: Cannot create file", name);
+        }
+        WriteWavHeader(WP, 0);
+        return WAC_OK;
+}
+
+// Rewrite the WAV header with the final sample count and close the file
+static int FinishWav(WacState *WP, unsigned long samples)
+{
+        int err = WAC_OK;
+
+        if (fseeko(WP->filetbl[1], 0, SEEK_SET) != 0)
+        {
+                err = SetError(WP, WAC_ERR_IO, "Seek failed");
+        }
+        else
+        {
+                WriteWavHeader(WP, samples);
+        }
+        if ((ferror(WP->filetbl[1]) | fclose(WP->filetbl[1])) != 0 && err == WAC_OK)
+        {
+                err = SetError(WP, WAC_ERR_IO, "Write error");
+        }
+        WP->filetbl[1] = NULL;
+        return err;
+}
+
+// Make room for one more entry of size bytes in the array *array, which has
+// count entries used out of *alloc
+static int GrowArray(WacState *WP, void **array, int *alloc, int count, size_t size)
+{
+        if (count == *alloc)
+        {
+                int n = *alloc ? 2 * *alloc : 64;
+                void *p = realloc(*array, n * size);
+                if (p == NULL)
+                {
+                        return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+                }
+                *array = p;
+                *alloc = n;
+        }
+        return WAC_OK;
+}
+
+static int AddSegment(WacState *WP, unsigned long start)
+{
+        if (GrowArray(WP, (void **) &WP->segments, &WP->segalloc, WP->nsegments, sizeof(WacSegment)) != WAC_OK)
+        {
+                return WP->error;
+        }
+        WP->segments[WP->nsegments].start = start;
+        WP->segments[WP->nsegments].length = 0;
+        WP->nsegments++;
+        return WAC_OK;
+}
+
+// Write the CSV segment index for WAC_TRIGGER_INDEX.  start and length are
+// in recorded samples, offset is where the segment starts in the WAV file
+// (in WAV samples, which differ if the output is resampled).
+static int WriteSegmentIndex(WacState *WP, const char *destfile)
+{
+        char name[1024];
+        unsigned long offset = 0;
+        FILE *fp;
+        int i;
+
+        if (SegmentName(WP, name, sizeof(name), destfile, -1) != WAC_OK)
+        {
+                return WP->error;
+        }
+        if ((fp = fopen(name, "w")) == NULL)
+        {
+                return SetError(WP, WAC_ERR_OPEN, "%s: Cannot create file", name);
+        }
+        fprintf(fp, "segment,start,length,offset,start_seconds\n");
+        for (i = 0; i < WP->nsegments; i++)
+        {
+                fprintf(fp, "%d,%lu,%lu,%lu,%.6f\n", i, WP->segments[i].start,
+                        WP->segments[i].length, offset,
+                        (double) WP->segments[i].start / WP->samplerate);
+                offset += OutCount(WP, WP->segments[i].length);
+        }
+        if ((ferror(fp) | fclose(fp)) != 0)
+        {
+                return SetError(WP, WAC_ERR_IO, "%s: Write error", name);
+        }
+        return WAC_OK;
+}
+
+// Whether the frame just decoded, with result err, found the end of the
+// input: at a block header, or part way through the frame so that it ran
+// into the zero padding FillBits() adds past the end (padbits)
+static int InputEnded(const WacState *WP, int err)
+{
+        return err == WAC_ERR_EOF || (err == WAC_OK && WP->bitcount < WP->padbits);
+}
+
+static int DecodeTriggered(WacState *WP, const char *destfile)
+{
+        unsigned long remaining = WP->samplecount;
+        unsigned long pos = 0;        // position in the recording (per channel)
+        unsigned long n = 0;          // samples per channel in the sample buffer
+        unsigned long cap = (unsigned long) WP->blocksize * WP->framesize;
+        unsigned long total = 0;      // WAV samples written to an index mode file
+        int inseg = 0;
+        int err;
+        char name[1024];
+
+        WP->nsegments = 0;
+        if ((err = SeekInput(WP, WP->datastart, 0)) != WAC_OK)
+        {
+                return err;
+        }
+        if (WP->triggers == WAC_TRIGGER_INDEX && (err = CreateWav(WP, destfile)) != WAC_OK)
+        {
+                return err;
+        }
+
+        WP->skipzero = 1;
+        while (err == WAC_OK && (remaining > 0 || inseg))
+        {
+                unsigned long step = remaining < (unsigned long) WP->framesize ?
+                        remaining : (unsigned long) WP->framesize;
+
+                // Decode the next frame (after the last one, behave as if we had
+                // found a zero frame so the open segment gets closed).  In
+                // truncated mode the end of the input is the end of the file.
+                WP->zeroframe = 1;
+                if (remaining > 0)
+                {
+                        err = FrameDecode(WP, WP->pcm + n * WP->channelcount);
+                        if (WP->truncated && InputEnded(WP, err))
+                        {
+                                WP->error = err = WAC_OK;
+                                WP->zeroframe = 1;
+                                remaining = step = 0;
+                        }
+                        else if (err != WAC_OK)
+                        {
+                                break;
+                        }
+                }
+
+                if (!WP->zeroframe)
+                {
+                        // Start a new segment on the first non-zero frame after a gap
+                        if (!inseg)
+                        {
+                                if ((err = AddSegment(WP, pos)) != WAC_OK)
+                                {
+                                        break;
+                                }
+                                if (WP->triggers != WAC_TRIGGER_INDEX)
+                                {
+                                        if ((err = SegmentName(WP, name, sizeof(name), destfile, WP->nsegments - 1)) != WAC_OK ||
+                                            (err = CreateWav(WP, name)) != WAC_OK)
+                                        {
+                                                break;
+                                        }
+                                }
+                                if (WP->convert && WP->rs != NULL)
+                                {
+                                        ResetResampler(WP->rs);
+                                }
+                                inseg = 1;
+                        }
+                        n += step;
+                        WP->segments[WP->nsegments - 1].length += step;
+                }
+
+                // Write out the buffer when it is full or the segment has ended
+                if (n > 0 && (n + WP->framesize > cap || WP->zeroframe))
+                {
+                        if ((err = WriteSamples(WP, WP->pcm, n)) != WAC_OK)
+                        {
+                                break;
+                        }
+                        n = 0;
+                }
+
+                // Close the segment at the first zero frame
+                if (WP->zeroframe && inseg)
+                {
+                        unsigned long len = OutCount(WP, WP->segments[WP->nsegments - 1].length);
+
+                        if ((err = FlushResampler(WP)) != WAC_OK)
+                        {
+                                break;
+                        }
+                        if (WP->triggers != WAC_TRIGGER_INDEX)
+                        {
+                                err = FinishWav(WP, len);
+                        }
+                        total += len;
+                        inseg = 0;
+                }
+                pos += step;
+                remaining -= step;
+        }
+        WP->skipzero = 0;
+
+        if (WP->filetbl[1] != NULL)
+        {
+                int e = FinishWav(WP, total);
+                if (err == WAC_OK)
+                {
+                        err = e;
+                }
+        }
+        if (err == WAC_OK && WP->triggers == WAC_TRIGGER_INDEX)
+        {
+                err = WriteSegmentIndex(WP, destfile);
+        }
+        return err;
+}
+
+// Return the triggered segments found by the last wac_write_wav() call
+int wac_segments(const WacDecoder *D, const WacSegment **segments)
+{
+        *segments = D->segments;
+        return D->nsegments;
+}
+
+// Truncated recordings
+//
+// A recording that was cut short (a flat battery, a pulled card) ends part
+// way through a block, and its header may still give the full sample count,
+// or none at all if it was never finalized.  In truncated mode the WAV
+// header is written with an unknown length and we decode up to the last
+// complete frame, or the sample count if that comes first, instead of
+// failing at the end of the input.  Returns the number of samples per
+// channel decoded in *decoded.  (Triggered files are handled the same way
+// by DecodeTriggered(), since their headers are rewritten anyway.)
+//
+static int DecodeTruncated(WacState *WP, unsigned long *decoded)
+{
+        unsigned long limit = WP->samplecount > 0 ? WP->samplecount : (unsigned long) -1;
+        unsigned long cap = (unsigned long) WP->blocksize * WP->framesize;
+        unsigned long n = 0; // samples per channel in buffer
+        int err = WAC_OK;
+
+        *decoded = 0;
+        while (*decoded + n < limit)
+        {
+                unsigned long step = limit - *decoded - n < (unsigned long) WP->framesize ?
+                        limit - *decoded - n : (unsigned long) WP->framesize;
+
+                err = FrameDecode(WP, WP->pcm + n * WP->channelcount);
+                if (InputEnded(WP, err))
+                {
+                        // The end of the input, not an error here
+                        WP->error = err = WAC_OK;
+                        break;
+                }
+                if (err != WAC_OK)
+                {
+                        return err;
+                }
+                n += step;
+                if (n + WP->framesize > cap)
+                {
+                        if ((err = WriteSamples(WP, WP->pcm, n)) != WAC_OK)
+                        {
+                                return err;
+                        }
+                        *decoded += n;
+                        n = 0;
+                }
+        }
+        if (n > 0 && (err = WriteSamples(WP, WP->pcm, n)) != WAC_OK)
+        {
+                return err;
+        }
+        *decoded += n;
+        return FlushResampler(WP);
+}
+
+// wac_write_wav
+//
+// Decode the whole file to a WAV file.  If the decoder was opened with more
+// than one thread and the seek table is intact, the file is split up between
+// workers that write straight into their part of the WAV file.  Otherwise we
+// decode everything here.  A destfile of "-" writes the WAV file to standard
+// output, with the header from the sample count in the WAC header (or an
+// unknown length in truncated mode).
+//
+static int WriteWavFile(WacState *D, const char *destfile)
+{
+        int tostdout = strcmp(destfile, "-") == 0;
+        unsigned long samples = D->samplecount;
+        int err;
+
+        OutputStage(D, 1);
+        if (D->flags & 0x10)
+        {
+                // Segments are written to separate files, or need the header
+                // rewritten at the end
+                if (tostdout)
+                {
+                        return SetError(D, WAC_ERR_ARG, "%s: Triggered files cannot be written to standard output", D->srcfile);
+                }
+                return DecodeTriggered(D, destfile);
+        }
+
+#ifdef WAC_HAVE_MMAP
+        // In mmap mode, size the WAV file up front (it is fully known from the
+        // header), map it and decode straight into the mapping.  If the mapping
+        // fails, or the file does not fit in the address space, we fall back
+        // to ordinary writes below.
+        if (D->usemmap && !tostdout && !D->truncated && wac_wav_size(D) <= (size_t) -1)
+        {
+                size_t size = (size_t) wac_wav_size(D);
+                int fd = open(destfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+                void *map;
+
+                if (fd < 0)
+                {
+                        return SetError(D, WAC_ERR_OPEN, "%s: Cannot create file", destfile);
+                }
+                if (ftruncate(fd, size) != 0)
+                {
+                        close(fd);
+                        return SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+                }
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED)
+                {
+                        err = WriteWavMem(D, map, size);
+                        if (munmap(map, size) != 0 && err == WAC_OK)
+                        {
+                                err = SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+                        }
+                        if (close(fd) != 0 && err == WAC_OK)
+                        {
+                                err = SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+                        }
+                        return err;
+                }
+                close(fd);
+        }
+#endif
+
+        D->filetbl[1] = tostdout ? stdout : fopen(destfile, "wb");
+        if (D->filetbl[1] == NULL)
+        {
+                return SetError(D, WAC_ERR_OPEN, "%s: Cannot create file", destfile);
+        }
+        WriteWavHeader(D, D->truncated ? WAV_UNKNOWN_LENGTH : OutCount(D, D->samplecount));
+
+        if (UseThreads(D) && !tostdout && !D->truncated)
+        {
+                if (fclose(D->filetbl[1]) != 0)
+                {
+                        D->filetbl[1] = NULL;
+                        return SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+                }
+                D->filetbl[1] = NULL;
+                return DecodeParallel(D, destfile, NULL, D->threads);
+        }
+
+        err = SeekInput(D, D->datastart, 0);
+        if (err == WAC_OK && D->pipeline && D->memsrc == NULL)
+        {
+                err = StartPipe(D);
+        }
+        if (err == WAC_OK)
+        {
+                err = D->truncated ? DecodeTruncated(D, &samples) : DecodeSamples(D, D->samplecount);
+        }
+        if (D->pipe != NULL)
+        {
+                int e = StopPipe(D);
+
+                // An error in the pipe is what stopped the decoder, which
+                // only saw the source end early or its output dropped
+                err = e != WAC_OK ? e : err;
+        }
+
+        // Now that the length is known, fix up the header of a truncated
+        // file, unless the output is a pipe
+        if (err == WAC_OK && D->truncated && fseeko(D->filetbl[1], 0, SEEK_SET) == 0)
+        {
+                WriteWavHeader(D, OutCount(D, samples));
+        }
+        if ((tostdout ? fflush(stdout) | ferror(stdout) : fclose(D->filetbl[1])) != 0 && err == WAC_OK)
+        {
+                err = SetError(D, WAC_ERR_IO, "%s: Write error", destfile);
+        }
+        D->filetbl[1] = NULL;
+        return err;
+}
+
+int wac_write_wav(WacDecoder *D, const char *destfile)
+{
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        MetricsStart(D);
+        return MetricsStop(D, WriteWavFile(D, destfile));
+}
+
+// wac_decode_all
+//
+// Decode the whole file into out, which must have room for samplecount *
+// channelcount interleaved samples.  Samples are decoded in place, so there
+// is no copy, and the file is split up between threads as for
+// wac_write_wav().
+//
+static int DecodeAll(WacState *WP, unsigned char *out)
+{
+        int err;
+
+        if (UseThreads(WP))
+        {
+                return DecodeParallel(WP, NULL, out, WP->threads);
+        }
+        err = SeekInput(WP, WP->datastart, 0);
+        if (err == WAC_OK)
+        {
+                WP->memout = out;
+                err = DecodeSamples(WP, WP->samplecount);
+                WP->memout = NULL;
+        }
+        return err;
+}
+
+int wac_decode_all(WacDecoder *D, short *out)
+{
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        MetricsStart(D);
+        OutputStage(D, 0);
+        return MetricsStop(D, DecodeAll(D, (unsigned char *) out));
+}
+
+// Range cache
+//
+// A viewer scrubbing over the same stretch of a recording asks for the same
+// samples again and again.  With the cache option, wac_decode_range() works a
+// seek table entry at a time and keeps the decoded entries in an LRU cache,
+// so a repeated range costs a memcpy().  The slots are carved out of one
+// arena allocated on first use, and the LRU list and entry-to-slot map are
+// fixed arrays, so nothing is allocated after that.
+//
+static int CacheInit(WacState *WP)
+{
+        int entries = (int) ((BlockCount(WP) + WP->seeksize - 1) / WP->seeksize);
+        size_t slotlen = (size_t) WP->seeksize * WP->blocksize * WP->framesize * WP->channelcount;
+        size_t n = WP->cachesize / (slotlen * sizeof(short));
+        int i;
+
+        WP->nslots = n < 1 ? 1 : n > (size_t) entries ? entries : (int) n;
+        WP->cachearena = malloc(WP->nslots * slotlen * sizeof(short));
+        WP->slots = malloc(WP->nslots * sizeof(WacCacheSlot));
+        WP->slotof = malloc(entries * sizeof(int));
+        if (WP->cachearena == NULL || WP->slots == NULL || WP->slotof == NULL)
+        {
+                free(WP->cachearena);
+                free(WP->slots);
+                free(WP->slotof);
+                WP->cachearena = NULL;
+                WP->slots = NULL;
+                WP->slotof = NULL;
+                return SetError(WP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        for (i = 0; i < entries; i++)
+        {
+                WP->slotof[i] = -1;
+        }
+        for (i = 0; i < WP->nslots; i++)
+        {
+                WP->slots[i].entry = -1;
+                WP->slots[i].prev = i - 1;
+                WP->slots[i].next = i + 1 < WP->nslots ? i + 1 : -1;
+        }
+        WP->cachehead = 0;
+        WP->cachetail = WP->nslots - 1;
+        WP->cacheused = 0;
+        return WAC_OK;
+}
+
+// Move slot s to the head of the LRU list
+static void CacheTouch(WacState *WP, int s)
+{
+        WacCacheSlot *SP = &WP->slots[s];
+
+        if (WP->cachehead == s)
+        {
+                return;
+        }
+        WP->slots[SP->prev].next = SP->next;
+        if (SP->next >= 0)
+        {
+                WP->slots[SP->next].prev = SP->prev;
+        }
+        else
+        {
+                WP->cachetail = SP->prev;
+        }
+        SP->prev = -1;
+        SP->next = WP->cachehead;
+        WP->slots[WP->cachehead].prev = s;
+        WP->cachehead = s;
+}
+
+// Find the samples of seek table entry e, decoding them into the least
+// recently used slot if they are not cached.  If positioned is set, the input
+// is already at the start of the entry.
+static int CacheEntry(WacState *WP, int e, int positioned, const short **pcm)
+{
+        unsigned long spe = (unsigned long) WP->seeksize * WP->blocksize * WP->framesize;
+        size_t slotlen = spe * WP->channelcount;
+        unsigned long left;
+        int s = WP->slotof[e];
+        WacCacheSlot *SP;
+        short *out;
+        int err;
+
+        if (s >= 0)
+        {
+                WP->cachehits++;
+                CacheTouch(WP, s);
+                *pcm = WP->cachearena + s * slotlen;
+                return WAC_OK;
+        }
+        WP->cachemisses++;
+        s = WP->cachetail;
+        SP = &WP->slots[s];
+        if (SP->entry >= 0)
+        {
+                WP->slotof[SP->entry] = -1;
+                SP->entry = -1;
+                WP->cacheused--;
+        }
+        if (!positioned && (err = SeekEntry(WP, e)) != WAC_OK)
+        {
+                return err;
+        }
+        out = WP->cachearena + s * slotlen;
+        for (left = WP->samplecount - e * spe < spe ? WP->samplecount - e * spe : spe; left > 0;
+             left -= left < (unsigned long) WP->framesize ? left : (unsigned long) WP->framesize)
+        {
+                if ((err = FrameDecode(WP, out)) != WAC_OK)
+                {
+                        return err;
+                }
+                out += WP->framesize * WP->channelcount;
+        }
+        SP->entry = e;
+        WP->slotof[e] = s;
+        WP->cacheused++;
+        CacheTouch(WP, s);
+        *pcm = WP->cachearena + s * slotlen;
+        return WAC_OK;
+}
+
+// wac_decode_range() of samples start to end through the cache
+static int CachedRange(WacState *WP, unsigned long start, unsigned long end, short *out)
+{
+        unsigned long spe = (unsigned long) WP->seeksize * WP->blocksize * WP->framesize;
+        int ch = WP->channelcount;
+        int positioned = 0;
+        unsigned long e;
+        int err;
+
+        if (WP->cachearena == NULL && (err = CacheInit(WP)) != WAC_OK)
+        {
+                return err;
+        }
+        for (e = start / spe; e * spe < end; e++)
+        {
+                unsigned long from = e * spe > start ? e * spe : start;
+                unsigned long to = (e + 1) * spe < end ? (e + 1) * spe : end;
+                unsigned long misses = WP->cachemisses;
+                const short *pcm;
+
+                if ((err = CacheEntry(WP, (int) e, positioned, &pcm)) != WAC_OK)
+                {
+                        return err;
+                }
+                memcpy(out + (from - start) * ch, pcm + (from - e * spe) * ch, (to - from) * ch * sizeof(short));
+
+                // After decoding an entry the input is at the start of the next
+                positioned = WP->cachemisses != misses;
+        }
+        return WAC_OK;
+}
+
+// Return the counters of the wac_decode_range() cache
+void wac_cache_stats(const WacDecoder *D, WacCacheStats *stats)
+{
+        stats->hits = D->cachehits;
+        stats->misses = D->cachemisses;
+        stats->slots = D->nslots;
+        stats->used = D->cacheused;
+}
+
+// wac_decode_range
+//
+// Decode count samples per channel starting at sample start into out (which
+// must have room for count * channelcount interleaved samples, so count * 2
+// is always enough).  The seek table is used to jump to the entry holding the
+// first block we need and only the frames from there up to the end of the
+// range are decoded (whole entries, kept for next time, with the range
+// cache).  The range is clipped to the end of the file and the number of
+// samples per channel actually stored is returned in *decoded.
+//
+int wac_decode_range(WacDecoder *D, unsigned long start, unsigned long count,
+                     short *out, unsigned long *decoded)
+{
+        int err;
+        unsigned long pos, end;
+
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        *decoded = 0;
+
+        // Work out the range to decode and jump to the closest seek table entry
+        // at or before it.  If the seek table is missing, we decode from the
+        // start of the file.
+        if (start >= D->samplecount || count == 0)
+        {
+                return WAC_OK;
+        }
+        end = count < D->samplecount - start ? start + count : D->samplecount;
+        if (D->cachesize > 0 && (SeekTableUsable(D) || ScanSeekTable(D)))
+        {
+                D->streaming = 0;
+                if ((err = CachedRange(D, start, end, out)) == WAC_OK)
+                {
+                        *decoded = end - start;
+                }
+                return err;
+        }
+        if (SeekTableUsable(D))
+        {
+                unsigned long block = start / ((unsigned long) D->blocksize * D->framesize);
+                err = SeekEntry(D, block / D->seeksize);
+        }
+        else
+        {
+                err = SeekInput(D, D->datastart, 0);
+        }
+        if (err != WAC_OK)
+        {
+                return err;
+        }
+
+        // Decode frames until the end of the range, keeping the samples that
+        // fall inside it
+        pos = (unsigned long) D->frameindex * D->framesize;
+        while (pos < end)
+        {
+                unsigned long from = pos > start ? pos : start;
+                unsigned long to = pos + D->framesize < end ? pos + D->framesize : end;
+
+                if ((err = FrameDecode(D, D->pcm)) != WAC_OK)
+                {
+                        return err;
+                }
+                if (from < to)
+                {
+                        memcpy(out + (from - start) * D->channelcount,
+                               D->pcm + (from - pos) * D->channelcount,
+                               (to - from) * D->channelcount * sizeof(short));
+                }
+                pos += D->framesize;
+        }
+        *decoded = end - start;
+        return WAC_OK;
+}
+
+// Streaming
+//
+// wac_read() returns the samples in order a chunk at a time, decoding only
+// as many frames as it needs, so a recording of any length can be processed
+// in the memory of one frame.  The first call starts at the beginning of the
+// file and any other decoding call on the handle ends the stream (the next
+// wac_read() starts over).  Whole frames go straight to the caller's buffer;
+// only a frame split between two calls is held in pcm.
+//
+int wac_read(WacDecoder *D, short *out, unsigned long count, unsigned long *got)
+{
+        int err;
+
+        D->error = WAC_OK;
+        *got = 0;
+        if (!D->streaming)
+        {
+                if ((err = SeekInput(D, D->datastart, 0)) != WAC_OK)
+                {
+                        return err;
+                }
+                D->streaming = 1;
+                D->streampos = 0;
+                D->ngaps = 0;
+                D->pcmpos = D->pcmlen = 0;
+        }
+        while (count > 0)
+        {
+                unsigned long pos = (unsigned long) D->frameindex * D->framesize;
+                unsigned long n;
+
+                if (D->pcmpos == D->pcmlen)
+                {
+                        if (pos >= D->samplecount)
+                        {
+                                break;
+                        }
+                        n = D->samplecount - pos < (unsigned long) D->framesize ?
+                                D->samplecount - pos : (unsigned long) D->framesize;
+
+                        // Decode a whole frame in place if the caller wants all of it
+                        if (n == (unsigned long) D->framesize && count >= n)
+                        {
+                                if ((err = FrameDecode(D, out)) != WAC_OK)
+                                {
+                                        return err;
+                                }
+                                out += n * D->channelcount;
+                                count -= n;
+                                *got += n;
+                                D->streampos += n;
+                                continue;
+                        }
+                        if ((err = FrameDecode(D, D->pcm)) != WAC_OK)
+                        {
+                                return err;
+                        }
+                        D->pcmpos = 0;
+                        D->pcmlen = (int) n;
+                }
+                n = (unsigned long) (D->pcmlen - D->pcmpos) < count ?
+                        (unsigned long) (D->pcmlen - D->pcmpos) : count;
+                memcpy(out, D->pcm + D->pcmpos * D->channelcount, n * D->channelcount * sizeof(short));
+                D->pcmpos += (int) n;
+                out += n * D->channelcount;
+                count -= n;
+                *got += n;
+                D->streampos += n;
+        }
+        return WAC_OK;
+}
+
+// Side-band data for the stream: the position, and the block, tag and most
+// recent GPS fix of the last sample returned by wac_read()
+void wac_stream_info(const WacDecoder *D, WacStreamInfo *info)
+{
+        memset(info, 0, sizeof(*info));
+        if (!D->streaming)
+        {
+                return;
+        }
+        info->sample = D->streampos;
+        info->block = D->block;
+        info->tag = D->tag;
+        info->gpsvalid = D->gpsvalid;
+        info->gps = D->gpsfix;
+}
+
+// Convert using the default options
+int wac2wav_c(char *srcfile, char *destfile)
+{
+        return wac2wav_opts_c(srcfile, destfile, NULL);
+}
+
+// Simply take stdin to stdout
+int wac2wav_opts_c(char *srcfile, char *destfile, const WacOptions *opts)
+{
+        WacDecoder *D;
+        int err;
+
+        if ((err = wac_open(&D, srcfile, opts)) == WAC_OK)
+        {
+                err = wac_write_wav(D, destfile);
+        }
+        wac_close(D);
+        return err;
+}
+
+// Decode a sample range from srcfile (see wac_decode_range()).  The channel
+// count of the file is returned in *channels.
+int wac2wav_range_c(char *srcfile, unsigned long start, unsigned long count,
+                    short *out, unsigned long *decoded, int *channels)
+{
+        WacDecoder *D;
+        int err;
+
+        *decoded = 0;
+        if ((err = wac_open(&D, srcfile, NULL)) == WAC_OK)
+        {
+                *channels = D->channelcount;
+                err = wac_decode_range(D, start, count, out, decoded);
+        }
+        wac_close(D);
+        return err;
+}
+
+// Probe
+//
+// wac_probe() collects what a catalogue needs to know about a file without
+// decoding any audio: the header, the GPS fixes and the ranges of tagged
+// blocks.  GPS data is only present in the first block of each seek table
+// entry, so if the seek table is usable and the file is not tagged, we just
+// read those few block headers.  Tags are in every block, so for tagged files
+// (or if the seek table is unusable) we scan the data for the block header
+// pattern instead of decoding the frames in between.  The pattern does not
+// occur in the data stream and we also require the block index after it to
+// move forward, so the scan only runs at the speed of memchr() and the disk.
+//
+
+// Bytes needed to read a block header with GPS and tag data
+#define WAC_BLOCKINFO_SIZE 16
+
+// Read n bits starting at bit offset bit of the 16-bit words at p, in the
+// same order as ReadBits()
+static unsigned PeekBits(const unsigned char *p, int bit, int n)
+{
+        unsigned v = 0;
+        int i;
+
+        for (i = bit; i < bit + n; i++)
+        {
+                unsigned w = p[2 * (i >> 4)] | (p[2 * (i >> 4) + 1] << 8);
+                v = (v << 1) | ((w >> (15 - (i & 15))) & 1);
+        }
+        return v;
+}
+
+// Convert a GPS field of bits bits in two's complement to degrees
+static double GpsDegrees(long v, int bits)
+{
+        if (v & (1L << (bits - 1)))
+        {
+                v -= 1L << bits;
+        }
+        return v / 100000.0;
+}
+
+// Check for the header of a block at p and return its index, or -1
+static long PeekBlockHeader(const unsigned char *p)
+{
+        if (p[0] != 0x00 || p[1] != 0x80 || p[2] != 0x01 || p[3] != 0x00)
+        {
+                return -1;
+        }
+        return (long) (p[4] | (p[5] << 8) | ((unsigned long) p[6] << 16) | ((unsigned long) p[7] << 24));
+}
+
+// Record the GPS fix and tag following the header of block at p, which has
+// WAC_BLOCKINFO_SIZE bytes
+static int BlockInfo(WacState *WP, const unsigned char *p, unsigned long block)
+{
+        unsigned long start = block * WP->blocksize * WP->framesize;
+        unsigned long end = start + (unsigned long) WP->blocksize * WP->framesize;
+        int bit = 64;
+
+        if (end > WP->samplecount)
+        {
+                end = WP->samplecount;
+        }
+        if ((WP->flags & 0x20) && 0 == (block % WP->seeksize))
+        {
+                // 25-bit latitude and 26-bit longitude
+                WacGps *fix;
+
+                if (GrowArray(WP, (void **) &WP->gps, &WP->gpsalloc, WP->ngps, sizeof(WacGps)) != WAC_OK)
+                {
+                        return WP->error;
+                }
+                fix = &WP->gps[WP->ngps++];
+                fix->sample = start;
+                fix->latitude = GpsDegrees(PeekBits(p, bit, 25), 25);
+                fix->longitude = GpsDegrees(PeekBits(p, bit + 25, 26), 26);
+                bit += 51;
+        }
+        if (WP->flags & 0x40)
+        {
+                int tag = PeekBits(p, bit, 4);
+                WacTagRange *last = WP->ntags > 0 ? &WP->tags[WP->ntags - 1] : NULL;
+
+                // Extend the last range if this block carries on from it
+                if (last != NULL && last->tag == tag && last->start + last->length == start)
+                {
+                        last->length = end - last->start;
+                }
+                else if (tag != 0)
+                {
+                        if (GrowArray(WP, (void **) &WP->tags, &WP->tagalloc, WP->ntags, sizeof(WacTagRange)) != WAC_OK)
+                        {
+                                return WP->error;
+                        }
+                        last = &WP->tags[WP->ntags++];
+                        last->tag = tag;
+                        last->start = start;
+                        last->length = end - start;
+                }
+        }
+        return WAC_OK;
+}
+
+// Read the GPS data from the first block of each seek table entry
+static int ProbeSeekTable(WacState *WP)
+{
+        unsigned long entries = (BlockCount(WP) + WP->seeksize - 1) / WP->seeksize;
+        unsigned long e;
+
+        for (e = 0; e < entries; e++)
+        {
+                unsigned char p[WAC_BLOCKINFO_SIZE];
+                off_t pos = 2 * (off_t) WP->seektbl[e];
+                size_t n;
+
+                memset(p, 0, sizeof(p));
+                if (WP->memsrc != NULL)
+                {
+                        n = (size_t) pos < WP->memlen ? WP->memlen - (size_t) pos : 0;
+                        memcpy(p, WP->memsrc + pos, n < sizeof(p) ? n : sizeof(p));
+                }
+                else if (fseeko(WP->filetbl[0], pos, SEEK_SET) != 0)
+                {
+                        return SetError(WP, WAC_ERR_IO, "%s: Seek failed", WP->srcfile);
+                }
+                else
+                {
+                        n = fread(p, 1, sizeof(p), WP->filetbl[0]);
+                }
+                if (PeekBlockHeader(p) != (long) (e * WP->seeksize))
+                {
+                        return SetError(WP, WAC_ERR_BLOCK, "%s: Bad block header in block %lu", WP->srcfile, e * WP->seeksize);
+                }
+                if (BlockInfo(WP, p, e * WP->seeksize) != WAC_OK)
+                {
+                        return WP->error;
+                }
+        }
+        return WAC_OK;
+}
+
+// Find the first block header starting at an offset from i up to limit in
+// the len bytes at buf (which start on a word boundary), with a block index
+// from minblock up to nblocks - 1, and store its index in *block.  Returns
+// the offset of the header, or limit if there is none.  This is the scanner
+// for the probe, the seek table rebuild and recovery from damaged blocks.
+static size_t FindBlock(const unsigned char *buf, size_t len, size_t i, size_t limit,
+                        unsigned long minblock, unsigned long nblocks, unsigned long *block)
+{
+        // Look for the 0x80 byte of the 0x8000 word, which is the second byte
+        // of a header at an even offset
+        while (i < limit)
+        {
+                size_t n = limit - i < len - i - 1 ? limit - i : len - i - 1;
+                const unsigned char *q = memchr(buf + i + 1, 0x80, n);
+                size_t c;
+                long b;
+
+                if (q == NULL)
+                {
+                        return limit;
+                }
+                c = q - buf - 1;
+                i = c + ((c & 1) ? 1 : 2);
+                if ((c & 1) || c + 8 > len)
+                {
+                        continue;
+                }
+                b = PeekBlockHeader(buf + c);
+                if (b >= 0 && (unsigned long) b >= minblock && (unsigned long) b < nblocks)
+                {
+                        *block = (unsigned long) b;
+                        return c;
+                }
+        }
+        return limit;
+}
+
+// Scan the data for block headers in len bytes at buf (which start at a
+// block boundary or on a word boundary following one).  If more is set, the
+// buffer is part of a larger whole and headers too close to the end are left
+// for the next call.  Returns the number of bytes consumed.
+static size_t ScanBlocks(WacState *WP, const unsigned char *buf, size_t len, int more,
+                         unsigned long *block)
+{
+        unsigned long nblocks = BlockCount(WP);
+        size_t limit = more ? (len > WAC_BLOCKINFO_SIZE ? len - WAC_BLOCKINFO_SIZE : 0) : len;
+        size_t i = 0;
+
+        while (i < limit && *block < nblocks && WP->error == WAC_OK)
+        {
+                unsigned char p[WAC_BLOCKINFO_SIZE];
+                unsigned long b;
+                size_t c = FindBlock(buf, len, i, limit, *block, nblocks, &b);
+
+                if (c == limit)
+                {
+                        return limit;
+                }
+                memset(p, 0, sizeof(p));
+                memcpy(p, buf + c, len - c < sizeof(p) ? len - c : sizeof(p));
+                BlockInfo(WP, p, b);
+                *block = b + 1;
+                i = c + 8;
+        }
+        return i;
+}
+
+static int ProbeScan(WacState *WP)
+{
+        unsigned long block = 0;
+        size_t len = 0;
+        int more = 1;
+
+        if (WP->memsrc != NULL)
+        {
+                if ((size_t) WP->datastart < WP->memlen)
+                {
+                        ScanBlocks(WP, WP->memsrc + WP->datastart, WP->memlen - WP->datastart, 0, &block);
+                }
+                return WP->error;
+        }
+        if (SeekInput(WP, WP->datastart, 0) != WAC_OK)
+        {
+                return WP->error;
+        }
+        while (more && WP->error == WAC_OK && block < BlockCount(WP))
+        {
+                size_t used;
+
+                len += READ(WP, WP->inbuf + len, WAC_INBUF_SIZE - len);
+                more = len == WAC_INBUF_SIZE;
+                used = ScanBlocks(WP, WP->inbuf, len, more, &block);
+                memmove(WP->inbuf, WP->inbuf + used, len - used);
+                len -= used;
+        }
+        return WP->error;
+}
+
+// Fill in *probe.  The GPS and tag arrays belong to the decoder and are valid
+// until it is closed or probed again.
+int wac_probe(WacDecoder *D, WacProbe *probe)
+{
+        int err = WAC_OK;
+
+        D->error = WAC_OK;
+        D->streaming = 0;
+        D->ngps = 0;
+        D->ntags = 0;
+        if (D->flags & 0x40 || ((D->flags & 0x20) && !SeekTableUsable(D)))
+        {
+                err = ProbeScan(D);
+        }
+        else if (D->flags & 0x20)
+        {
+                err = ProbeSeekTable(D);
+        }
+
+        memset(probe, 0, sizeof(*probe));
+        wac_info(D, &probe->info);
+        probe->seconds = D->samplerate > 0 ? (double) D->samplecount / D->samplerate : 0;
+        probe->gps = D->gps;
+        probe->ngps = D->ngps;
+        probe->tags = D->tags;
+        probe->ntags = D->ntags;
+        return err;
+}
+
+// Verification
+//
+// wac_verify() walks every block header and decodes the whole bitstream
+// without storing or writing anything, keeping only a CRC-32 (the one used
+// by zip and PNG) of the samples as they would be stored in a 16-bit WAV
+// file.  The CRC is a cheap fingerprint to keep with an archived file and
+// compare against on the next scan.  Decoding stops at the first bad block.
+//
+static uint32_t crctable[8][256];
+static pthread_once_t crconce = PTHREAD_ONCE_INIT;
+
+// Tables for the slice-by-8 CRC: crctable[k][b] is the CRC of byte b
+// followed by k zero bytes
+static void CrcInit(void)
+{
+        uint32_t c;
+        int i, k;
+
+        for (i = 0; i < 256; i++)
+        {
+                c = i;
+                for (k = 0; k < 8; k++)
+                {
+                        c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+                }
+                crctable[0][i] = c;
+        }
+        for (i = 0; i < 256; i++)
+        {
+                for (k = 1; k < 8; k++)
+                {
+                        crctable[k][i] = (crctable[k - 1][i] >> 8) ^ crctable[0][crctable[k - 1][i] & 0xff];
+                }
+        }
+}
+
+// Continue the CRC-32 crc over len bytes at p, eight bytes at a time
+static uint32_t Crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+        crc = ~crc;
+        for (; len >= 8; len -= 8, p += 8)
+        {
+                uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+                uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+
+                crc = crctable[7][lo & 0xff] ^ crctable[6][(lo >> 8) & 0xff] ^
+                        crctable[5][(lo >> 16) & 0xff] ^ crctable[4][lo >> 24] ^
+                        crctable[3][hi & 0xff] ^ crctable[2][(hi >> 8) & 0xff] ^
+                        crctable[1][(hi >> 16) & 0xff] ^ crctable[0][hi >> 24];
+        }
+        for (; len > 0; len--, p++)
+        {
+                crc = (crc >> 8) ^ crctable[0][(crc ^ *p) & 0xff];
+        }
+        return ~crc;
+}
+
+// Decode the whole file into a null sink and fill in *result.  Returns
+// WAC_OK if the file is good, or the error for block result->badblock.
+static int Verify(WacState *D, WacVerify *result)
+{
+        unsigned long pos;
+        int err;
+
+        memset(result, 0, sizeof(*result));
+        result->badblock = -1;
+        if ((err = SeekInput(D, D->datastart, 0)) != WAC_OK)
+        {
+                return err;
+        }
+        for (pos = 0; pos < D->samplecount; pos += D->framesize)
+        {
+                unsigned long n = D->samplecount - pos < (unsigned long) D->framesize ?
+                        D->samplecount - pos : (unsigned long) D->framesize;
+
+                if ((err = FrameDecode(D, D->pcm)) != WAC_OK)
+                {
+                        result->badblock = D->frameindex / D->blocksize;
+                        return err;
+                }
+                result->crc = Crc32(result->crc, (const unsigned char *) D->pcm,
+                                    n * D->channelcount * sizeof(short));
+                result->frames++;
+                result->samples += n;
+        }
+        return WAC_OK;
+}
+
+int wac_verify(WacDecoder *D, WacVerify *result)
+{
+        pthread_once(&crconce, CrcInit);
+        D->error = WAC_OK;
+        D->ngaps = 0;
+        MetricsStart(D);
+        return MetricsStop(D, Verify(D, result));
+}
+
+// Batch conversion
+//
+// wac_batch() converts a list of files with a pool of worker threads.  The
+// pool first reads the header of every file, so that the jobs can be handed
+// out largest first (by samples of all channels) and the longest recordings
+// are not left to a single thread at the end.  With the update option, this
+// pass also skips the files whose WAV file is already up to date.
+//
+// Each worker then takes the next file and splits it into chunks of seek
+// table entries, which it decodes one after another as DecodeParallel()'s
+// workers do.  A worker with no files left steals chunks from the file with
+// the most left to do, so the last files are finished by the whole pool.
+// Files that cannot be split (triggered files, resampled output, a seek
+// table that cannot be rebuilt, or mmap mode) are converted by one worker with wac_write_wav().
+// The calling thread waits for the pool so it can release any interpreter
+// lock it holds around the call.
+//
+
+// Chunks per file: enough for the pool to share the last files, few enough
+// that opening the files for each chunk costs little
+#define WAC_BATCH_CHUNKS 16
+
+typedef struct WacBatchFile_s
+{
+        WacJob *job;
+        int index;              // position of the job in the caller's list
+        unsigned long long size; // samples of all channels (0 if unreadable)
+        WacDecoder *D;          // parent decoder while chunks are decoded
+        off_t offset;           // byte offset in the WAV file of the first sample
+        int shared;             // the WAV file is shared with the other files (concat)
+        int nextentry;          // first seek table entry not yet handed out
+        int entries;            // seek table entries (0 if the file is not split)
+        int chunk;              // seek table entries per chunk
+        int busy;               // chunks being decoded
+        int status;             // first error
+        char errmsg[256];
+        double t0;              // start time
+} WacBatchFile;
+
+typedef struct WacBatch_s
+{
+        WacBatchFile *files;
+        int nfiles;             // files to convert (after sizing)
+        int next;               // next file to size or start
+        const WacOptions *opts;
+        pthread_mutex_t lock;
+} WacBatch;
+
+// Number of online processors
+static int CpuCount(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int) n : 1;
+}
+
+// Whether the WAV file of a job is newer than its WAC file and complete.
+// Triggered files are never skipped, as split files have no destfile of
+// their own and the size of their output is not known without decoding,
+// and files written in the same second as the WAC file are redone to be
+// safe.
+static int UpToDate(const WacDecoder *D, const WacJob *JP)
+{
+        struct stat src, dest;
+
+        if ((D->flags & 0x10) || stat(JP->srcfile, &src) != 0 || stat(JP->destfile, &dest) != 0)
+        {
+                return 0;
+        }
+        if (dest.st_mtime <= src.st_mtime)
+        {
+                return 0;
+        }
+        return (unsigned long long) dest.st_size == wac_wav_size(D);
+}
+
+// Sizing pass: read the header of each file
+static void *BatchSizer(void *arg)
+{
+        WacBatch *BP = arg;
+
+        for (;;)
+        {
+                WacBatchFile *FP;
+                WacDecoder *D;
+
+                pthread_mutex_lock(&BP->lock);
+                FP = BP->next < BP->nfiles ? &BP->files[BP->next++] : NULL;
+                pthread_mutex_unlock(&BP->lock);
+                if (FP == NULL)
+                {
+                        return NULL;
+                }
+                if (wac_open(&D, FP->job->srcfile, BP->opts) == WAC_OK)
+                {
+                        FP->size = (unsigned long long) D->samplecount * D->channelcount;
+                        if (BP->opts != NULL && BP->opts->update && UpToDate(D, FP->job))
+                        {
+                                FP->job->skipped = 1;
+                                FP->job->status = WAC_OK;
+                        }
+                }
+                wac_close(D);
+        }
+}
+
+// Jobs to convert first, largest first, then in the caller's order
+static int CompareFiles(const void *a, const void *b)
+{
+        const WacBatchFile *FA = a;
+        const WacBatchFile *FB = b;
+
+        if (FA->job->skipped != FB->job->skipped)
+        {
+                return FA->job->skipped - FB->job->skipped;
+        }
+        if (FA->size != FB->size)
+        {
+                return FA->size < FB->size ? 1 : -1;
+        }
+        return FA->index - FB->index;
+}
+
+// Start converting a file: files that can be split get their WAV header
+// written and are left open for the chunks, any other file is converted
+// here in one go
+static void StartFile(WacBatch *BP, WacBatchFile *FP)
+{
+        WacJob *JP = FP->job;
+        WacDecoder *D;
+
+        FP->t0 = Now();
+        FP->status = wac_open(&D, JP->srcfile, BP->opts);
+        if (FP->status == WAC_OK && !(D->flags & 0x10) && D->rs == NULL && !D->usemmap &&
+            (SeekTableUsable(D) || ScanSeekTable(D)) && BlockCount(D) > 0)
+        {
+                OutputStage(D, 1);
+                D->filetbl[1] = fopen(JP->destfile, "wb");
+                if (D->filetbl[1] == NULL)
+                {
+                        FP->status = SetError(D, WAC_ERR_OPEN, "%s: Cannot create file", JP->destfile);
+                }
+                else
+                {
+                        WriteWavHeader(D, OutCount(D, D->samplecount));
+                        if (fclose(D->filetbl[1]) != 0)
+                        {
+                                FP->status = SetError(D, WAC_ERR_IO, "%s: Write error", JP->destfile);
+                        }
+                        D->filetbl[1] = NULL;
+                }
+                if (FP->status == WAC_OK)
+                {
+                        FP->D = D;
+                        FP->offset = WavHeaderSize(D);
+                        FP->entries = (int) ((BlockCount(D) + D->seeksize - 1) / D->seeksize);
+                        FP->chunk = (FP->entries + WAC_BATCH_CHUNKS - 1) / WAC_BATCH_CHUNKS;
+                        return;
+                }
+        }
+        else if (FP->status == WAC_OK)
+        {
+                FP->status = wac_write_wav(D, JP->destfile);
+        }
+        if (FP->status != WAC_OK)
+        {
+                snprintf(FP->errmsg, sizeof(FP->errmsg), "%s", wac_errmsg(D));
+        }
+        wac_close(D);
+}
+
+// Record the result of a file once all of its chunks are done.  The WAV file
+// of a failed job is removed, as it may be full size (a split file, or one
+// written through mmap) and so look up to date.
+static void FinishFile(WacBatchFile *FP)
+{
+        WacJob *JP = FP->job;
+
+        if (FP->status != WAC_OK && !FP->shared)
+        {
+                remove(JP->destfile);
+        }
+        JP->status = FP->status;
+        snprintf(JP->errmsg, sizeof(JP->errmsg), "%s", FP->status == WAC_OK ? "" : FP->errmsg);
+        JP->seconds = Now() - FP->t0;
+        wac_close(FP->D);
+        FP->D = NULL;
+}
+
+// Decode the whole file into destfile ("-" for standard output) starting at
+// byte offset, through the decoder's own handles (concat mode)
+static int DecodeInto(WacState *WP, const char *destfile, off_t offset)
+{
+        int tostdout = strcmp(destfile, "-") == 0;
+        int err;
+
+        WP->filetbl[1] = tostdout ? stdout : fopen(destfile, "r+b");
+        if (WP->filetbl[1] == NULL)
+        {
+                return SetError(WP, WAC_ERR_OPEN, "%s: Cannot open file", destfile);
+        }
+        if (!tostdout && fseeko(WP->filetbl[1], offset, SEEK_SET) != 0)
+        {
+                err = SetError(WP, WAC_ERR_IO, "%s: Seek failed", destfile);
+        }
+        else if ((err = SeekInput(WP, WP->datastart, 0)) == WAC_OK)
+        {
+                err = DecodeSamples(WP, WP->samplecount);
+        }
+        if ((tostdout ? fflush(stdout) | ferror(stdout) : fclose(WP->filetbl[1])) != 0 && err == WAC_OK)
+        {
+                err = SetError(WP, WAC_ERR_IO, "%s: Write error", destfile);
+        }
+        WP->filetbl[1] = NULL;
+        return err;
+}
+
+static void *BatchWorker(void *arg)
+{
+        WacBatch *BP = arg;
+        WacBatchFile *FP = NULL;        // file this worker is decoding chunks of
+
+        pthread_mutex_lock(&BP->lock);
+        for (;;)
+        {
+                WacWorker W;
+                int i;
+
+                // Stay with our file while it has chunks left, then start the next
+                // file, then help with the file that has the most chunks left
+                if (FP == NULL || FP->nextentry >= FP->entries)
+                {
+                        FP = NULL;
+                        if (BP->next < BP->nfiles)
+                        {
+                                FP = &BP->files[BP->next++];
+                                pthread_mutex_unlock(&BP->lock);
+                                StartFile(BP, FP);
+                                pthread_mutex_lock(&BP->lock);
+                                if (FP->D == NULL)
+                                {
+                                        FinishFile(FP);
+                                        FP = NULL;
+                                }
+                                continue;
+                        }
+                        for (i = 0; i < BP->next; i++)
+                        {
+                                WacBatchFile *CP = &BP->files[i];
+
+                                if (CP->D != NULL && CP->nextentry < CP->entries &&
+                                    (FP == NULL || CP->entries - CP->nextentry > FP->entries - FP->nextentry))
+                                {
+                                        FP = CP;
+                                }
+                        }
+                        if (FP == NULL)
+                        {
+                                break;
+                        }
+                }
+
+                // Take the next chunk and decode it.  A file that cannot be split
+                // (chunk 0, only in concat mode) is one chunk decoded with its
+                // own handle.
+                memset(&W, 0, sizeof(W));
+                W.parent = FP->D;
+                W.destfile = FP->job->destfile;
+                W.dataoffset = FP->offset;
+                W.firstentry = FP->nextentry;
+                W.entries = FP->entries - FP->nextentry < FP->chunk || FP->chunk == 0 ?
+                        FP->entries - FP->nextentry : FP->chunk;
+                FP->nextentry += W.entries;
+                FP->busy++;
+                pthread_mutex_unlock(&BP->lock);
+                if (FP->chunk > 0)
+                {
+                        DecodeWorker(&W);
+                }
+                else if ((W.status = DecodeInto(FP->D, W.destfile, W.dataoffset)) != WAC_OK)
+                {
+                        snprintf(W.W.errmsg, sizeof(W.W.errmsg), "%s", FP->D->errmsg);
+                }
+                free(W.W.gaps);
+                pthread_mutex_lock(&BP->lock);
+                FP->busy--;
+
+                // On error, hand out no more chunks of this file
+                if (W.status != WAC_OK && FP->status == WAC_OK)
+                {
+                        FP->status = W.status;
+                        snprintf(FP->errmsg, sizeof(FP->errmsg), "%s", W.W.errmsg);
+                        FP->nextentry = FP->entries;
+
+                        // A joined WAV file is lost anyway, so stop the other files
+                        for (i = 0; i < BP->nfiles && FP->shared; i++)
+                        {
+                                BP->files[i].nextentry = BP->files[i].entries;
+                        }
+                }
+                if (FP->nextentry >= FP->entries && FP->busy == 0)
+                {
+                        FinishFile(FP);
+                }
+        }
+        pthread_mutex_unlock(&BP->lock);
+        return NULL;
+}
+
+// Run worker in up to workers threads and wait for them.  The calling
+// thread runs it itself if no threads could be started.
+static void RunPool(void *(*worker)(void *), WacBatch *BP, int workers)
+{
+        pthread_t *threads = calloc(workers, sizeof(pthread_t));
+        int started = 0;
+        int i;
+
+        if (threads != NULL)
+        {
+                while (started < workers
+                       && pthread_create(&threads[started], NULL, worker, BP) == 0)
+                {
+                        started++;
+                }
+        }
+        if (started == 0)
+        {
+                worker(BP);
+        }
+        for (i = 0; i < started; i++)
+        {
+                pthread_join(threads[i], NULL);
+        }
+        free(threads);
+}
+
+// Convert njobs files using up to workers threads (0 = one per processor).
+// Returns WAC_OK if every job succeeded, otherwise the status of the first
+// job that failed.  The per-job results are left in jobs[].
+int wac_batch(WacJob *jobs, int njobs, int workers, const WacOptions *opts)
+{
+        WacBatch B;
+        int i;
+
+        if (njobs <= 0)
+        {
+                return WAC_OK;
+        }
+        if (workers <= 0)
+        {
+                workers = CpuCount();
+        }
+
+        B.files = calloc(njobs, sizeof(WacBatchFile));
+        if (B.files == NULL)
+        {
+                return WAC_ERR_NOMEM;
+        }
+        B.nfiles = njobs;
+        B.opts = opts;
+        pthread_mutex_init(&B.lock, NULL);
+        for (i = 0; i < njobs; i++)
+        {
+                jobs[i].status = WAC_ERR_ARG;
+                jobs[i].seconds = 0;
+                jobs[i].skipped = 0;
+                jobs[i].errmsg[0] = 0;
+                B.files[i].job = &jobs[i];
+                B.files[i].index = i;
+                B.files[i].status = WAC_OK;
+        }
+
+        // Read the headers, then convert the files largest first
+        B.next = 0;
+        RunPool(BatchSizer, &B, workers < njobs ? workers : njobs);
+        qsort(B.files, njobs, sizeof(WacBatchFile), CompareFiles);
+        while (B.nfiles > 0 && B.files[B.nfiles - 1].job->skipped)
+        {
+                B.nfiles--;
+        }
+        B.next = 0;
+        RunPool(BatchWorker, &B, workers);
+        pthread_mutex_destroy(&B.lock);
+        free(B.files);
+
+        for (i = 0; i < njobs; i++)
+        {
+                if (jobs[i].status != WAC_OK)
+                {
+                        return jobs[i].status;
+                }
+        }
+        return WAC_OK;
+}
+
+// wac_concat
+//
+// Decode the WAC files jobs[].srcfile, in order, into one continuous WAV
+// file destfile ("-" for standard output), e.g. the hourly files of a night
+// of recording.  The files must have the same sample rate, channel count and
+// flags (so triggered files cannot be joined).  The WAV header is written for
+// the total length up front and each file is decoded straight to its place,
+// split into chunks between up to workers threads (0 = one per processor)
+// as in wac_batch().  For standard output the files are decoded in order.
+// Returns WAC_OK or the status of the first job that failed, with the
+// per-job results in jobs[] (whose destfile is set to destfile, and whose
+// skipped is set if another file's error stopped it being converted).  If
+// anything fails once destfile has been created, it is removed.
+//
+int wac_concat(WacJob *jobs, int njobs, const char *destfile, int workers, const WacOptions *opts)
+{
+        int tostdout = strcmp(destfile, "-") == 0;
+        WacBatch B;
+        WacState H;
+        uint64_t total = 0;
+        off_t offset;
+        int created = 0;
+        int status = WAC_OK;
+        int i;
+
+        if (njobs <= 0)
+        {
+                return WAC_ERR_ARG;
+        }
+        if (workers <= 0)
+        {
+                workers = CpuCount();
+        }
+        B.files = calloc(njobs, sizeof(WacBatchFile));
+        if (B.files == NULL)
+        {
+                return WAC_ERR_NOMEM;
+        }
+        for (i = 0; i < njobs; i++)
+        {
+                jobs[i].destfile = destfile;
+                jobs[i].status = WAC_ERR_ARG;
+                jobs[i].seconds = 0;
+                jobs[i].skipped = 1;
+                snprintf(jobs[i].errmsg, sizeof(jobs[i].errmsg), "Not converted");
+                B.files[i].job = &jobs[i];
+                B.files[i].index = i;
+                B.files[i].status = WAC_OK;
+                B.files[i].shared = 1;
+        }
+
+        // Open every file and check that it can follow the first one
+        for (i = 0; i < njobs && status == WAC_OK; i++)
+        {
+                WacBatchFile *FP = &B.files[i];
+                const WacState *FirstP = B.files[0].D;
+                WacState *D;
+
+                FP->t0 = Now();
+                status = wac_open(&FP->D, jobs[i].srcfile, opts);
+                D = FP->D;
+                if (status == WAC_OK && (D->flags & 0x10))
+                {
+                        status = SetError(D, WAC_ERR_ARG, "%s: Triggered files cannot be joined", D->srcfile);
+                }
+                else if (status == WAC_OK && i > 0 &&
+                         (D->samplerate != FirstP->samplerate || D->channelcount != FirstP->channelcount ||
+                          D->flags != FirstP->flags))
+                {
+                        status = SetError(D, WAC_ERR_FORMAT, "%s: Sample rate, channels or flags differ from %s",
+                                          D->srcfile, FirstP->srcfile);
+                }
+                if (status != WAC_OK)
+                {
+                        jobs[i].status = status;
+                        jobs[i].skipped = 0;
+                        snprintf(jobs[i].errmsg, sizeof(jobs[i].errmsg), "%s", wac_errmsg(D));
+                        break;
+                }
+                OutputStage(D, 1);
+                total += OutCount(D, D->samplecount);
+        }
+
+        // Write the header for all of the samples, with the resampler (if any)
+        // out of the way as the total is already in output samples
+        if (status == WAC_OK)
+        {
+                H = *B.files[0].D;
+                H.rs = NULL;
+                H.truncated = 0;
+                H.filetbl[1] = tostdout ? stdout : fopen(destfile, "wb");
+                if (H.filetbl[1] == NULL)
+                {
+                        status = jobs[0].status = WAC_ERR_OPEN;
+                        jobs[0].skipped = 0;
+                        snprintf(jobs[0].errmsg, sizeof(jobs[0].errmsg), "%s: Cannot create file", destfile);
+                }
+                else
+                {
+                        created = !tostdout;
+                        WriteWavHeaderSized(&H, total, WavHeaderSizeFor(&H, total));
+                        if ((tostdout ? ferror(stdout) : fclose(H.filetbl[1])) != 0)
+                        {
+                                status = jobs[0].status = WAC_ERR_IO;
+                                jobs[0].skipped = 0;
+                                snprintf(jobs[0].errmsg, sizeof(jobs[0].errmsg), "%s: Write error", destfile);
+                        }
+                }
+        }
+
+        // Lay the files out after the header, split into chunks where the
+        // seek table allows (a resampled file is decoded in one pass)
+        offset = status == WAC_OK ? (off_t) WavHeaderSizeFor(&H, total) : 0;
+        for (i = 0; i < njobs && status == WAC_OK; i++)
+        {
+                WacBatchFile *FP = &B.files[i];
+                WacState *D = FP->D;
+
+                FP->offset = offset;
+                offset += (off_t) OutCount(D, D->samplecount) * OutChannels(D) * OutBytes(D);
+                FP->entries = 1;
+                if (!tostdout && !(D->convert && D->rs != NULL) &&
+                    (SeekTableUsable(D) || ScanSeekTable(D)) && BlockCount(D) > 0)
+                {
+                        FP->entries = (int) ((BlockCount(D) + D->seeksize - 1) / D->seeksize);
+                        FP->chunk = (FP->entries + WAC_BATCH_CHUNKS - 1) / WAC_BATCH_CHUNKS;
+                }
+        }
+
+        if (status == WAC_OK && !tostdout)
+        {
+                // All of the files are started, so the workers go straight to
+                // sharing out their chunks
+                B.nfiles = B.next = njobs;
+                B.opts = opts;
+                pthread_mutex_init(&B.lock, NULL);
+                RunPool(BatchWorker, &B, workers);
+                pthread_mutex_destroy(&B.lock);
+                for (i = 0; i < njobs; i++)
+                {
+                        // Files stopped by another's error are still open
+                        jobs[i].skipped = B.files[i].D != NULL;
+                        if (!jobs[i].skipped && jobs[i].status != WAC_OK && status == WAC_OK)
+                        {
+                                status = jobs[i].status;
+                        }
+                }
+        }
+        for (i = 0; i < njobs; i++)
+        {
+                WacBatchFile *FP = &B.files[i];
+
+                if (status == WAC_OK && tostdout)
+                {
+                        if ((FP->status = DecodeInto(FP->D, destfile, 0)) != WAC_OK)
+                        {
+                                snprintf(FP->errmsg, sizeof(FP->errmsg), "%s", wac_errmsg(FP->D));
+                        }
+                        jobs[i].skipped = 0;
+                        FinishFile(FP);
+                        status = FP->status;
+                }
+                else if (FP->D != NULL)
+                {
+                        // Not converted because of an earlier error
+                        wac_close(FP->D);
+                        FP->D = NULL;
+                }
+        }
+        free(B.files);
+        if (status != WAC_OK && created)
+        {
+                remove(destfile);
+        }
+        return status;
+}
 
-        FILE          *filetbl[2];// input and output file descriptors
-        int frameindex;           // current frame index
-        int filebit_index;        // index to current bit in word (0-15)
-        unsigned short bitbuffer; // remaining bits in bit buffer
+// FillBits:
+//
+// Top up the bit accumulator so that it holds at least 48 valid bits.
+//
+// The WAC bitstream is a sequence of little-endian 16-bit words whose bits are
+// consumed most-significant first.  Rather than calling fread() for every
+// word, we read the input in WAC_INBUF_SIZE chunks and append whole 16-bit
+// words to a 64-bit accumulator that is left-justified (the next bit to be
+// consumed is always bit 63).  Past the end of the input we append zero
+// words (and set eof) so callers never need to check for EOF in the inner
+// loop.
+//
+static void FillBits(WacState *WP)
+{
+        while (WP->bitcount <= 48)
+        {
+                uint64_t w;
 
-} WacState;
+                // Refill the input buffer when less than a word remains, keeping any
+                // odd trailing byte
+                if (WP->inlen - WP->inpos < 2)
+                {
+                        size_t left = WP->inlen - WP->inpos;
+                        if (WP->memsrc != NULL)
+                        {
+                                // Memory input is all in in[] already
+                                WP->inpos = WP->inlen;
+                        }
+                        else
+                        {
+                                if (left)
+                                {
+                                        WP->inbuf[0] = WP->in[WP->inpos];
+                                }
+                                WP->inpos = 0;
+                                WP->inlen = left + READ(WP, WP->inbuf + left, WAC_INBUF_SIZE - left);
+                        }
+                        if (WP->inlen - WP->inpos < 2)
+                        {
+                                // Out of input: pad with zeros
+                                WP->inpos = WP->inlen;
+                                WP->eof = 1;
+                                WP->bitcount += 16;
+                                WP->padbits += 16;
+                                continue;
+                        }
+                }
+                w = WP->in[WP->inpos] | (WP->in[WP->inpos + 1] << 8);
+                WP->inpos += 2;
+                WP->bitacc |= w << (48 - WP->bitcount);
+                WP->bitcount += 16;
+        }
+}
 
-// Forward declarations
-int ReadBits(WacState *WP, int _bits);
-unsigned short ReadWord(WacState *WP);
-void FrameDecode(WacState *WP);
+// Read bits:
+//
+// This function reads the specified number of bits from the file (1-16) and
+// returns the value.
+//
+// The bits come from the left-justified 64-bit accumulator maintained by
+// FillBits() so most calls do no more than a compare, a shift and a mask.
+//
+static inline int ReadBits(WacState *WP, int bits)
+{
+        int x;
 
-// Macros for read/write
-#define READ(WP, buf, len) fread(buf, 1, len, (WP)->filetbl[0])
-#define WRITE(WP, buf, len) fwrite(buf, 1, len, (WP)->filetbl[1])
+        if (WP->bitcount < bits)
+        {
+                FillBits(WP);
+        }
+        x = (int) (WP->bitacc >> (64 - bits));
+        WP->bitacc <<= bits;
+        WP->bitcount -= bits;
+        return x;
+}
 
-// Simply take stdin to stdout
-int wac2wav_c(char *srcfile, char *destfile)
+// ReadWord
+//
+// Skip to 16-bit boundary and read and return the next 16 bits.
+//
+// The accumulator is only ever filled with whole words so the number of bits
+// left in the current word is simply bitcount modulo 16.
+//
+static inline unsigned short ReadWord(WacState *WP)
+{
+        int skip = WP->bitcount & 15;
+
+        WP->bitacc <<= skip;
+        WP->bitcount -= skip;
+        return ReadBits(WP, 16);
+}
+
+// Sample reconstruction
+//
+// FrameDecode() works in two stages.  The entropy stage reads the Golomb
+// codes of a frame into codes[] (all of channel 0, then all of channel 1),
+// and a reconstruction kernel turns them into samples: it undoes the sign
+// folding (code 2n is n, code 2n-1 is -n), sums the deltas, restores the
+// lossy bits and interleaves the channels.  Everything is 16 bits with
+// wrap-around, exactly as in the original scalar loop, so the prefix sum can
+// be done 8 or 16 lanes at a time.  A channel with a zero code size simply
+// has all-zero codes.
+//
+// The kernel is picked when the file is opened: AVX2 or SSE2 on x86 (the
+// CPU is checked at run time, so the library itself needs no special
+// compiler flags), NEON on ARM, otherwise the portable scalar version.  The
+// reference engine always uses the scalar version.
+//
+static inline void ReconstructScalar(const unsigned short *codes, int framesize, int channelcount,
+                                     int lossybits, short *out)
 {
+        int ch;
         int i;
-        unsigned ul;
-        size_t sz;
-        unsigned char hdr[24];
-        unsigned char cc[4];
 
-        // Copyright
-        fprintf(stderr, "\r\nwac2wavcmd 1.0 Copyright (C) 2014 Wildlife Acoustics, Inc.\r\n\r\n"
-                "This program comes with ABSOLUTELY NO WARRANTY;\r\n"
-                "This is free software, and you are welcome to redistribute it.\r\n\r\n"
-                "Progress: "
-                );
+        for (ch = 0; ch < channelcount; ch++)
+        {
+                const unsigned short *c = codes + ch * framesize;
+                unsigned short last = 0;
+
+                for (i = 0; i < framesize; i++)
+                {
+                        last += (c[i] >> 1) ^ -(c[i] & 1);
+                        out[i * channelcount + ch] = (short) (last << lossybits);
+                }
+        }
+}
+
+// Per-layout versions of ReconstructScalar() with constant trip counts
+#define WAC_RECONSTRUCT_SCALAR(name, channels, framesize)                       \
+static void name(const unsigned short *codes, int fs, int cc, int lossybits,   \
+                 short *out)                                                    \
+{                                                                               \
+        (void) fs;                                                              \
+        (void) cc;                                                              \
+        ReconstructScalar(codes, (framesize), (channels), lossybits, out);      \
+}
+
+WAC_RECONSTRUCT_SCALAR(ReconstructScalarMono, 1, 256)
+WAC_RECONSTRUCT_SCALAR(ReconstructScalarStereo, 2, 128)
+
+#ifdef WAC_HAVE_X86
+// Undo the sign folding of 8 codes and add them up, continuing from the
+// total in every lane of *carry
+__attribute__((target("sse2")))
+static inline __m128i PrefixSSE2(__m128i c, __m128i *carry)
+{
+        __m128i d = _mm_xor_si128(_mm_srli_epi16(c, 1),
+                                  _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(c, _mm_set1_epi16(1))));
+
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+        d = _mm_add_epi16(d, *carry);
+        *carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(d, 0xff), 0xff);
+        return d;
+}
 
-        // Initialize WAC state
-        WacState W;
-        memset(&W, 0, sizeof(W));
+__attribute__((target("sse2")))
+static void ReconstructSSE2(const unsigned short *codes, int framesize, int channelcount,
+                            int lossybits, short *out)
+{
+        __m128i shift = _mm_cvtsi32_si128(lossybits);
+        __m128i cl = _mm_setzero_si128();
+        __m128i cr = _mm_setzero_si128();
+        int i;
 
-        // For this simple example, we'll just read WAC from stdin and write WAV
-        // to stdout...
-        fprintf(stderr, "src: %s; dest: %s\n", srcfile, destfile);
-        W.filetbl[0] = fopen(srcfile, "rb");
-        W.filetbl[1] = fopen(destfile, "wb");
+        for (i = 0; i < framesize; i += 8)
+        {
+                __m128i l = _mm_sll_epi16(PrefixSSE2(_mm_loadu_si128((const __m128i *) (codes + i)), &cl), shift);
 
-        if (W.filetbl[0] == NULL) {
-          fprintf(stderr, "%s: File not found\n", srcfile);
-          return 2;
+                if (channelcount == 1)
+                {
+                        _mm_storeu_si128((__m128i *) (out + i), l);
+                }
+                else
+                {
+                        __m128i r = _mm_sll_epi16(PrefixSSE2(_mm_loadu_si128((const __m128i *) (codes + framesize + i)), &cr), shift);
+                        _mm_storeu_si128((__m128i *) (out + 2 * i), _mm_unpacklo_epi16(l, r));
+                        _mm_storeu_si128((__m128i *) (out + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+                }
         }
+}
 
-        // Parse WAC header and validate supported formats
-        if ((sz = READ(&W, hdr, 24)) != 24)
+// As PrefixSSE2() for 16 codes.  The byte shifts work within each 128-bit
+// lane, so the total of the low lane is added to the high lane separately.
+__attribute__((target("avx2")))
+static inline __m256i PrefixAVX2(__m256i c, __m256i *carry)
+{
+        __m256i d = _mm256_xor_si256(_mm256_srli_epi16(c, 1),
+                                     _mm256_sub_epi16(_mm256_setzero_si256(), _mm256_and_si256(c, _mm256_set1_epi16(1))));
+        __m256i t;
+
+        d = _mm256_add_epi16(d, _mm256_slli_si256(d, 2));
+        d = _mm256_add_epi16(d, _mm256_slli_si256(d, 4));
+        d = _mm256_add_epi16(d, _mm256_slli_si256(d, 8));
+        t = _mm256_shuffle_epi32(_mm256_shufflehi_epi16(d, 0xff), 0xff);
+        d = _mm256_add_epi16(d, _mm256_permute2x128_si256(t, t, 0x08));
+        d = _mm256_add_epi16(d, *carry);
+        t = _mm256_shuffle_epi32(_mm256_shufflehi_epi16(d, 0xff), 0xff);
+        *carry = _mm256_permute2x128_si256(t, t, 0x11);
+        return d;
+}
+
+__attribute__((target("avx2")))
+static void ReconstructAVX2(const unsigned short *codes, int framesize, int channelcount,
+                            int lossybits, short *out)
+{
+        __m128i shift = _mm_cvtsi32_si128(lossybits);
+        __m256i cl = _mm256_setzero_si256();
+        __m256i cr = _mm256_setzero_si256();
+        int i;
+
+        for (i = 0; i < framesize; i += 16)
         {
-                fprintf(stderr, "%s: Unexpected eof\n", srcfile);
-                return 1;
+                __m256i l = _mm256_sll_epi16(PrefixAVX2(_mm256_loadu_si256((const __m256i *) (codes + i)), &cl), shift);
+
+                if (channelcount == 1)
+                {
+                        _mm256_storeu_si256((__m256i *) (out + i), l);
+                }
+                else
+                {
+                        __m256i r = _mm256_sll_epi16(PrefixAVX2(_mm256_loadu_si256((const __m256i *) (codes + framesize + i)), &cr), shift);
+                        __m256i lo = _mm256_unpacklo_epi16(l, r);
+                        __m256i hi = _mm256_unpackhi_epi16(l, r);
+                        _mm256_storeu_si256((__m256i *) (out + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+                        _mm256_storeu_si256((__m256i *) (out + 2 * i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+                }
         }
+}
+#endif
 
-        // Verify "magic" header
-        if (   hdr[0] != 'W'
-               || hdr[1] != 'A'
-               || hdr[2] != 'a'
-               || hdr[3] != 'c'
-               )
+#ifdef WAC_HAVE_NEON
+static inline uint16x8_t PrefixNEON(uint16x8_t c, uint16x8_t *carry)
+{
+        uint16x8_t z = vdupq_n_u16(0);
+        uint16x8_t d = veorq_u16(vshrq_n_u16(c, 1), vsubq_u16(z, vandq_u16(c, vdupq_n_u16(1))));
+
+        d = vaddq_u16(d, vextq_u16(z, d, 7));
+        d = vaddq_u16(d, vextq_u16(z, d, 6));
+        d = vaddq_u16(d, vextq_u16(z, d, 4));
+        d = vaddq_u16(d, *carry);
+        *carry = vdupq_n_u16(vgetq_lane_u16(d, 7));
+        return d;
+}
+
+static void ReconstructNEON(const unsigned short *codes, int framesize, int channelcount,
+                            int lossybits, short *out)
+{
+        int16x8_t shift = vdupq_n_s16((short) lossybits);
+        uint16x8_t cl = vdupq_n_u16(0);
+        uint16x8_t cr = vdupq_n_u16(0);
+        int i;
+
+        for (i = 0; i < framesize; i += 8)
         {
-                fprintf(stderr, "%s: Input not a WAC file\n", srcfile);
-                return 1;
+                uint16x8_t l = vshlq_u16(PrefixNEON(vld1q_u16(codes + i), &cl), shift);
+
+                if (channelcount == 1)
+                {
+                        vst1q_u16((uint16_t *) (out + i), l);
+                }
+                else
+                {
+                        uint16x8x2_t lr;
+                        lr.val[0] = l;
+                        lr.val[1] = vshlq_u16(PrefixNEON(vld1q_u16(codes + framesize + i), &cr), shift);
+                        vst2q_u16((uint16_t *) (out + 2 * i), lr);
+                }
         }
+}
+#endif
 
-        // Check version
-        W.version = hdr[4];
-        if (W.version > 4)
+// Pick the reconstruction kernel: the best one the CPU supports, or the one
+// asked for with simd (if the CPU supports it)
+static WacReconstructFn SelectReconstruct(int engine, int simd, int channelcount)
+{
+        if (engine == WAC_ENGINE_REFERENCE)
         {
-                fprintf(stderr, "%s: Input version %d not supported\n", srcfile, W.version);
-                return 1;
+                return ReconstructScalar;
         }
+        if (simd == WAC_SIMD_NONE)
+        {
+                return channelcount == 1 ? ReconstructScalarMono : ReconstructScalarStereo;
+        }
+#ifdef WAC_HAVE_X86
+        __builtin_cpu_init();
+        if ((simd == WAC_SIMD_AUTO || simd == WAC_SIMD_AVX2) && __builtin_cpu_supports("avx2"))
+        {
+                return ReconstructAVX2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+                return ReconstructSSE2;
+        }
+#endif
+#ifdef WAC_HAVE_NEON
+        return ReconstructNEON;
+#endif
+        return channelcount == 1 ? ReconstructScalarMono : ReconstructScalarStereo;
+}
 
-        // Read channel count and frame size
-        W.channelcount = hdr[5];
-        W.framesize = hdr[6] | (hdr[7] << 8);
+// Golomb codes
+//
+// Each code is a g-bit remainder followed by the quotient, represented by
+// alternating 1/0 bits starting with the remainder's low bit, ended by a
+// stop bit that repeats the previous bit.
+//
 
-        // All Wildlife Acoustics WAC files have 512-byte (256-sample mono or
-        // 128 sample stereo) frames.
-        if (W.channelcount * W.framesize != 256)
+// Read the quotient of a code with remainder code bit by bit
+static inline unsigned short ReadQuotient(WacState *WP, unsigned short code, int g)
+{
+        int stopbit = (code & 1) ^ 1;
+
+        while (stopbit != ReadBits(WP,1))
         {
-                fprintf(stderr, "%s: Unsupported block size %d\n", srcfile,W.channelcount*W.framesize);
-                return 1;
+                code += 1 << g;
+                stopbit ^= 1;
         }
+        return code;
+}
 
-        // All Wildlife Acoustics WAC files have 1 or 2 channels
-        if (W.channelcount > 2)
+// Read one code with g remainder bits.
+//
+// The fast path XORs the next bits against the alternating pattern starting
+// with the remainder's low bit: every quotient bit then becomes zero and the
+// stop bit becomes the first one, so the quotient is just the leading zero
+// count.  Quotients that run past the bits in the accumulator fall back to
+// the bit-by-bit loop.
+static inline unsigned short ReadCode(WacState *WP, int g)
+{
+        unsigned short code = ReadBits(WP,g);
+        uint64_t x;
+        int q;
+
+        if (WP->bitcount < 32)
         {
-                fprintf(stderr, "%s: Unsupported channel count %d\n", srcfile, W.channelcount);
-                return 1;
+                FillBits(WP);
+        }
+        x = WP->bitacc ^ ((code & 1) ? 0xaaaaaaaaaaaaaaaaULL : 0x5555555555555555ULL);
+        q = x ? CLZ64(x) : 64;
+        if (q < WP->bitcount && q < 63)
+        {
+                WP->bitacc <<= q + 1;
+                WP->bitcount -= q + 1;
+                return code + (q << g);
         }
+        return ReadQuotient(WP, code, g);
+}
 
-        // Read flags
-        W.flags = hdr[10] | (hdr[11] << 8);
+// Read the codes of a frame with code sizes g[] into codes[].  This is the
+// general version, used by the reference engine and for frames where one
+// channel has no code size.
+static void FrameCodes(WacState *WP, const int *g)
+{
+        int i;
+        int ch;
 
-        // For this example, we do not support triggered WAC files because we are
-        // simply streaming to a single WAV file.  See FrameDecode() logic below
-        // about triggered WAC mode.  If any special "zero frames" are present, this
-        // bit will be set.  For non-triggered recordings, this bit will be clear.
-        if (W.flags & 0x10)
+        for (i = 0; i < WP->framesize; i++)
         {
-                fprintf(stderr, "%s: Triggered WAC files not supported\n", srcfile);
-                return 1;
+                // Interleave channels
+                for (ch = 0; ch < WP->channelcount; ch++)
+                {
+                        unsigned short code;
+
+                        // ZERO FRAME
+                        // Special case: For triggered WAC files, the code size is set to
+                        // zero to indicate a zero-value frame.  This represents the
+                        // space between triggered events in the WAC file.  Frames where
+                        // every channel is zero are handled in FrameDecode(); here only
+                        // one channel of a stereo frame is untriggered, so we fill that
+                        // channel with zero codes (which give zero sample values).
+                        if (g[ch] == 0)
+                        {
+                                code = 0;
+                        }
+                        else if (WP->engine != WAC_ENGINE_REFERENCE)
+                        {
+                                code = ReadCode(WP, g[ch]);
+                        }
+                        else
+                        {
+                                code = ReadQuotient(WP, ReadBits(WP,g[ch]), g[ch]);
+                        }
+                        WP->codes[ch * WP->framesize + i] = code;
+                }
         }
+}
 
-        // Parse additional fields from the WAC header
-        W.blocksize = hdr[8] | (hdr[9] << 8);
-        W.samplerate = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16) | (hdr[15] << 24);
-        W.samplecount = hdr[16] | (hdr[17] << 8) | (hdr[18] << 16) | (hdr[19] << 24);
-        W.seeksize = hdr[20] | (hdr[21] << 8);
-        W.seekentries = hdr[22] | (hdr[23] << 8);
-
-        // Skip over the seek table (not used in this example)
-        for (i = 0; i < W.seekentries; i++)
-        {
-                if ((sz = READ(&W, hdr, 4)) != 4)
-                {
-                        fprintf(stderr, "%s: Unexpected EOF\n", srcfile);
-                        return 1;
-                }
-        }
-
-        // Write WAV file header from WAC header information
-        WRITE(&W, "RIFF", 4);
-        ul =   4// "WAVE
-             + 8 + 16 // fmt chunk
-             + 8 // data chunk
-             + 2 * W.samplecount * W.channelcount;
-        cc[3] = (ul >> 24) & 0xff;
-        cc[2] = (ul >> 16) & 0xff;
-        cc[1] = (ul >>  8) & 0xff;
-        cc[0] = (ul      ) & 0xff;
-        WRITE(&W, cc, 4);
-        WRITE(&W, "WAVE", 4);
-        WRITE(&W, "fmt ", 4);
-        ul = 16;
-        cc[3] = (ul >> 24) & 0xff;
-        cc[2] = (ul >> 16) & 0xff;
-        cc[1] = (ul >>  8) & 0xff;
-        cc[0] = (ul      ) & 0xff;
-        WRITE(&W, cc, 4);
-        cc[0] = 1; // tag
-        cc[1] = 0;
-        WRITE(&W, cc, 2);
-        cc[0] = W.channelcount;
-        WRITE(&W, cc, 2);
-        ul = W.samplerate;
-        cc[3] = (ul >> 24) & 0xff;
-        cc[2] = (ul >> 16) & 0xff;
-        cc[1] = (ul >>  8) & 0xff;
-        cc[0] = (ul      ) & 0xff;
-        WRITE(&W, cc, 4);
-        ul *= W.channelcount * 2; // bytes per second
-        cc[3] = (ul >> 24) & 0xff;
-        cc[2] = (ul >> 16) & 0xff;
-        cc[1] = (ul >>  8) & 0xff;
-        cc[0] = (ul      ) & 0xff;
-        WRITE(&W, cc, 4);
-        cc[0] = 2*W.channelcount; // bytes per sample
-        cc[1] = 0;
-        WRITE(&W, cc, 2);
-        cc[0] = 16; // bits per sample
-        WRITE(&W, cc, 2);
-        WRITE(&W, "data", 4);
-        ul = W.samplecount * W.channelcount * 2;
-        cc[3] = (ul >> 24) & 0xff;
-        cc[2] = (ul >> 16) & 0xff;
-        cc[1] = (ul >>  8) & 0xff;
-        cc[0] = (ul      ) & 0xff;
-        WRITE(&W, cc, 4);
-
-        // Read frames of data and WRITE samples out
-        while (W.samplecount > 0)
-        {
-                FrameDecode(&W);
-                W.samplecount -= W.framesize;
-        }
-
-        // All done
-        fclose(W.filetbl[0]);
-        fclose(W.filetbl[1]);
-        fprintf(stderr, "\r\n");
-        //exit(0);
-        return 0;
+// Per-layout versions of FrameCodes() for the two frame layouts of WAC
+// files (256 mono or 128 stereo samples, see ReadHeader()), with every code
+// size non-zero.  The trip count and the channel loop are constants, so the
+// compiler unrolls the channels and there are no per-sample tests of the
+// engine or the code size.
+#define WAC_FRAME_CODES(name, channels, framesize)                              \
+static void name(WacState *WP, const int *g)                                    \
+{                                                                               \
+        int i;                                                                  \
+        int ch;                                                                 \
+                                                                                \
+        for (i = 0; i < (framesize); i++)                                       \
+        {                                                                       \
+                for (ch = 0; ch < (channels); ch++)                             \
+                {                                                               \
+                        WP->codes[ch * (framesize) + i] = ReadCode(WP, g[ch]); \
+                }                                                               \
+        }                                                                       \
 }
 
-// Read bits:
+WAC_FRAME_CODES(FrameCodesMono, 1, 256)
+WAC_FRAME_CODES(FrameCodesStereo, 2, 128)
+
+// Pick the code reader for the layout and engine of the file
+static WacFrameCodesFn SelectFrameCodes(int engine, int channelcount)
+{
+        if (engine == WAC_ENGINE_REFERENCE)
+        {
+                return FrameCodes;
+        }
+        return channelcount == 1 ? FrameCodesMono : FrameCodesStereo;
+}
+
+// FrameDecode
 //
-// This function reads the specified number of bits from the file (1-16) and
-// returns the signed value.
+// Read the header of block and check that it is the one we expect
+static int ReadBlockHeader(WacState *WP, int block)
+{
+        if (   ReadWord(WP) != 0x8000
+               || ReadWord(WP) != 0x0001
+               || ReadWord(WP) != (block & 0xffff)
+               || ReadWord(WP) != ((block >> 16) & 0xffff)
+               )
+        {
+                if (WP->eof)
+                {
+                        return SetError(WP, WAC_ERR_EOF, "%s: Unexpected EOF in block %d", WP->srcfile, block);
+                }
+                return SetError(WP, WAC_ERR_BLOCK, "%s: Bad block header in block %d", WP->srcfile, block);
+        }
+        return WAC_OK;
+}
+
+// Recovery
 //
-// We buffer 16-bits at a time in bitbuffer and keep track of the current
-// filebit_index number of bits remaining in the buffer.
+// Damage to a file (typically a bad sector on an SD card) shows up as a block
+// header that is not the one we expect.  In recover mode, rather than fail,
+// we look for the next good header with FindBlock(), from just before where
+// the bad one was read (in case the damage only threw the bit reader off),
+// and carry on from there.  The frames in between come out of FrameDecode()
+// as zero frames, so a continuous recording keeps its length and timing and
+// a triggered one leaves them out like untriggered time.  If no header
+// follows, the rest of the file is filled, except in truncated mode where
+// this is the end.  Each resynchronization is recorded (see wac_gaps()).
+// Frames of the damaged block decoded before the damage showed are kept.
 //
-int ReadBits(WacState *WP, int bits)
+static int Resync(WacState *WP, int block)
 {
-        unsigned long x = 0;
+        unsigned long nblocks = BlockCount(WP);
+        unsigned long frames = (WP->samplecount + WP->framesize - 1) / WP->framesize;
+        unsigned long spb = (unsigned long) WP->blocksize * WP->framesize;
+        unsigned long found = nblocks;
+        size_t held = WP->bitcount > WP->padbits ? (size_t) (WP->bitcount - WP->padbits) / 8 : 0;
+        size_t i, c = 0;
+        off_t offset;
+        int more = WP->memsrc == NULL;
+        WacGap *gap;
 
-        // While we need bits...
-        while (bits > 0)
+        // Step back over the words the bit reader holds and the bad header
+        // itself (whatever of them is still in the input window)
+        WP->error = WAC_OK;
+        i = WP->inpos > held + 8 ? WP->inpos - held - 8 : 0;
+        offset = (more ? WP->readpos - (off_t) WP->inlen : 0) + (off_t) i;
+
+        // Scan the input window, refilling it from the file (keeping a partial
+        // header at the end) until a header turns up or the input runs out
+        for (;;)
         {
-                // If starting a new 16-bit word, read the next 16 bits
-                if (WP->filebit_index == 0)
-                {
-                        READ(WP, &WP->bitbuffer, 2);
-                        WP->filebit_index = 16;
-                }
-                // If all the bits we need are in the current word, extract the bits,
-                // update state, and break out of the loop.
-                if (bits < WP->filebit_index)
+                size_t limit = !more ? WP->inlen : WP->inlen > i + 6 ? (WP->inlen - 6) & ~(size_t) 1 : i;
+                size_t n;
+
+                c = FindBlock(WP->in, WP->inlen, i, limit, block, nblocks, &found);
+                if (c < limit)
                 {
-                        x <<= bits;
-                        x |= WP->bitbuffer >> (16 - bits);
-                        WP->bitbuffer <<= bits;
-                        WP->filebit_index -= bits;
                         break;
                 }
-                else
+                if (!more)
                 {
-                        // Otherwise extract the bits we have and continue (which will
-                        // then load the next 16-bits into the bitbuffer
-                        x <<= WP->filebit_index;
-                        x |= WP->bitbuffer >> (16 - WP->filebit_index);
-                        bits -= WP->filebit_index;
-                        WP->filebit_index = 0;
+                        found = nblocks;
+                        c = WP->inlen;
+                        break;
                 }
+                memmove(WP->inbuf, WP->in + limit, WP->inlen - limit);
+                WP->inlen -= limit;
+                n = READ(WP, WP->inbuf + WP->inlen, WAC_INBUF_SIZE - WP->inlen);
+                WP->inlen += n;
+                more = n > 0;
+                i = 0;
         }
-        return (int) x;
+
+        // Pick up at the header found, after zero frames standing in for the
+        // blocks that were lost
+        WP->inpos = c;
+        WP->bitacc = 0;
+        WP->bitcount = 0;
+        WP->padbits = 0;
+        WP->eof = 0;
+        WP->fill = found < nblocks ? (int) ((found - block) * WP->blocksize) :
+                (int) (frames > (unsigned long) WP->frameindex ? frames - WP->frameindex : 0);
+        if (found == nblocks && (WP->truncated || WP->fill == 0))
+        {
+                WP->fill = 0;
+                return SetError(WP, WAC_ERR_EOF, "%s: Unexpected EOF in block %d", WP->srcfile, block);
+        }
+        if (GrowArray(WP, (void **) &WP->gaps, &WP->gapalloc, WP->ngaps, sizeof(WacGap)) != WAC_OK)
+        {
+                return WP->error;
+        }
+        gap = &WP->gaps[WP->ngaps++];
+        gap->sample = block * spb;
+        gap->length = (found < nblocks ? found * spb : WP->samplecount) - gap->sample;
+        if (gap->sample + gap->length > WP->samplecount)
+        {
+                gap->length = WP->samplecount - gap->sample;
+        }
+        gap->offset = (long long) offset;
+        return WAC_OK;
 }
 
-// ReadWord
-//
-// Skip to 16-bit boundary and read and return the next 16 bits.
-//
-unsigned short ReadWord(WacState *WP)
+// Return the damage skipped over in recover mode by the last conversion
+int wac_gaps(const WacDecoder *D, const WacGap **gaps)
 {
-        WP->filebit_index = 0;
-        return ReadBits(WP, 16);
+        *gaps = D->gaps;
+        return D->ngaps;
 }
 
-// FrameDecode
-//
-// Decode the next frame and write interleaved 16-bit samples to output file
+// Count the code sizes and quotient lengths of a frame (with the metrics
+// option).  A long quotient shows a loud or noisy frame.
+static void CountCodes(WacState *WP, const int *g)
+{
+        int ch, i;
+
+        for (ch = 0; ch < WP->channelcount; ch++)
+        {
+                const unsigned short *code = WP->codes + ch * WP->framesize;
+
+                WP->stats.codesizes[ch][g[ch]]++;
+                for (i = 0; i < WP->framesize && g[ch] != 0; i++)
+                {
+                        int q = code[i] >> g[ch];
+                        WP->stats.quotients[q < WAC_METRICS_QUOTIENTS ? q : WAC_METRICS_QUOTIENTS - 1]++;
+                }
+        }
+}
+
+// Decode the next frame and store framesize interleaved 16-bit samples per
+// channel at out.  Returns WAC_OK, or WAC_ERR_BLOCK (WAC_ERR_EOF if we ran
+// out of input) if the block header is not the one we expect.  The Golomb
+// codes are read into codes[] here and turned into samples by the
+// reconstruction kernel above.
 //
-void FrameDecode(WacState *WP)
+int FrameDecode(WacState *WP, short *out)
 {
-        unsigned short s;
-        int i;
         int ch;
-        unsigned short code;
-        short lastsample[2];
         int g[2];
         int lossybits = WP->flags & 0x0f;
 
+        // Frames lost to damage (see Resync()) are zero frames
+        if (WP->fill > 0)
+        {
+                WP->fill--;
+                WP->frameindex++;
+                WP->stats.frames++;
+                WP->stats.zeroframes++;
+                WP->zeroframe = 1;
+                if (!WP->skipzero)
+                {
+                        memset(out, 0, WP->framesize * WP->channelcount * sizeof(short));
+                }
+                return WAC_OK;
+        }
+
         // At start of block parse block header
         if (0 == (WP->frameindex % WP->blocksize))
         {
-                // Verify that the block header is valid and as expected
+                // Verify that the block header is valid and as expected, or in
+                // recover mode find the next good one and start again from there
                 int block = WP->frameindex / WP->blocksize;
-                if (   ReadWord(WP) != 0x8000
-                       || ReadWord(WP) != 0x0001
-                       || ReadWord(WP) != (block & 0xffff)
-                       || ReadWord(WP) != ((block >> 16) & 0xffff)
-                       )
+                int err;
+
+                if (WP->tracker != NULL && WP->tracker->active && Progress(WP, 0) != WAC_OK)
                 {
-                        fprintf(stderr, "Bad block header\n");
-                        exit(1);
+                        return WP->error;
                 }
-
-                if (0 == WP->frameindex % 1024)
+                err = ReadBlockHeader(WP, block);
+                if (err != WAC_OK)
                 {
-                        fprintf(stderr, "."); // progress...
+                        if (!WP->recover)
+                        {
+                                return err;
+                        }
+                        return Resync(WP, block) == WAC_OK ? FrameDecode(WP, out) : WP->error;
                 }
 
                 // If GPS data present and the block number is modulo the blocks per
                 // seek table entry, then load the latitude and longitude.
                 if ((WP->flags & 0x20) && 0 == (block % WP->seeksize))
                 {
-                        int lathi = ReadBits(WP,9);
-                        int latlo = ReadBits(WP,16);
-                        int lonhi = ReadBits(WP,10);
-                        int lonlo = ReadBits(WP,16);
+                        long lathi = ReadBits(WP,9);
+                        long latlo = ReadBits(WP,16);
+                        long lonhi = ReadBits(WP,10);
+                        long lonlo = ReadBits(WP,16);
 
-                        // For this example, we are not actually using the latitude and
-                        // longitude.  But these values are 100,000 times the latitude and
-                        // longitude in degrees with positive sign indicating north latitude
-                        // and west longitude.  These can be derived as follows:
-                        //
-                        //   float lat = ((lathi<<16)|latlo) / 100000.0;
-                        //   float lon = ((lonhi<<16)|lonlo) / 100000.0;
+                        // These values are 100,000 times the latitude and longitude in
+                        // degrees with positive sign indicating north latitude and west
+                        // longitude.  We keep the last fix for wac_stream_info().
+                        WP->gpsvalid = 1;
+                        WP->gpsfix.sample = (unsigned long) WP->frameindex * WP->framesize;
+                        WP->gpsfix.latitude = GpsDegrees((lathi<<16)|latlo, 25);
+                        WP->gpsfix.longitude = GpsDegrees((lonhi<<16)|lonlo, 26);
                 }
 
-                // If tag data present read it.  For this example, we aren't using this
-                // data.  But for EM3 recordings, for example, this tag value would
-                // be 1-4 corresponding to buttons A-D being depressed during this frame.
-                if (WP->flags & 0x40)
-                {
-                        int tag = ReadBits(WP,4);
-                }
+                // If tag data present read it.  For EM3 recordings, for example, this
+                // tag value would be 1-4 corresponding to buttons A-D being depressed
+                // during this frame.
+                WP->block = block;
+                WP->tag = (WP->flags & 0x40) ? ReadBits(WP,4) : 0;
+                WP->stats.blocks++;
         }
         // Advance frame
         WP->frameindex++;
+        WP->stats.frames++;
 
         // Read the per-channel Golumb remainder code size
+        WP->zeroframe = 1;
         for (ch = 0; ch < WP->channelcount; ch++)
         {
-                lastsample[ch] = 0;
                 g[ch] = ReadBits(WP,4);
+                if (g[ch] != 0)
+                {
+                        WP->zeroframe = 0;
+                }
         }
-        // Read samples for frame
-        for (i = 0; i < WP->framesize; i++)
+
+        // ZERO FRAME
+        // If every channel has a zero code size, the whole frame is untriggered
+        // time.  There are no sample bits to read, so fill the frame in one go, or
+        // leave it out if the caller is skipping zero frames (see
+        // DecodeTriggered()).
+        if (WP->zeroframe)
         {
-                // Interleave channels
-                for (ch = 0; ch < WP->channelcount; ch++)
+                WP->stats.zeroframes++;
+                if (WP->metrics)
                 {
-                        int delta;
-                        int stopbit;
-
-                        // ZERO FRAME
-                        // Special case: For triggered WAC files, the code size is set to
-                        // zero to indicate a zero-value frame.  This represents the
-                        // space between triggered events in the WAC file.  A trigger-aware
-                        // parser would look for onset/offset of this condition to break up
-                        // a WAC file into individual triggers.  In this example, we are just
-                        // filling the space with zero sample values.  And we won't actually
-                        // get to this code because the presence of these special zero-value
-                        // frames also requires that the header flags has 0x10 set.  In
-                        // main() above, we exit with an error if this is the case.
-                        if (g[ch] == 0)
-                        {
-                                s = 0;
-                                WRITE(WP, &s, 2);
-                                continue;
-                        }
-
-                        // Read the remainder code from the specified number of bits
-                        code = ReadBits(WP,g[ch]);
-
-                        // Read the quotient represented by alternating 1/0 pattern
-                        // following the remainder code
-                        stopbit = (code & 1) ^ 1;
-                        while (stopbit != ReadBits(WP,1))
-                        {
-                                code += 1 << g[ch];
-                                stopbit ^= 1;
-                        }
-
-                        // Adjust for sign
-                        if (code & 1)
-                        {
-                                delta = -(code+1)/2;
-                        }
-                        else
-                        {
-                                delta = code/2;
-                        }
-
-                        // Compute sample value as delta from previous sample
-                        delta += lastsample[ch];
-                        lastsample[ch] = delta;
-
-                        // Restore dropped least-significant bits used in higher levels
-                        // of compression e.g. WAC1, WAC2, etc.
-                        delta <<= lossybits;
-
-                        // Write 16-bit sample to output file
-                        s = delta;
-                        WRITE(WP, &s, 2);
+                        CountCodes(WP, g);
+                }
+                if (!WP->skipzero)
+                {
+                        memset(out, 0, WP->framesize * WP->channelcount * sizeof(short));
                 }
+                return WAC_OK;
+        }
+        // Read the codes for frame.  Both channels of a stereo frame normally
+        // have a code size, which is what the per-layout kernels handle.
+        if (g[0] != 0 && g[WP->channelcount - 1] != 0)
+        {
+                WP->framecodes(WP, g);
+        }
+        else
+        {
+                FrameCodes(WP, g);
+        }
+        if (WP->metrics)
+        {
+                CountCodes(WP, g);
         }
+
+        // Adjust for sign, compute each sample value as a delta from the previous
+        // sample, restore dropped least-significant bits used in higher levels of
+        // compression e.g. WAC1, WAC2, etc. and store the interleaved 16-bit
+        // samples in the output buffer
+        WP->reconstruct(WP->codes, WP->framesize, WP->channelcount, lossybits, out);
+        return WAC_OK;
 }
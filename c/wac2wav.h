@@ -1,13 +1,305 @@
 #ifndef WAC2WAV_H_   /* Include guard */
 #define WAC2WAV_H_
 
+// 64-bit file offsets (off_t, fseeko()) on 32-bit systems too
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define WAC_HAVE_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define WAC_HAVE_NEON 1
+#endif
+
+// Memory-mapped I/O is available on POSIX systems
+#ifndef _WIN32
+#include <sys/mman.h>
+#define WAC_HAVE_MMAP 1
+#endif
+
+// Decoder engines
+#define WAC_ENGINE_FAST      0 // bit-scan driven Golomb decoding
+#define WAC_ENGINE_REFERENCE 1 // original bit-by-bit Golomb decoding
+
+// Error codes
+#define WAC_OK         0 // success
+#define WAC_ERR_FORMAT 1 // not a WAC file or an unsupported WAC variant
+#define WAC_ERR_OPEN   2 // file not found or cannot be created
+#define WAC_ERR_EOF    3 // unexpected end of file
+#define WAC_ERR_BLOCK  4 // bad block header (corrupt file)
+#define WAC_ERR_NOMEM  5 // out of memory
+#define WAC_ERR_IO     6 // read, write or seek error
+#define WAC_ERR_ARG    7 // invalid argument
+#define WAC_ERR_CANCEL 8 // stopped by the progress callback
+
+// Handling of triggered WAC files by wac_write_wav()
+#define WAC_TRIGGER_SPLIT 0 // one WAV file per triggered segment (dest_NNNN.wav)
+#define WAC_TRIGGER_INDEX 1 // one WAV file of all segments plus dest_segments.csv
+
+// WAV output sample formats
+#define WAC_FORMAT_PCM16 0  // 16-bit integers (WAV format tag 1)
+#define WAC_FORMAT_FLOAT 1  // 32-bit float, full scale +/-1.0 (WAV format tag 3)
+
+// WAV output channels
+#define WAC_CHANNELS_ALL   0 // all recorded channels
+#define WAC_CHANNELS_LEFT  1 // first channel only
+#define WAC_CHANNELS_RIGHT 2 // second channel only
+#define WAC_CHANNELS_MIX   3 // average of the channels
+
+// Spectrogram windows and output formats (see wac_spectrogram())
+#define WAC_WINDOW_HANN    0
+#define WAC_WINDOW_HAMMING 1
+#define WAC_WINDOW_RECT    2
+#define WAC_SPEC_MAGNITUDE 0 // float, linear magnitude (a full-scale sine is 1)
+#define WAC_SPEC_DB        1 // float, dB relative to full scale
+#define WAC_SPEC_DB8       2 // unsigned char, -120 dB to 0 dB in 255 steps
+
+// Sample reconstruction kernels (WAC_SIMD_AUTO picks the best for the CPU)
+#define WAC_SIMD_AUTO 0
+#define WAC_SIMD_NONE 1     // portable scalar code
+#define WAC_SIMD_SSE2 2
+#define WAC_SIMD_AVX2 3
+#define WAC_SIMD_NEON 4
+
+// Conversion options
+typedef struct WacOptions_s
+{
+        int engine;             // WAC_ENGINE_FAST or WAC_ENGINE_REFERENCE
+        int threads;            // number of decoder threads (0 or 1 = no threads)
+        int mmap;               // non-zero to memory-map the source and WAV files
+        int triggers;           // WAC_TRIGGER_SPLIT or WAC_TRIGGER_INDEX
+        int format;             // WAV sample format: WAC_FORMAT_xxx
+        int channels;           // WAV channels: WAC_CHANNELS_xxx
+        int rate;               // WAV sample rate, lower than the recording to
+                                // resample (0 = as recorded)
+        int simd;               // reconstruction kernel: WAC_SIMD_xxx
+        int update;             // wac_batch(): skip files whose WAV file is
+                                // newer than the WAC file and complete
+        int pipeline;           // read, decode and write in separate threads
+        int truncated;          // wac_write_wav(): decode up to the end of the
+                                // input, for recordings that were cut short
+        int recover;            // carry on after damaged blocks (see wac_gaps())
+        size_t cache;           // wac_decode_range(): bytes of decoded seek
+                                // table entries to keep (0 = no cache)
+        int metrics;            // also count code sizes and quotient lengths
+                                // for wac_metrics() (a little slower)
+} WacOptions;
+
+// A triggered segment: a run of non-zero frames in a triggered WAC file
+typedef struct WacSegment_s
+{
+        unsigned long start;    // first sample (per channel) in the recording
+        unsigned long length;   // number of samples per channel
+} WacSegment;
+
+// Damage skipped over in recover mode.  The missing frames are silence in a
+// continuous recording and left out of a triggered one.
+typedef struct WacGap_s
+{
+        unsigned long sample;   // first sample (per channel) lost
+        unsigned long length;   // samples per channel lost (0 if the decoder
+                                // only had to find its place again)
+        long long offset;       // byte offset in the file of the damage
+} WacGap;
+
+// WAC header information
+typedef struct WacInfo_s
+{
+        int version;            // WAC file version number
+        int channelcount;       // number of channels
+        int framesize;          // samples per channel per frame
+        int blocksize;          // frames per block
+        int flags;              // WAC flags
+        int samplerate;         // sample rate
+        unsigned long samplecount; // number of samples in file per channel
+        int seeksize;           // blocks per seek-table entry
+        int seekentries;        // number of seek-table entries
+} WacInfo;
+
+// GPS fix (see wac_probe()).  The recorder stores these in the first block of
+// each seek table entry.
+typedef struct WacGps_s
+{
+        unsigned long sample;   // first sample (per channel) of the block
+        double latitude;        // degrees, positive north
+        double longitude;       // degrees, positive west as recorded
+} WacGps;
+
+// A run of blocks with the same EM3 tag (1-4 for buttons A-D)
+typedef struct WacTagRange_s
+{
+        int tag;
+        unsigned long start;    // first sample (per channel)
+        unsigned long length;   // number of samples per channel
+} WacTagRange;
+
+// File metadata returned by wac_probe()
+typedef struct WacProbe_s
+{
+        WacInfo info;           // header
+        double seconds;         // duration
+        int ngps;               // GPS fixes
+        const WacGps *gps;
+        int ntags;              // tagged ranges
+        const WacTagRange *tags;
+} WacProbe;
+
+// Side-band data for wac_read() (see wac_stream_info())
+typedef struct WacStreamInfo_s
+{
+        unsigned long sample;   // samples per channel read so far
+        unsigned long block;    // block holding the last sample read
+        int tag;                // tag of that block (0 if none)
+        int gpsvalid;           // set if gps holds a fix
+        WacGps gps;             // most recent GPS fix
+} WacStreamInfo;
+
+// Output callback: called with successive pieces of the output, returns 0 to
+// continue or non-zero to abort
+typedef int (*WacWriteFn)(void *ctx, const void *data, size_t len);
+
+// Result of wac_verify()
+typedef struct WacVerify_s
+{
+        unsigned long frames;   // frames decoded without error
+        unsigned long samples;  // samples per channel in those frames
+        long badblock;          // first bad block, or -1 if the file is good
+        uint32_t crc;           // CRC-32 of the decoded 16-bit samples, as
+                                // stored in the WAV data
+} WacVerify;
+
+// Spectrogram options
+typedef struct WacSpecOptions_s
+{
+        int fftsize;            // window length, a power of two from 16 to
+                                // 65536 samples (0 = 256)
+        int hop;                // samples per channel from one window to the
+                                // next (0 = fftsize / 2)
+        int window;             // WAC_WINDOW_xxx
+        int format;             // WAC_SPEC_xxx
+} WacSpecOptions;
+
+// Layout of a spectrogram: columns spectra, each of channels sets of bins
+// values from 0 Hz up to half the sample rate
+typedef struct WacSpecInfo_s
+{
+        unsigned long columns;  // number of windows
+        int channels;           // channels analysed (see WacOptions.channels)
+        int bins;               // values per channel per column (fftsize / 2 + 1)
+        size_t size;            // bytes of output from wac_spectrogram()
+} WacSpecInfo;
+
+// Counters of the wac_decode_range() cache (see WacOptions.cache)
+typedef struct WacCacheStats_s
+{
+        unsigned long hits;     // seek table entries copied from the cache
+        unsigned long misses;   // seek table entries decoded into the cache
+        int slots;              // entries the cache can hold
+        int used;               // entries it holds now
+} WacCacheStats;
+
+// Decoder metrics (see wac_metrics()).  The histograms are only filled in
+// with the metrics option.
+#define WAC_METRICS_QUOTIENTS 32 // quotient histogram bins (the last is 31 or more)
+
+typedef struct WacMetrics_s
+{
+        unsigned long frames;   // frames decoded, including zero frames
+        unsigned long zeroframes; // frames with no audio data
+        unsigned long blocks;   // block headers read
+        unsigned long long bytesin; // bytes of the WAC file read
+        unsigned long long bytesout; // bytes of output produced
+        double seconds;         // wall time of the operation
+        double readseconds;     // time spent reading (or waiting for) input
+        double decodeseconds;   // time spent decoding
+        double writeseconds;    // time spent writing output
+                                // (the stage times add up over threads)
+        unsigned long codesizes[2][16]; // frames by code size, per channel
+        unsigned long quotients[WAC_METRICS_QUOTIENTS]; // codes by quotient
+} WacMetrics;
+
+// Progress of a whole-file operation, passed to the progress callback
+typedef struct WacProgress_s
+{
+        unsigned long samples;  // samples per channel decoded so far
+        unsigned long total;    // samples per channel in the file
+        unsigned long long bytesin; // bytes of the WAC file read so far
+        double seconds;         // time since the operation started
+} WacProgress;
+
+// Progress callback (see wac_set_progress()): returns 0 to continue or
+// non-zero to stop with WAC_ERR_CANCEL
+typedef int (*WacProgressFn)(void *ctx, const WacProgress *progress);
+
+// Batch conversion job (see wac_batch() and wac_concat())
+typedef struct WacJob_s
+{
+        const char *srcfile;    // WAC file to convert
+        const char *destfile;   // WAV file to write
+        int status;             // result: WAC_OK or an error code
+        double seconds;         // wall time taken by this job
+        int skipped;            // set if the WAV file was already up to date
+                                // (or, for wac_concat(), if the file was not
+                                // converted because another one failed)
+        char errmsg[256];       // description of the error if status != WAC_OK
+} WacJob;
+
+// Decoder handle.  Each handle owns all of its state so any number of them
+// can be used at once from different threads (but each one from only one
+// thread at a time).
+typedef struct WacState_s WacDecoder;
+
+int wac_open(WacDecoder **decoder, const char *srcfile, const WacOptions *opts);
+int wac_open_mem(WacDecoder **decoder, const void *data, size_t len, const WacOptions *opts);
+void wac_close(WacDecoder *decoder);
+void wac_info(const WacDecoder *decoder, WacInfo *info);
+int wac_write_wav(WacDecoder *decoder, const char *destfile);
+int wac_probe(WacDecoder *decoder, WacProbe *probe);
+int wac_verify(WacDecoder *decoder, WacVerify *result);
+int wac_segments(const WacDecoder *decoder, const WacSegment **segments);
+int wac_gaps(const WacDecoder *decoder, const WacGap **gaps);
+unsigned long long wac_wav_size(const WacDecoder *decoder);
+int wac_write_wav_mem(WacDecoder *decoder, void *buf, size_t size);
+int wac_write_wav_cb(WacDecoder *decoder, WacWriteFn writefn, void *ctx);
+int wac_decode_all(WacDecoder *decoder, short *out);
+int wac_decode_range(WacDecoder *decoder, unsigned long start, unsigned long count,
+                     short *out, unsigned long *decoded);
+int wac_read(WacDecoder *decoder, short *out, unsigned long count, unsigned long *got);
+void wac_stream_info(const WacDecoder *decoder, WacStreamInfo *info);
+void wac_cache_stats(const WacDecoder *decoder, WacCacheStats *stats);
+void wac_metrics(const WacDecoder *decoder, WacMetrics *metrics);
+int wac_set_progress(WacDecoder *decoder, WacProgressFn fn, void *ctx, double interval);
+int wac_spectrogram_info(const WacDecoder *decoder, const WacSpecOptions *opts, WacSpecInfo *info);
+int wac_spectrogram(WacDecoder *decoder, const WacSpecOptions *opts, void *out);
+int wac_write_spectrogram(WacDecoder *decoder, const WacSpecOptions *opts, const char *destfile);
+const char *wac_errmsg(const WacDecoder *decoder);
+const char *wac_strerror(int error);
+int wac_batch(WacJob *jobs, int njobs, int workers, const WacOptions *opts);
+int wac_concat(WacJob *jobs, int njobs, const char *destfile, int workers, const WacOptions *opts);
 
-int wac2wav_c();  /* An example function declaration */
+// One-call conversions.  These return one of the error codes above.
+int wac2wav_c(char *srcfile, char *destfile);
+int wac2wav_opts_c(char *srcfile, char *destfile, const WacOptions *opts);
+int wac2wav_range_c(char *srcfile, unsigned long start, unsigned long count,
+                    short *out, unsigned long *decoded, int *channels);
 
 #endif // WAC2WAV_H_
@@ -30,8 +30,9 @@
 //
 // wac2wavcmd.c VERSION 1.0
 //
-// This code will take an untriggered WAC file (version 4 or earlier) as
-// standard input and produce an uncompressed WAV file as standard output.
+// This code will take a WAC file (version 4 or earlier, triggered or not),
+// from a file or standard input, and produce an uncompressed WAV file, to a
+// file or standard output.
 //
 // This code serves as an example of how to decode the Wildlife Acoustics
 // proprietary audio compression format known as "WAC".
@@ -66,9 +67,9 @@
 //                             time between triggered recordings.  Software
 //                             capable of handling triggers can break a file
 //                             into pieces discarding these zero-value frames.
-//                             Note: This example code does not support
-//                             this, but look in the code for "ZERO FRAME"
-//                             to see where this would be used.
+//                             Such files are written as one WAV file per
+//                             triggered segment (dest_NNNN.wav), or with -i
+//                             as a single WAV file plus dest_segments.csv.
 //                      0x20 = GPS data present - GPS data is interleaved with
 //                             data in block headers.
 //                      0x40 = TAG data present - TAG data is interleaved with
@@ -86,8 +87,9 @@
 //    you would double these values to convert to a byte offset into the file.
 //    The intention of the seek table is to make it easier to jump to a position
 //    in the WAC file without needing to decompress all the data before that
-//    position.  This code example does not use the seek table so we simply
-//    skip over it.
+//    position.  This code uses it to split the file between decoder threads
+//    and to decode sample ranges (wac_decode_range()) without decoding
+//    everything before them.
 //
 // 3. BLOCKS OF FRAMES OF SAMPLES
 //    Samples are grouped into frames (according to the frame size), and
@@ -123,9 +125,9 @@
 //    indicates that no tag is present.  While the tag button is pressed,
 //    blocks will be written with the corresponding tag.
 //
-//    Note that the GPS and TAG values are not implemented in this code and are
-//    simply skipped, but please see the comments in the code for more
-//    information.
+//    The GPS and TAG values are skipped while decoding.  wac_probe() (wac2wavcmd
+//    -p) reads them from the block headers without decoding the audio, see
+//    the comments in the code for more information.
 //
 //    Following the block header and optional GPS or tag data are block size
 //    frames of frame size samples for each channel.  For multi-channel
@@ -152,13 +154,612 @@
 //    applications.  Little-endian is assumed.
 //
 #include "wac2wav.h"
+#include "wacenc.h"
 
 // Simply take stdin to stdout
+//
+// Usage: wac2wavcmd [-r] [-k kernel] [-m] [-P] [-t] [-R] [-i] [-f] [-c left|right|mix]
+//                   [-s rate] [-j threads] [-M] src.wac dest.wav
+//        wac2wavcmd -S size[,hop] [-W window] [-d|-D] [-c left|right|mix] [-M] src.wac dest.spec
+//
+//   src.wac or dest.wav may be - for standard input or output, e.g.
+//   curl -s http://host/rec.wac | wac2wavcmd - - | ffmpeg -i - rec.flac
+//
+//   WAV files with over 4 GB of samples are written as RF64.
+//
+//   -r  decode with the bit-by-bit reference engine (for comparing output)
+//   -k  use the none, sse2, avx2 or neon sample reconstruction kernel rather
+//       than the best one for this CPU
+//   -i  write triggered segments to a single WAV file with a CSV index
+//   -f  write 32-bit float samples
+//   -c  write only the left or right channel, or a mono mix of both
+//   -s  downsample to this sample rate (e.g. 48000)
+//   -m  memory-map the source and destination files
+//   -P  read, decode and write in separate threads, so that slow disks or
+//       network storage overlap with decoding
+//   -t  the recording was cut short: write the WAV header with an unknown
+//       length (fixed up afterwards unless writing to a pipe) and decode up
+//       to the end of the input
+//   -R  carry on past damaged blocks from the next good block header, with
+//       silence in place of the lost frames, and list the gaps
+//   -j  decode with this many threads using the WAC seek table (rebuilt
+//       from the block headers if it is missing)
+//   -S  write a spectrogram (see wac_write_spectrogram()) instead of a WAV
+//       file, with windows of this many samples (a power of two), e.g. 256,
+//       optionally followed by the hop between them, e.g. 256,64
+//   -W  spectrogram window: hann (the default), hamming or rect
+//   -d  spectrogram values in dB instead of linear magnitudes
+//   -D  spectrogram values in dB, one byte each (-120 dB to 0 dB)
+//   -M  show progress, and print the decoder metrics (frames, bytes, time
+//       per stage and histograms of code sizes and quotient lengths) at the
+//       end
+//
+// or:    wac2wavcmd -p src.wac ...
+//        wac2wavcmd -v src.wac ...
+//
+//   -p  print the header, GPS fixes and tagged ranges of each file without
+//       decoding the audio
+//   -v  decode each file without writing anything and print the number of
+//       frames and the CRC-32 of the samples, or the first bad block
+//
+// or:    wac2wavcmd -b [-u] [options] src dest
+//
+//   -b  convert every .wac file under the directory src (or listed in the
+//       manifest file src, one per line) to a .wav file at the same place
+//       under the directory dest, with -j worker threads (default one per
+//       processor).  Relative manifest paths keep their directories; other
+//       paths are written by file name.
+//   -u  skip files whose WAV file is newer than the WAC file and complete
+//
+// or:    wac2wavcmd -a [options] dest.wav src.wac ...
+//
+//   -a  join the WAC files, in order, into one continuous WAV file (e.g.
+//       -a night.wav IGLOOLIK24_20150620_*.wac).  The files must have the same
+//       sample rate, channels and flags.  -j is the number of worker threads
+//       (default one per processor).
+//
+// or:    wac2wavcmd -e [-l lossy] [-T] [-j threads] src.wav dest.wac
+//
+//   -e  encode a 16-bit PCM mono or stereo WAV file (src.wav may be - for
+//       standard input) into a WAC file, with -j threads
+//   -l  drop this many least-significant bits (1-4 for WAC1-WAC4)
+//   -T  write a triggered file, with silent frames left out
+//
+static int probe(const char *srcfile)
+{
+  WacDecoder *decoder;
+  WacProbe p;
+  int err;
+  int i;
+
+  err = wac_open(&decoder, srcfile, NULL);
+  if (err == WAC_OK) {
+    err = wac_probe(decoder, &p);
+  }
+  if (err != WAC_OK) {
+    fprintf(stderr, "%s\n", wac_errmsg(decoder));
+    wac_close(decoder);
+    return err;
+  }
+  printf("file: %s\n", srcfile);
+  printf("version: %d\n", p.info.version);
+  printf("channels: %d\n", p.info.channelcount);
+  printf("samplerate: %d\n", p.info.samplerate);
+  printf("samples: %lu\n", p.info.samplecount);
+  printf("seconds: %.6f\n", p.seconds);
+  printf("flags: 0x%04x\n", p.info.flags);
+  for (i = 0; i < p.ngps; i++) {
+    printf("gps: %lu %.5f %.5f\n", p.gps[i].sample, p.gps[i].latitude, p.gps[i].longitude);
+  }
+  for (i = 0; i < p.ntags; i++) {
+    printf("tag: %c %lu %lu\n", 'A' + p.tags[i].tag - 1, p.tags[i].start, p.tags[i].length);
+  }
+  printf("\n");
+  wac_close(decoder);
+  return WAC_OK;
+}
+
+static int verify(const char *srcfile)
+{
+  WacDecoder *decoder;
+  WacVerify v;
+  int err;
+
+  v.badblock = -1;
+  err = wac_open(&decoder, srcfile, NULL);
+  if (err == WAC_OK) {
+    err = wac_verify(decoder, &v);
+    if (err == WAC_OK) {
+      printf("%s: OK frames %lu samples %lu crc %08x\n", srcfile, v.frames, v.samples, (unsigned) v.crc);
+    } else if (v.badblock >= 0) {
+      printf("%s: BAD block %ld after %lu frames: %s\n", srcfile, v.badblock, v.frames, wac_errmsg(decoder));
+    }
+  }
+  if (err != WAC_OK && v.badblock < 0) {
+    printf("%s: ERROR %s\n", srcfile, wac_errmsg(decoder));
+  }
+  wac_close(decoder);
+  return err;
+}
+
+// Progress line for -M
+static int show_progress(void *ctx, const WacProgress *p)
+{
+  (void) ctx;
+  if (p->total > 0) {
+    fprintf(stderr, "\r%5.1f%% %8.1f MB/s", 100.0 * p->samples / p->total,
+            p->seconds > 0 ? p->bytesin / p->seconds / 1e6 : 0);
+  }
+  return 0;
+}
+
+// Print the metrics of the last operation for -M
+static void print_metrics(WacDecoder *decoder)
+{
+  WacMetrics m;
+  WacInfo info;
+  int ch, i;
+
+  wac_metrics(decoder, &m);
+  wac_info(decoder, &info);
+  fprintf(stderr, "\nframes: %lu (%lu zero), blocks: %lu\n", m.frames, m.zeroframes, m.blocks);
+  fprintf(stderr, "bytes: %llu in, %llu out\n", m.bytesin, m.bytesout);
+  fprintf(stderr, "seconds: %.3f (read %.3f, decode %.3f, write %.3f)\n", m.seconds,
+          m.readseconds, m.decodeseconds, m.writeseconds);
+  for (ch = 0; ch < info.channelcount; ch++) {
+    fprintf(stderr, "code sizes, channel %d:", ch + 1);
+    for (i = 0; i < 16; i++) {
+      if (m.codesizes[ch][i] > 0) {
+        fprintf(stderr, " %d:%lu", i, m.codesizes[ch][i]);
+      }
+    }
+    fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "quotients:");
+  for (i = 0; i < WAC_METRICS_QUOTIENTS; i++) {
+    if (m.quotients[i] > 0) {
+      fprintf(stderr, " %d%s:%lu", i, i == WAC_METRICS_QUOTIENTS - 1 ? "+" : "", m.quotients[i]);
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+// Batch mode job list
+typedef struct {
+  WacJob *jobs;
+  int count;
+  int alloc;
+} joblist;
+
+static int has_wac_suffix(const char *name)
+{
+  size_t len = strlen(name);
+  return len > 4 && name[len - 4] == '.' && tolower((unsigned char) name[len - 3]) == 'w' &&
+    tolower((unsigned char) name[len - 2]) == 'a' && tolower((unsigned char) name[len - 1]) == 'c';
+}
+
+// Create the directories leading up to path
+static int make_parents(char *path)
+{
+  char *p;
+  for (p = path + 1; *p; p++) {
+    if (*p == '/') {
+      struct stat st;
+      *p = 0;
+      if (stat(path, &st) != 0 && mkdir(path, 0777) != 0) {
+        fprintf(stderr, "%s: cannot create directory\n", path);
+        *p = '/';
+        return -1;
+      }
+      *p = '/';
+    }
+  }
+  return 0;
+}
+
+// Add a job converting src to destroot/rel, with .wav for the .wac suffix
+static int add_job(joblist *list, const char *src, const char *rel, const char *destroot)
+{
+  size_t len = strlen(rel);
+  char *s, *d;
+
+  if (list->count == list->alloc) {
+    int alloc = list->alloc ? list->alloc * 2 : 256;
+    WacJob *jobs = realloc(list->jobs, alloc * sizeof(WacJob));
+    if (jobs == NULL) {
+      return -1;
+    }
+    list->jobs = jobs;
+    list->alloc = alloc;
+  }
+  if (has_wac_suffix(rel)) {
+    len -= 4;
+  }
+  s = malloc(strlen(src) + 1);
+  d = malloc(strlen(destroot) + len + 6);
+  if (s == NULL || d == NULL) {
+    free(s);
+    free(d);
+    return -1;
+  }
+  strcpy(s, src);
+  sprintf(d, "%s/%.*s.wav", destroot, (int) len, rel);
+  if (make_parents(d) != 0) {
+    free(s);
+    free(d);
+    return -1;
+  }
+  memset(&list->jobs[list->count], 0, sizeof(WacJob));
+  list->jobs[list->count].srcfile = s;
+  list->jobs[list->count].destfile = d;
+  list->count++;
+  return 0;
+}
+
+// Add every .wac file under dir (rel is its path below the batch source)
+static int scan_dir(joblist *list, const char *dir, const char *rel, const char *destroot)
+{
+  DIR *dp = opendir(dir);
+  struct dirent *de;
+  int err = 0;
+
+  if (dp == NULL) {
+    fprintf(stderr, "%s: cannot open directory\n", dir);
+    return -1;
+  }
+  while (err == 0 && (de = readdir(dp)) != NULL) {
+    struct stat st;
+    char *path, *sub;
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    path = malloc(strlen(dir) + strlen(de->d_name) + 2);
+    sub = malloc(strlen(rel) + strlen(de->d_name) + 2);
+    if (path == NULL || sub == NULL) {
+      err = -1;
+    } else {
+      sprintf(path, "%s/%s", dir, de->d_name);
+      sprintf(sub, "%s%s%s", rel, *rel ? "/" : "", de->d_name);
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        err = scan_dir(list, path, sub, destroot);
+      } else if (has_wac_suffix(de->d_name)) {
+        err = add_job(list, path, sub, destroot);
+      }
+    }
+    free(path);
+    free(sub);
+  }
+  closedir(dp);
+  return err;
+}
+
+// Add every file listed in a manifest (blank lines and # comments skipped)
+static int read_manifest(joblist *list, const char *manifest, const char *destroot)
+{
+  FILE *fp = fopen(manifest, "r");
+  char line[4096];
+  int err = 0;
+
+  if (fp == NULL) {
+    fprintf(stderr, "%s: cannot open manifest\n", manifest);
+    return -1;
+  }
+  while (err == 0 && fgets(line, sizeof(line), fp) != NULL) {
+    char *p = line;
+    char *end = line + strlen(line);
+    const char *rel;
+    while (end > p && isspace((unsigned char) end[-1])) {
+      *--end = 0;
+    }
+    while (isspace((unsigned char) *p)) {
+      p++;
+    }
+    if (*p == 0 || *p == '#') {
+      continue;
+    }
+    rel = p;
+    while (rel[0] == '.' && rel[1] == '/') {
+      rel += 2;
+    }
+    if (rel[0] == '/' || strstr(rel, "..") != NULL) {
+      rel = strrchr(p, '/') + 1;
+    }
+    err = add_job(list, p, rel, destroot);
+  }
+  fclose(fp);
+  return err;
+}
+
+static int batch(const char *src, const char *destroot, int workers, const WacOptions *opts)
+{
+  joblist list;
+  struct stat st;
+  struct timespec t0, t1;
+  int converted = 0, skipped = 0, failed = 0;
+  int err;
+  int i;
+
+  memset(&list, 0, sizeof(list));
+  if (stat(src, &st) == 0 && S_ISDIR(st.st_mode)) {
+    err = scan_dir(&list, src, "", destroot);
+  } else {
+    err = read_manifest(&list, src, destroot);
+  }
+  if (err != 0) {
+    return WAC_ERR_OPEN;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  err = wac_batch(list.jobs, list.count, workers, opts);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (i = 0; i < list.count; i++) {
+    WacJob *job = &list.jobs[i];
+    if (job->status != WAC_OK) {
+      fprintf(stderr, "%s: %s\n", job->srcfile, job->errmsg[0] ? job->errmsg : wac_strerror(job->status));
+      failed++;
+    } else if (job->skipped) {
+      skipped++;
+    } else {
+      converted++;
+    }
+    free((char *) job->srcfile);
+    free((char *) job->destfile);
+  }
+  free(list.jobs);
+  fprintf(stderr, "%d files: %d converted, %d up to date, %d failed in %.1f seconds\n",
+          converted + skipped + failed, converted, skipped, failed,
+          (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+  return err;
+}
+
+// Join srcfiles, in order, into one WAV file
+static int concat(const char *destfile, char **srcfiles, int n, int workers, const WacOptions *opts)
+{
+  WacJob *jobs = calloc(n, sizeof(WacJob));
+  struct timespec t0, t1;
+  int err;
+  int i;
+
+  if (jobs == NULL) {
+    return WAC_ERR_NOMEM;
+  }
+  for (i = 0; i < n; i++) {
+    jobs[i].srcfile = srcfiles[i];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  err = wac_concat(jobs, n, destfile, workers, opts);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (i = 0; i < n; i++) {
+    if (jobs[i].status != WAC_OK && !jobs[i].skipped) {
+      fprintf(stderr, "%s\n", jobs[i].errmsg[0] ? jobs[i].errmsg : wac_strerror(jobs[i].status));
+    }
+  }
+  if (err == WAC_OK) {
+    fprintf(stderr, "%d files joined in %.1f seconds\n", n,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+  }
+  free(jobs);
+  return err;
+}
+
+static int encode(const char *srcfile, const char *destfile, const WacEncOptions *eopts)
+{
+  WacEncResult r;
+  int err = wac_encode_wav(srcfile, destfile, eopts, &r);
+
+  if (err != WAC_OK) {
+    fprintf(stderr, "%s\n", r.errmsg[0] ? r.errmsg : wac_strerror(err));
+    return err;
+  }
+  fprintf(stderr, "%s: %lu samples, %d channels, %llu bytes (%.1f%% of the PCM) in %.1f seconds\n",
+          destfile, r.samples, r.channels, r.bytes,
+          r.samples > 0 ? 100.0 * r.bytes / (2.0 * r.samples * r.channels) : 0, r.seconds);
+  return WAC_OK;
+}
+
 int main(int argc, char **argv)
 {
+  WacOptions opts;
+  WacSpecOptions spec;
+  WacEncOptions eopts;
+  int batchmode = 0;
+  int concatmode = 0;
+  int specmode = 0;
+  int encodemode = 0;
+  int metrics = 0;
+
+  if (argc > 2 && (strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-v") == 0)) {
+    int i;
+    int err = WAC_OK;
+    for (i = 2; i < argc; i++) {
+      int e = argv[1][1] == 'p' ? probe(argv[i]) : verify(argv[i]);
+      if (err == WAC_OK) {
+        err = e;
+      }
+    }
+    return err;
+  }
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&spec, 0, sizeof(spec));
+  memset(&eopts, 0, sizeof(eopts));
+  opts.engine = WAC_ENGINE_FAST;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1] != 0) {
+    if (strcmp(argv[1], "-r") == 0) {
+      opts.engine = WAC_ENGINE_REFERENCE;
+    } else if (strcmp(argv[1], "-b") == 0) {
+      batchmode = 1;
+    } else if (strcmp(argv[1], "-a") == 0) {
+      concatmode = 1;
+    } else if (strcmp(argv[1], "-u") == 0) {
+      opts.update = 1;
+    } else if (strcmp(argv[1], "-i") == 0) {
+      opts.triggers = WAC_TRIGGER_INDEX;
+    } else if (strcmp(argv[1], "-k") == 0 && argc > 2) {
+      if (strcmp(argv[2], "none") == 0) {
+        opts.simd = WAC_SIMD_NONE;
+      } else if (strcmp(argv[2], "sse2") == 0) {
+        opts.simd = WAC_SIMD_SSE2;
+      } else if (strcmp(argv[2], "avx2") == 0) {
+        opts.simd = WAC_SIMD_AVX2;
+      } else if (strcmp(argv[2], "neon") == 0) {
+        opts.simd = WAC_SIMD_NEON;
+      } else {
+        break;
+      }
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-f") == 0) {
+      opts.format = WAC_FORMAT_FLOAT;
+    } else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+      if (strcmp(argv[2], "left") == 0) {
+        opts.channels = WAC_CHANNELS_LEFT;
+      } else if (strcmp(argv[2], "right") == 0) {
+        opts.channels = WAC_CHANNELS_RIGHT;
+      } else if (strcmp(argv[2], "mix") == 0) {
+        opts.channels = WAC_CHANNELS_MIX;
+      } else {
+        break;
+      }
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-m") == 0) {
+      opts.mmap = 1;
+    } else if (strcmp(argv[1], "-P") == 0) {
+      opts.pipeline = 1;
+    } else if (strcmp(argv[1], "-t") == 0) {
+      opts.truncated = 1;
+    } else if (strcmp(argv[1], "-R") == 0) {
+      opts.recover = 1;
+    } else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+      opts.rate = atoi(argv[2]);
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-S") == 0 && argc > 2) {
+      char *hop = strchr(argv[2], ',');
+      specmode = 1;
+      spec.fftsize = atoi(argv[2]);
+      spec.hop = hop != NULL ? atoi(hop + 1) : 0;
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-W") == 0 && argc > 2) {
+      if (strcmp(argv[2], "hann") == 0) {
+        spec.window = WAC_WINDOW_HANN;
+      } else if (strcmp(argv[2], "hamming") == 0) {
+        spec.window = WAC_WINDOW_HAMMING;
+      } else if (strcmp(argv[2], "rect") == 0) {
+        spec.window = WAC_WINDOW_RECT;
+      } else {
+        break;
+      }
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-d") == 0) {
+      spec.format = WAC_SPEC_DB;
+    } else if (strcmp(argv[1], "-D") == 0) {
+      spec.format = WAC_SPEC_DB8;
+    } else if (strcmp(argv[1], "-M") == 0) {
+      opts.metrics = 1;
+      metrics = 1;
+    } else if (strcmp(argv[1], "-e") == 0) {
+      encodemode = 1;
+    } else if (strcmp(argv[1], "-l") == 0 && argc > 2) {
+      eopts.lossy = atoi(argv[2]);
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-T") == 0) {
+      eopts.triggered = 1;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+      opts.threads = atoi(argv[2]);
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
+  if (concatmode && argc > 2) {
+    // As for -b, -j is the number of workers
+    int workers = opts.threads;
+    opts.threads = 0;
+    return concat(argv[1], argv + 2, argc - 2, workers, &opts);
+  }
+  if (argc != 3) {
+    fprintf(stderr, "usage: wac2wavcmd [-r] [-k kernel] [-m] [-P] [-t] [-R] [-i] [-f] [-c left|right|mix]\n"
+            "                  [-s rate] [-j threads] [-M] src.wac dest.wav\n"
+            "       wac2wavcmd -S size[,hop] [-W window] [-d|-D] [-c left|right|mix] [-M] src.wac dest.spec\n"
+            "       wac2wavcmd -p src.wac ...\n"
+            "       wac2wavcmd -v src.wac ...\n"
+            "       wac2wavcmd -b [-u] [options] srcdir|manifest destdir\n"
+            "       wac2wavcmd -a [options] dest.wav src.wac ...\n"
+            "       wac2wavcmd -e [-l lossy] [-T] [-j threads] src.wav dest.wac\n");
+    return 1;
+  }
+  if (batchmode) {
+    // -j is the number of workers, each file is decoded by one at a time
+    int workers = opts.threads;
+    opts.threads = 0;
+    return batch(argv[1], argv[2], workers, &opts);
+  }
+  if (encodemode) {
+    eopts.threads = opts.threads;
+    return encode(argv[1], argv[2], &eopts);
+  }
 
   char *srcfile = argv[1];
   char *destfile = argv[2];
+  WacDecoder *decoder;
+  int err;
+
+  // Copyright
+  fprintf(stderr, "\r\nwac2wavcmd 1.0 Copyright (C) 2014 Wildlife Acoustics, Inc.\r\n\r\n"
+          "This program comes with ABSOLUTELY NO WARRANTY;\r\n"
+          "This is free software, and you are welcome to redistribute it.\r\n\r\n"
+          );
   fprintf(stderr, "src: %s, dest: %s \n", srcfile, destfile);
-  return(wac2wav_c(srcfile, destfile));
+
+  err = wac_open(&decoder, srcfile, &opts);
+  if (err == WAC_OK && metrics) {
+    err = wac_set_progress(decoder, show_progress, NULL, 0.5);
+  }
+  if (err == WAC_OK && specmode) {
+    WacSpecInfo si;
+    err = wac_write_spectrogram(decoder, &spec, destfile);
+    if (err == WAC_OK && metrics) {
+      print_metrics(decoder);
+    }
+    if (err == WAC_OK && wac_spectrogram_info(decoder, &spec, &si) == WAC_OK) {
+      fprintf(stderr, "%lu columns of %d x %d bins\n", si.columns, si.channels, si.bins);
+    }
+    if (err != WAC_OK) {
+      fprintf(stderr, "%s\n", wac_errmsg(decoder));
+    }
+    wac_close(decoder);
+    return err;
+  }
+  if (err == WAC_OK) {
+    err = wac_write_wav(decoder, destfile);
+  }
+  if (err == WAC_OK && metrics) {
+    print_metrics(decoder);
+  }
+  if (err == WAC_OK) {
+    WacInfo info;
+    const WacSegment *segments;
+    const WacGap *gaps;
+    int i, n = wac_gaps(decoder, &gaps);
+    wac_info(decoder, &info);
+    for (i = 0; i < n; i++) {
+      fprintf(stderr, "damage at byte %lld: %lu samples lost at %.3f seconds\n", gaps[i].offset,
+              gaps[i].length, (double) gaps[i].sample / info.samplerate);
+    }
+    if (info.flags & 0x10)
+      fprintf(stderr, "%d triggered segments\n", wac_segments(decoder, &segments));
+  }
+  if (err != WAC_OK) {
+    fprintf(stderr, "%s\n", wac_errmsg(decoder));
+  }
+  wac_close(decoder);
+  return err;
 }
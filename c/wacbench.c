@@ -0,0 +1,404 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wacbench.c
+//
+// Decoder throughput benchmark over the synthetic corpus of wacgen.c.  Each
+// file is generated in memory and each stage of the decoder is timed on its
+// own, single-threaded:
+//
+//    bits         raw bit reader: the whole payload read 16 bits at a time
+//    entropy      block headers and Golomb codes (FrameDecode() without the
+//                 reconstruction kernel)
+//    reconstruct  the reconstruction kernel alone, over the codes saved by the
+//                 entropy stage
+//    output       WAV output of the decoded samples (16-bit, then float)
+//    total        the whole file decoded to a WAV file in memory
+//    encode       the decoded samples encoded again (wacenc.c) in memory
+//
+// MB/s is of the WAC data for bits and entropy and of the 16-bit samples for
+// the other stages; samples/s counts every sample of every channel.  Each
+// stage is repeated until it has run for at least the minimum time (-t,
+// default 0.2 seconds) and the fastest run is reported.
+//
+//    wacbench [-t seconds] [-n scale] [-k kernel] [file ...]
+//
+// With names, only the corpus files with those names are run.  The library is
+// included directly so that the stages can be timed separately.
+//
+#include "wac2wav.c"
+#include "wacgen.h"
+#include "wacenc.h"
+
+// Minimum time to spend on each stage, in seconds
+static double mintime = 0.2;
+
+// A stage of the decoder, run once per call
+typedef struct
+{
+        const char *name;
+        int (*run)(WacState *WP, void *ctx);
+        int wacbytes;           // MB/s of the WAC data rather than the samples
+} BenchStage;
+
+// Buffers shared by the stages
+typedef struct
+{
+        WacDecoder *D;          // 16-bit output decoder
+        WacDecoder *F;          // float output decoder
+        const unsigned char *data;
+        size_t len;
+        unsigned long frames;   // frames in the file
+        unsigned short *codes;  // 256 codes per frame, from the entropy stage
+        short *pcm;             // the decoded samples
+        unsigned char *wav;     // WAV output
+        size_t wavlen;
+        size_t wavpos;          // bytes stored in wav by the output stage
+} BenchFile;
+
+// Null reconstruction kernel for timing the entropy stage
+static void NoReconstruct(const unsigned short *codes, int framesize, int channelcount,
+                          int lossybits, short *out)
+{
+        (void) codes;
+        (void) framesize;
+        (void) channelcount;
+        (void) lossybits;
+        (void) out;
+}
+
+// WAV output goes to memory, as the callers of wac_write_wav_cb() would
+static int MemWrite(void *ctx, const void *data, size_t len)
+{
+        BenchFile *BP = ctx;
+
+        if (len > BP->wavlen - BP->wavpos)
+        {
+                return 1;
+        }
+        memcpy(BP->wav + BP->wavpos, data, len);
+        BP->wavpos += len;
+        return 0;
+}
+
+static int RunBits(WacState *WP, void *ctx)
+{
+        BenchFile *BP = ctx;
+        size_t words = (BP->len - WP->datastart) / 2;
+        unsigned sum = 0;
+        size_t i;
+        int err;
+
+        if ((err = SeekInput(WP, WP->datastart, 0)) != WAC_OK)
+        {
+                return err;
+        }
+        for (i = 0; i < words; i++)
+        {
+                sum += ReadBits(WP, 16);
+        }
+        // Keep the reads from being optimized away
+        WP->tag = sum & 1;
+        return WAC_OK;
+}
+
+static int RunEntropy(WacState *WP, void *ctx)
+{
+        BenchFile *BP = ctx;
+        WacReconstructFn reconstruct = WP->reconstruct;
+        unsigned long i;
+        int err = WAC_OK;
+
+        if ((err = SeekInput(WP, WP->datastart, 0)) != WAC_OK)
+        {
+                return err;
+        }
+        WP->reconstruct = NoReconstruct;
+        for (i = 0; i < BP->frames && err == WAC_OK; i++)
+        {
+                err = FrameDecode(WP, BP->pcm);
+                if (WP->zeroframe)
+                {
+                        memset(WP->codes, 0, sizeof(WP->codes));
+                }
+                memcpy(BP->codes + i * 256, WP->codes, sizeof(WP->codes));
+        }
+        WP->reconstruct = reconstruct;
+        return err;
+}
+
+static int RunReconstruct(WacState *WP, void *ctx)
+{
+        BenchFile *BP = ctx;
+        int lossybits = WP->flags & 0x0f;
+        int framesamples = WP->framesize * WP->channelcount;
+        unsigned long i;
+
+        for (i = 0; i < BP->frames; i++)
+        {
+                WP->reconstruct(BP->codes + i * 256, WP->framesize, WP->channelcount, lossybits,
+                                BP->pcm + i * framesamples);
+        }
+        return WAC_OK;
+}
+
+// Write the decoded samples out a block at a time, as DecodeSamples() does
+static int WriteBlocks(WacState *WP, BenchFile *BP)
+{
+        unsigned long block = (unsigned long) WP->blocksize * WP->framesize;
+        unsigned long pos;
+        int err = WAC_OK;
+
+        OutputStage(WP, 1);
+        BP->wavpos = 0;
+        WP->writefn = MemWrite;
+        WP->writectx = BP;
+        for (pos = 0; pos < WP->samplecount && err == WAC_OK; pos += block)
+        {
+                unsigned long n = WP->samplecount - pos < block ? WP->samplecount - pos : block;
+
+                err = WriteSamples(WP, BP->pcm + pos * WP->channelcount, n);
+        }
+        WP->writefn = NULL;
+        WP->writectx = NULL;
+        return err;
+}
+
+static int RunOutput16(WacState *WP, void *ctx)
+{
+        (void) WP;
+        return WriteBlocks(((BenchFile *) ctx)->D, ctx);
+}
+
+static int RunOutputFloat(WacState *WP, void *ctx)
+{
+        (void) WP;
+        return WriteBlocks(((BenchFile *) ctx)->F, ctx);
+}
+
+static int RunTotal(WacState *WP, void *ctx)
+{
+        BenchFile *BP = ctx;
+
+        return wac_write_wav_mem(WP, BP->wav, BP->wavlen);
+}
+
+// Encode the samples left by the reconstruct stage with the file's settings
+static int RunEncode(WacState *WP, void *ctx)
+{
+        BenchFile *BP = ctx;
+        WacEncOptions eopts;
+        WacEncResult result;
+        unsigned char *data;
+        size_t len;
+        int err;
+
+        memset(&eopts, 0, sizeof(eopts));
+        eopts.lossy = WP->flags & 0x0f;
+        eopts.triggered = (WP->flags & 0x10) != 0;
+        err = wac_encode(BP->pcm, WP->samplecount, WP->channelcount, WP->samplerate, &eopts,
+                         &data, &len, &result);
+        if (err != WAC_OK)
+        {
+                return SetError(WP, err, "%s", result.errmsg);
+        }
+        free(data);
+        return WAC_OK;
+}
+
+static const BenchStage stages[] =
+{
+        { "bits",         RunBits,        1 },
+        { "entropy",      RunEntropy,     1 },
+        { "reconstruct",  RunReconstruct, 0 },
+        { "output",       RunOutput16,    0 },
+        { "output-float", RunOutputFloat, 0 },
+        { "total",        RunTotal,       0 },
+        { "encode",       RunEncode,      0 },
+};
+#define NSTAGES ((int) (sizeof(stages) / sizeof(stages[0])))
+
+// Run a stage until mintime has passed and return the fastest time, or a
+// negative time on error
+static double TimeStage(const BenchStage *SP, BenchFile *BP)
+{
+        double best = -1;
+        double spent = 0;
+
+        while (spent < mintime || best < 0)
+        {
+                double t = Now();
+                int err = SP->run(BP->D, BP);
+
+                t = Now() - t;
+                if (err != WAC_OK)
+                {
+                        fprintf(stderr, "%s: %s\n", SP->name, wac_errmsg(BP->D));
+                        return -1;
+                }
+                if (best < 0 || t < best)
+                {
+                        best = t;
+                }
+                spent += t;
+        }
+        return best;
+}
+
+static int Selected(const char *name, int argc, char **argv)
+{
+        int i;
+
+        if (argc == 0)
+        {
+                return 1;
+        }
+        for (i = 0; i < argc; i++)
+        {
+                if (!strcmp(argv[i], name))
+                {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        WacOptions opts;
+        double scale = 0;
+        double totaltime[NSTAGES];
+        double totalbytes[NSTAGES];
+        double totalsamples = 0;
+        int i, k;
+
+        memset(&opts, 0, sizeof(opts));
+        for (argv++, argc--; argc >= 2 && argv[0][0] == '-'; argv += 2, argc -= 2)
+        {
+                if (!strcmp(argv[0], "-t"))
+                {
+                        mintime = atof(argv[1]);
+                }
+                else if (!strcmp(argv[0], "-n"))
+                {
+                        scale = atof(argv[1]);
+                }
+                else if (!strcmp(argv[0], "-k"))
+                {
+                        opts.simd = !strcmp(argv[1], "none") ? WAC_SIMD_NONE :
+                                !strcmp(argv[1], "sse2") ? WAC_SIMD_SSE2 :
+                                !strcmp(argv[1], "avx2") ? WAC_SIMD_AVX2 :
+                                !strcmp(argv[1], "neon") ? WAC_SIMD_NEON : WAC_SIMD_AUTO;
+                }
+                else
+                {
+                        break;
+                }
+        }
+        if (argc > 0 && argv[0][0] == '-')
+        {
+                fprintf(stderr, "usage: wacbench [-t seconds] [-n scale] [-k kernel] [file ...]\n");
+                return 1;
+        }
+
+        memset(totaltime, 0, sizeof(totaltime));
+        memset(totalbytes, 0, sizeof(totalbytes));
+        printf("%-16s %-13s %10s %12s\n", "file", "stage", "MB/s", "Msamples/s");
+        for (i = 0; i < wacgen_corpus_size; i++)
+        {
+                const WacGenSpec *spec = &wacgen_corpus[i];
+                WacOptions fopts = opts;
+                BenchFile B;
+                unsigned char *data;
+                double samples, pcmbytes;
+                int err;
+
+                if (!Selected(spec->name, argc, argv))
+                {
+                        continue;
+                }
+                memset(&B, 0, sizeof(B));
+                if (wacgen_make(spec, scale, &data, &B.len) != WAC_OK)
+                {
+                        fprintf(stderr, "%s: out of memory\n", spec->name);
+                        return 1;
+                }
+                B.data = data;
+                fopts.format = WAC_FORMAT_FLOAT;
+                if ((err = wac_open_mem(&B.D, data, B.len, &opts)) != WAC_OK ||
+                    (err = wac_open_mem(&B.F, data, B.len, &fopts)) != WAC_OK)
+                {
+                        fprintf(stderr, "%s: %s\n", spec->name, wac_strerror(err));
+                        return 1;
+                }
+                B.frames = (B.D->samplecount + B.D->framesize - 1) / B.D->framesize;
+                B.codes = malloc(B.frames * 256 * sizeof(unsigned short));
+                B.pcm = malloc(B.frames * 256 * sizeof(short));
+                B.wavlen = (size_t) wac_wav_size(B.F);
+                B.wav = wac_wav_size(B.F) == B.wavlen ? malloc(B.wavlen) : NULL;
+                if (B.codes == NULL || B.pcm == NULL || B.wav == NULL)
+                {
+                        fprintf(stderr, "%s: out of memory\n", spec->name);
+                        return 1;
+                }
+
+                samples = (double) B.D->samplecount * B.D->channelcount;
+                pcmbytes = samples * sizeof(short);
+                totalsamples += samples;
+                for (k = 0; k < NSTAGES; k++)
+                {
+                        double bytes = stages[k].wacbytes ? (double) B.len : pcmbytes;
+                        double t = TimeStage(&stages[k], &B);
+
+                        if (t < 0)
+                        {
+                                return 1;
+                        }
+                        totaltime[k] += t;
+                        totalbytes[k] += bytes;
+                        printf("%-16s %-13s %10.1f %12.1f\n", spec->name, stages[k].name,
+                               bytes / t / 1e6, samples / t / 1e6);
+                }
+                fflush(stdout);
+
+                wac_close(B.D);
+                wac_close(B.F);
+                free(B.codes);
+                free(B.pcm);
+                free(B.wav);
+                free(data);
+        }
+        for (k = 0; k < NSTAGES && totalsamples > 0; k++)
+        {
+                printf("%-16s %-13s %10.1f %12.1f\n", "ALL", stages[k].name,
+                       totalbytes[k] / totaltime[k] / 1e6, totalsamples / totaltime[k] / 1e6);
+        }
+        return 0;
+}
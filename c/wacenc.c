@@ -0,0 +1,961 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wacenc.c
+//
+// The encoder is FrameDecode() run backwards.  Each sample is cut down to
+// the kept bits (rounding off the lossy bits), differenced against the one
+// before in the frame and folded into an unsigned code (0, -1, 1, -2, ... to
+// 0, 1, 2, 3, ...).  Each channel of a frame then gets the Golomb code size g
+// that takes the fewest bits, and the frame is written as the code sizes
+// followed by the interleaved codes, exactly as the decoder reads them.
+//
+// Seek table entries are independent (every frame starts from zero and the
+// decoder can start at any block), so like DecodeParallel() the encoder
+// hands runs of seek table entries to worker threads.  The source is taken a
+// batch of entries at a time, the workers code their entries into buffers of
+// their own, and the buffers are written out in order, which gives the seek
+// table offsets.  The seek table goes in last, so WAC files are written to a
+// seekable file or to memory.
+//
+#include "wacenc.h"
+
+// Blocks are 16 frames and seek table entries 16 blocks, as on the recorders
+#define WACENC_BLOCKSIZE 16
+#define WACENC_SEEKSIZE  16
+
+// Seek table entries per thread in each batch
+#define WACENC_BATCH 8
+
+// Most bytes a frame can take (the code sizes and 256 codes of at most 17
+// bits, since g = 15 never needs more) and a block header can take (its
+// alignment, the block number, a GPS fix and a tag)
+#define WACENC_FRAME_BYTES 552
+#define WACENC_BLOCK_BYTES 16
+
+// Encoder state
+typedef struct
+{
+        const WacEncOptions *opts;
+        WacEncResult *result;   // the caller's result, or one of our own
+        int error;              // first error
+        int channels;
+        int framesize;          // samples per channel per frame
+        int samplerate;
+        int lossy;
+        int flags;
+        int blocksize;          // frames per block
+        int seeksize;           // blocks per seek table entry
+        unsigned long samples;  // samples per channel
+        unsigned long nblocks;
+        int nseek;              // seek table entries
+        uint32_t *seektbl;      // word offsets of the seek table entries
+        FILE *fp;               // output file, or
+        unsigned char *buf;     // output in memory
+        size_t alloc;           // bytes allocated for buf
+        unsigned long long pos; // bytes written
+} WacEnc;
+
+// One seek table entry
+typedef struct
+{
+        int entry;              // seek table entry number
+        const short *pcm;       // its samples (interleaved)
+        unsigned long count;    // samples per channel in it
+        unsigned char *out;     // the encoded blocks
+        size_t len;             // bytes in out
+} WacEncChunk;
+
+// An encoder thread and its share of a batch
+typedef struct
+{
+        const WacEnc *EP;
+        WacEncChunk *chunks;
+        int nchunks;
+        pthread_t thread;
+} WacEncWorker;
+
+// Bit writer: bits go into 16-bit little-endian words msb first, as the
+// decoder reads them.  The output buffer must be large enough.
+typedef struct
+{
+        unsigned char *p;       // next output byte
+        uint64_t acc;           // pending bits, right-justified
+        int nbits;              // number of pending bits (< 16 between calls)
+} WacEncBits;
+
+static double Now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int EncError(WacEnc *EP, int error, const char *fmt, ...)
+{
+        va_list ap;
+
+        // Keep the first error: later ones are usually consequences of it
+        if (EP->error == WAC_OK)
+        {
+                EP->error = error;
+                va_start(ap, fmt);
+                vsnprintf(EP->result->errmsg, sizeof(EP->result->errmsg), fmt, ap);
+                va_end(ap);
+        }
+        return error;
+}
+
+// Write the n bits of v (n <= 48, v < 2^n)
+static inline void PutBits(WacEncBits *BP, uint64_t v, int n)
+{
+        BP->acc = (BP->acc << n) | v;
+        BP->nbits += n;
+        while (BP->nbits >= 16)
+        {
+                unsigned w;
+
+                BP->nbits -= 16;
+                w = (unsigned) (BP->acc >> BP->nbits) & 0xffff;
+                BP->p[0] = w & 0xff;
+                BP->p[1] = w >> 8;
+                BP->p += 2;
+        }
+}
+
+// Pad with zero bits to the next word boundary
+static inline void AlignBits(WacEncBits *BP)
+{
+        if (BP->nbits > 0)
+        {
+                PutBits(BP, 0, 16 - BP->nbits);
+        }
+}
+
+// Golomb code: the g-bit remainder, then the q = code >> g quotient bits
+// alternating from the remainder's low bit, then a stop bit repeating the
+// last one.  The quotient and stop bit are the first q + 1 bits of the
+// alternating pattern with the last one flipped, so short codes (nearly all
+// of them) go out in one write.
+static inline void PutCode(WacEncBits *BP, unsigned code, int g)
+{
+        unsigned q = code >> g;
+        uint64_t alt = code & 1 ? 0xaaaaaaaaaaaaULL : 0x555555555555ULL;
+        uint64_t rem = code & ((1u << g) - 1);
+
+        if (g + q < 48)
+        {
+                PutBits(BP, rem << (q + 1) | ((alt >> (47 - q)) ^ 1), g + q + 1);
+                return;
+        }
+        PutBits(BP, rem, g);
+        for (; q >= 32; q -= 32)
+        {
+                PutBits(BP, alt >> 16, 32);
+        }
+        PutBits(BP, (alt >> (47 - q)) ^ 1, q + 1);
+}
+
+// Cut a sample down to the bits the decoder shifts back up, to the nearest
+// step (the top of the range rounds down, as the step above does not exist)
+static inline int Quantize(int x, int lossy)
+{
+        int v;
+
+        if (lossy == 0)
+        {
+                return x;
+        }
+        v = (x + (1 << (lossy - 1))) >> lossy;
+        return v > (32767 >> lossy) ? 32767 >> lossy : v;
+}
+
+// Bits taken by n codes with code size g
+static unsigned long CodeBits(const unsigned short *codes, int n, int g)
+{
+        unsigned long bits = (unsigned long) n * (g + 1);
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                bits += codes[i] >> g;
+        }
+        return bits;
+}
+
+// The code size giving the fewest bits for n codes summing to sum.  The
+// cost is convex in g, so walk from the size suggested by the mean code to
+// the minimum, taking the smallest g of a tie as wacgen.c does.
+static int BestCodeSize(const unsigned short *codes, int n, unsigned long sum)
+{
+        unsigned long best, bits;
+        int start = 1;
+        int g;
+
+        while (start < 15 && (unsigned long) n << (start + 1) <= sum)
+        {
+                start++;
+        }
+        g = start;
+        best = CodeBits(codes, n, g);
+        while (g > 1 && (bits = CodeBits(codes, n, g - 1)) <= best)
+        {
+                best = bits;
+                g--;
+        }
+        if (g == start)
+        {
+                while (g < 15 && (bits = CodeBits(codes, n, g + 1)) < best)
+                {
+                        best = bits;
+                        g++;
+                }
+        }
+        return g;
+}
+
+// The GPS fix for a seek table entry starting at sample: the last one at or
+// before it, or the first one
+static const WacGps *GpsAt(const WacEnc *EP, unsigned long sample)
+{
+        const WacGps *gps = EP->opts->gps;
+        int lo = 0;
+        int hi = EP->opts->ngps;
+
+        while (hi - lo > 1)
+        {
+                int mid = (lo + hi) / 2;
+
+                if (gps[mid].sample <= sample)
+                {
+                        lo = mid;
+                }
+                else
+                {
+                        hi = mid;
+                }
+        }
+        return &gps[lo];
+}
+
+// The tag of the block starting at sample (0 if not in a tagged range)
+static int TagAt(const WacEnc *EP, unsigned long sample)
+{
+        const WacTagRange *tags = EP->opts->tags;
+        int lo = 0;
+        int hi = EP->opts->ntags;
+
+        while (hi - lo > 1)
+        {
+                int mid = (lo + hi) / 2;
+
+                if (tags[mid].start <= sample)
+                {
+                        lo = mid;
+                }
+                else
+                {
+                        hi = mid;
+                }
+        }
+        if (sample < tags[lo].start || sample - tags[lo].start >= tags[lo].length)
+        {
+                return 0;
+        }
+        return tags[lo].tag;
+}
+
+// Block header: the marker, the block number, a GPS fix at each seek table
+// entry (in 1/100000 degree, as two's complement 25 and 26-bit values) and
+// the tag
+static void EncodeBlockHeader(const WacEnc *EP, WacEncBits *BP, unsigned long block)
+{
+        unsigned long sample = block * EP->blocksize * EP->framesize;
+
+        AlignBits(BP);
+        PutBits(BP, 0x8000, 16);
+        PutBits(BP, 0x0001, 16);
+        PutBits(BP, block & 0xffff, 16);
+        PutBits(BP, (block >> 16) & 0xffff, 16);
+        if ((EP->flags & 0x20) && block % EP->seeksize == 0)
+        {
+                const WacGps *fix = GpsAt(EP, sample);
+
+                PutBits(BP, (uint64_t) lrint(fix->latitude * 100000) & 0x1ffffff, 25);
+                PutBits(BP, (uint64_t) lrint(fix->longitude * 100000) & 0x3ffffff, 26);
+        }
+        if (EP->flags & 0x40)
+        {
+                PutBits(BP, TagAt(EP, sample), 4);
+        }
+}
+
+// One frame of n samples per channel (a short last frame repeats its last
+// sample, which codes as zeros)
+static void EncodeFrame(const WacEnc *EP, WacEncBits *BP, const short *pcm, unsigned long n)
+{
+        unsigned short codes[2][256];
+        int g[2];
+        int ch, i;
+
+        for (ch = 0; ch < EP->channels; ch++)
+        {
+                unsigned long sum = 0;
+                int nonzero = 0;
+                int last = 0;
+
+                for (i = 0; i < EP->framesize; i++)
+                {
+                        unsigned long k = (unsigned long) i < n ? (unsigned long) i : n - 1;
+                        int v = Quantize(pcm[k * EP->channels + ch], EP->lossy);
+                        int d = (short) (v - last);
+
+                        last = v;
+                        codes[ch][i] = (unsigned short) (d >= 0 ? 2 * d : -2 * d - 1);
+                        sum += codes[ch][i];
+                        nonzero |= v;
+                }
+                g[ch] = (EP->flags & 0x10) && !nonzero ? 0 : BestCodeSize(codes[ch], EP->framesize, sum);
+        }
+
+        for (ch = 0; ch < EP->channels; ch++)
+        {
+                PutBits(BP, g[ch], 4);
+        }
+        if (EP->channels == 1 && g[0] != 0)
+        {
+                for (i = 0; i < EP->framesize; i++)
+                {
+                        PutCode(BP, codes[0][i], g[0]);
+                }
+        }
+        else if (EP->channels == 2)
+        {
+                for (i = 0; i < EP->framesize; i++)
+                {
+                        for (ch = 0; ch < EP->channels; ch++)
+                        {
+                                if (g[ch] != 0)
+                                {
+                                        PutCode(BP, codes[ch][i], g[ch]);
+                                }
+                        }
+                }
+        }
+}
+
+// The blocks of one seek table entry
+static void EncodeChunk(const WacEnc *EP, WacEncChunk *CP)
+{
+        WacEncBits B;
+        unsigned long frame = (unsigned long) CP->entry * EP->seeksize * EP->blocksize;
+        unsigned long i;
+
+        B.p = CP->out;
+        B.acc = 0;
+        B.nbits = 0;
+        for (i = 0; i < CP->count; i += EP->framesize, frame++)
+        {
+                unsigned long n = CP->count - i < (unsigned long) EP->framesize ? CP->count - i :
+                        (unsigned long) EP->framesize;
+
+                if (frame % EP->blocksize == 0)
+                {
+                        EncodeBlockHeader(EP, &B, frame / EP->blocksize);
+                }
+                EncodeFrame(EP, &B, CP->pcm + i * EP->channels, n);
+        }
+        AlignBits(&B);
+        CP->len = (size_t) (B.p - CP->out);
+}
+
+static void *EncodeWorker(void *arg)
+{
+        WacEncWorker *WP = (WacEncWorker *) arg;
+        int i;
+
+        for (i = 0; i < WP->nchunks; i++)
+        {
+                EncodeChunk(WP->EP, &WP->chunks[i]);
+        }
+        return NULL;
+}
+
+// Encode a batch of seek table entries, split evenly between the threads
+static void EncodeBatch(const WacEnc *EP, WacEncWorker *workers, int nthreads,
+                        WacEncChunk *chunks, int nchunks)
+{
+        int i;
+
+        if (nthreads > nchunks)
+        {
+                nthreads = nchunks;
+        }
+        if (nthreads <= 1)
+        {
+                for (i = 0; i < nchunks; i++)
+                {
+                        EncodeChunk(EP, &chunks[i]);
+                }
+                return;
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+                int first = (int) ((long long) nchunks * i / nthreads);
+
+                workers[i].EP = EP;
+                workers[i].chunks = chunks + first;
+                workers[i].nchunks = (int) ((long long) nchunks * (i + 1) / nthreads) - first;
+                if (pthread_create(&workers[i].thread, NULL, EncodeWorker, &workers[i]) != 0)
+                {
+                        // Could not start a thread: encode this share here
+                        EncodeWorker(&workers[i]);
+                        workers[i].thread = pthread_self();
+                }
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+                if (!pthread_equal(workers[i].thread, pthread_self()))
+                {
+                        pthread_join(workers[i].thread, NULL);
+                }
+        }
+}
+
+// Check the options and lay out the file
+static int Layout(WacEnc *EP, int channels, int samplerate, unsigned long long samples)
+{
+        const WacEncOptions *opts = EP->opts;
+        unsigned long nframes;
+        unsigned long nseek;
+        int i;
+
+        if (channels != 1 && channels != 2)
+        {
+                return EncError(EP, WAC_ERR_ARG, "Cannot encode %d channels (only 1 or 2)", channels);
+        }
+        if (samplerate <= 0)
+        {
+                return EncError(EP, WAC_ERR_ARG, "Invalid sample rate %d", samplerate);
+        }
+        if (samples > 0xffffffffULL)
+        {
+                return EncError(EP, WAC_ERR_ARG, "Too many samples for a WAC file (%llu)", samples);
+        }
+        if (opts->lossy < 0 || opts->lossy > 15 || opts->blocksize < 0 || opts->blocksize > 65535 ||
+            opts->seeksize < 0 || opts->seeksize > 65535 || opts->ngps < 0 || opts->ntags < 0 ||
+            (opts->ngps > 0 && opts->gps == NULL) || (opts->ntags > 0 && opts->tags == NULL))
+        {
+                return EncError(EP, WAC_ERR_ARG, "Invalid encoder options");
+        }
+        for (i = 0; i < opts->ntags; i++)
+        {
+                if (opts->tags[i].tag < 0 || opts->tags[i].tag > 15)
+                {
+                        return EncError(EP, WAC_ERR_ARG, "Invalid tag %d (0-15)", opts->tags[i].tag);
+                }
+        }
+
+        EP->channels = channels;
+        EP->framesize = 256 / channels;
+        EP->samplerate = samplerate;
+        EP->samples = (unsigned long) samples;
+        EP->lossy = opts->lossy;
+        EP->flags = opts->lossy | (opts->triggered ? 0x10 : 0) | (opts->ngps > 0 ? 0x20 : 0) |
+                (opts->ntags > 0 ? 0x40 : 0);
+        EP->blocksize = opts->blocksize > 0 ? opts->blocksize : WACENC_BLOCKSIZE;
+        EP->seeksize = opts->seeksize > 0 ? opts->seeksize : WACENC_SEEKSIZE;
+        nframes = (EP->samples + EP->framesize - 1) / EP->framesize;
+        EP->nblocks = (nframes + EP->blocksize - 1) / EP->blocksize;
+        nseek = (EP->nblocks + EP->seeksize - 1) / EP->seeksize;
+        while (opts->seeksize == 0 && nseek > 65535 && EP->seeksize < 32768)
+        {
+                EP->seeksize *= 2;
+                nseek = (EP->nblocks + EP->seeksize - 1) / EP->seeksize;
+        }
+        if (nseek > 65535)
+        {
+                return EncError(EP, WAC_ERR_ARG, "Too many seek table entries (%lu)", nseek);
+        }
+        EP->nseek = (int) nseek;
+        EP->seektbl = calloc(nseek > 0 ? nseek : 1, sizeof(uint32_t));
+        if (EP->seektbl == NULL)
+        {
+                return EncError(EP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        return WAC_OK;
+}
+
+static int Put(WacEnc *EP, const void *p, size_t n)
+{
+        if (EP->fp != NULL)
+        {
+                if (fwrite(p, 1, n, EP->fp) != n)
+                {
+                        return EncError(EP, WAC_ERR_IO, "Write error");
+                }
+        }
+        else
+        {
+                if (EP->pos + n > EP->alloc)
+                {
+                        size_t alloc = EP->alloc ? EP->alloc : 65536;
+                        unsigned char *buf;
+
+                        while (alloc < EP->pos + n)
+                        {
+                                alloc *= 2;
+                        }
+                        buf = realloc(EP->buf, alloc);
+                        if (buf == NULL)
+                        {
+                                return EncError(EP, WAC_ERR_NOMEM, "Out of memory");
+                        }
+                        EP->buf = buf;
+                        EP->alloc = alloc;
+                }
+                memcpy(EP->buf + EP->pos, p, n);
+        }
+        EP->pos += n;
+        return WAC_OK;
+}
+
+// The header and the seek table (little-endian)
+static void PutHeader(const WacEnc *EP, unsigned char *out)
+{
+        int i;
+
+        memcpy(out, "WAac", 4);
+        out[4] = 4;
+        out[5] = (unsigned char) EP->channels;
+        out[6] = EP->framesize & 0xff;
+        out[7] = EP->framesize >> 8;
+        out[8] = EP->blocksize & 0xff;
+        out[9] = EP->blocksize >> 8;
+        out[10] = EP->flags & 0xff;
+        out[11] = EP->flags >> 8;
+        for (i = 0; i < 4; i++)
+        {
+                out[12 + i] = (EP->samplerate >> (8 * i)) & 0xff;
+                out[16 + i] = (EP->samples >> (8 * i)) & 0xff;
+        }
+        out[20] = EP->seeksize & 0xff;
+        out[21] = EP->seeksize >> 8;
+        out[22] = EP->nseek & 0xff;
+        out[23] = EP->nseek >> 8;
+}
+
+static void PutSeekTable(const WacEnc *EP, unsigned char *out)
+{
+        int i, k;
+
+        for (i = 0; i < EP->nseek; i++)
+        {
+                for (k = 0; k < 4; k++)
+                {
+                        out[4 * i + k] = (EP->seektbl[i] >> (8 * k)) & 0xff;
+                }
+        }
+}
+
+// Encode the samples, from pcm in memory or from the WAV data in src, a
+// batch of seek table entries at a time
+static int Encode(WacEnc *EP, const short *pcm, FILE *src)
+{
+        size_t spe = (size_t) EP->seeksize * EP->blocksize * EP->framesize;
+        size_t bound = (size_t) EP->seeksize * EP->blocksize * WACENC_FRAME_BYTES +
+                (size_t) EP->seeksize * WACENC_BLOCK_BYTES;
+        int nthreads = EP->opts->threads > 1 ? EP->opts->threads : 1;
+        int batch = nthreads * WACENC_BATCH;
+        size_t tblsize = 24 + 4 * (size_t) EP->nseek;
+        unsigned char *tbl = calloc(tblsize, 1);
+        WacEncWorker *workers = calloc(nthreads, sizeof(WacEncWorker));
+        WacEncChunk *chunks;
+        short *in = NULL;
+        int err = WAC_OK;
+        int e, i, n;
+
+        if (batch > EP->nseek)
+        {
+                batch = EP->nseek > 0 ? EP->nseek : 1;
+        }
+        chunks = calloc(batch, sizeof(WacEncChunk));
+        if (tbl == NULL || workers == NULL || chunks == NULL)
+        {
+                err = EncError(EP, WAC_ERR_NOMEM, "Out of memory");
+        }
+        for (i = 0; err == WAC_OK && i < batch; i++)
+        {
+                chunks[i].out = malloc(bound);
+                if (chunks[i].out == NULL)
+                {
+                        err = EncError(EP, WAC_ERR_NOMEM, "Out of memory");
+                }
+        }
+        if (err == WAC_OK && src != NULL)
+        {
+                in = malloc(batch * spe * EP->channels * sizeof(short));
+                if (in == NULL)
+                {
+                        err = EncError(EP, WAC_ERR_NOMEM, "Out of memory");
+                }
+        }
+
+        // Header and a zero seek table, filled in at the end
+        if (err == WAC_OK)
+        {
+                PutHeader(EP, tbl);
+                err = Put(EP, tbl, tblsize);
+        }
+
+        for (e = 0; err == WAC_OK && e < EP->nseek; e += n)
+        {
+                unsigned long first = (unsigned long) e * spe;
+                unsigned long count;
+                const short *base = pcm + (size_t) first * EP->channels;
+
+                n = EP->nseek - e < batch ? EP->nseek - e : batch;
+                count = EP->samples - first < n * spe ? EP->samples - first : (unsigned long) (n * spe);
+                if (src != NULL)
+                {
+                        if (fread(in, EP->channels * sizeof(short), count, src) != count)
+                        {
+                                err = EncError(EP, ferror(src) ? WAC_ERR_IO : WAC_ERR_EOF,
+                                               ferror(src) ? "Read error" : "Unexpected EOF");
+                                break;
+                        }
+                        base = in;
+                }
+                for (i = 0; i < n; i++)
+                {
+                        chunks[i].entry = e + i;
+                        chunks[i].pcm = base + i * spe * EP->channels;
+                        chunks[i].count = count - i * spe < spe ? count - i * spe : (unsigned long) spe;
+                }
+                EncodeBatch(EP, workers, nthreads, chunks, n);
+                for (i = 0; err == WAC_OK && i < n; i++)
+                {
+                        if (EP->pos / 2 > 0xffffffffULL)
+                        {
+                                err = EncError(EP, WAC_ERR_ARG, "Too large for a WAC file");
+                                break;
+                        }
+                        EP->seektbl[e + i] = (uint32_t) (EP->pos / 2);
+                        err = Put(EP, chunks[i].out, chunks[i].len);
+                }
+        }
+
+        // Now the seek table
+        if (err == WAC_OK)
+        {
+                PutSeekTable(EP, tbl + 24);
+                if (EP->fp == NULL)
+                {
+                        memcpy(EP->buf + 24, tbl + 24, tblsize - 24);
+                }
+                else if (fseeko(EP->fp, 24, SEEK_SET) != 0 ||
+                         fwrite(tbl + 24, 1, tblsize - 24, EP->fp) != tblsize - 24)
+                {
+                        err = EncError(EP, WAC_ERR_IO, "Cannot write the seek table");
+                }
+        }
+
+        for (i = 0; chunks != NULL && i < batch; i++)
+        {
+                free(chunks[i].out);
+        }
+        free(chunks);
+        free(workers);
+        free(tbl);
+        free(in);
+        return err;
+}
+
+int wac_encode(const short *pcm, unsigned long samples, int channels, int samplerate,
+               const WacEncOptions *opts, unsigned char **data, size_t *len,
+               WacEncResult *result)
+{
+        static const WacEncOptions defaults;
+        WacEncResult R;
+        WacEnc E;
+        double start = Now();
+        int err;
+
+        memset(&E, 0, sizeof(E));
+        E.opts = opts != NULL ? opts : &defaults;
+        E.result = result != NULL ? result : &R;
+        memset(E.result, 0, sizeof(*E.result));
+        *data = NULL;
+        *len = 0;
+        err = Layout(&E, channels, samplerate, samples);
+        if (err == WAC_OK && pcm == NULL && samples > 0)
+        {
+                err = EncError(&E, WAC_ERR_ARG, "No samples");
+        }
+        if (err == WAC_OK)
+        {
+                err = Encode(&E, pcm, NULL);
+        }
+        free(E.seektbl);
+        if (err != WAC_OK)
+        {
+                free(E.buf);
+                return err;
+        }
+        *data = E.buf;
+        *len = (size_t) E.pos;
+        E.result->channels = channels;
+        E.result->samplerate = samplerate;
+        E.result->samples = samples;
+        E.result->bytes = E.pos;
+        E.result->seconds = Now() - start;
+        return WAC_OK;
+}
+
+// Little-endian fields of a WAV header
+static unsigned long long GetLE(const unsigned char *p, int n)
+{
+        unsigned long long v = 0;
+
+        while (n-- > 0)
+        {
+                v = v << 8 | p[n];
+        }
+        return v;
+}
+
+static int Skip(FILE *fp, unsigned long long n)
+{
+        unsigned char buf[4096];
+
+        while (n > 0)
+        {
+                size_t k = n < sizeof(buf) ? (size_t) n : sizeof(buf);
+
+                if (fread(buf, 1, k, fp) != k)
+                {
+                        return -1;
+                }
+                n -= k;
+        }
+        return 0;
+}
+
+// Read the header of a 16-bit PCM WAV file (RIFF, or RF64 for files over
+// 4 GB) up to its samples.  Chunks other than fmt, ds64 and data are
+// skipped.  A data size of 0xffffffff with no ds64 chunk, as written by
+// programs that stream WAV files, means up to the end of the file.
+static int ReadWavHeader(WacEnc *EP, FILE *fp, int *channels, int *samplerate,
+                         unsigned long long *samples)
+{
+        unsigned char hdr[48];
+        unsigned long long ds64 = 0;
+        int rf64;
+        int format = 0;
+
+        if (fread(hdr, 1, 12, fp) != 12 || (memcmp(hdr, "RIFF", 4) && memcmp(hdr, "RF64", 4)) ||
+            memcmp(hdr + 8, "WAVE", 4))
+        {
+                return EncError(EP, WAC_ERR_FORMAT, "Not a WAV file");
+        }
+        rf64 = !memcmp(hdr, "RF64", 4);
+        for (;;)
+        {
+                unsigned long long size;
+                size_t n;
+
+                if (fread(hdr, 1, 8, fp) != 8)
+                {
+                        return EncError(EP, WAC_ERR_EOF, "Unexpected EOF (no data chunk)");
+                }
+                size = GetLE(hdr + 4, 4);
+                if (!memcmp(hdr, "data", 4))
+                {
+                        break;
+                }
+                n = !memcmp(hdr, "fmt ", 4) || !memcmp(hdr, "ds64", 4) ?
+                        (size < sizeof(hdr) - 8 ? (size_t) size : sizeof(hdr) - 8) : 0;
+                if (fread(hdr + 8, 1, n, fp) != n || Skip(fp, size - n + (size & 1)) != 0)
+                {
+                        return EncError(EP, WAC_ERR_EOF, "Unexpected EOF");
+                }
+                if (!memcmp(hdr, "fmt ", 4) && n >= 16)
+                {
+                        format = (int) GetLE(hdr + 8, 2);
+                        *channels = (int) GetLE(hdr + 10, 2);
+                        *samplerate = (int) GetLE(hdr + 12, 4);
+                        if (format == 0xfffe && n >= 26)
+                        {
+                                // WAVE_FORMAT_EXTENSIBLE: the format is in the sub-format GUID
+                                format = (int) GetLE(hdr + 32, 2);
+                        }
+                        if (format != 1 || GetLE(hdr + 22, 2) != 16 ||
+                            GetLE(hdr + 20, 2) != 2 * (unsigned) *channels ||
+                            (*channels != 1 && *channels != 2))
+                        {
+                                return EncError(EP, WAC_ERR_FORMAT,
+                                                "Only 16-bit PCM mono or stereo WAV files can be encoded");
+                        }
+                }
+                else if (!memcmp(hdr, "ds64", 4) && rf64 && n >= 24)
+                {
+                        ds64 = GetLE(hdr + 16, 8);
+                }
+        }
+        if (format == 0)
+        {
+                return EncError(EP, WAC_ERR_FORMAT, "No fmt chunk before the samples");
+        }
+
+        // The data chunk
+        if (GetLE(hdr + 4, 4) != 0xffffffff)
+        {
+                *samples = GetLE(hdr + 4, 4) / (2 * *channels);
+        }
+        else if (rf64)
+        {
+                *samples = ds64 / (2 * *channels);
+        }
+        else
+        {
+                *samples = ~0ULL;
+        }
+        return WAC_OK;
+}
+
+// Encode a WAV file into destfile
+int wac_encode_wav(const char *srcfile, const char *destfile, const WacEncOptions *opts,
+                   WacEncResult *result)
+{
+        static const WacEncOptions defaults;
+        WacEncResult R;
+        WacEnc E;
+        FILE *src;
+        struct stat st;
+        unsigned long long samples = 0;
+        short *pcm = NULL;
+        double start = Now();
+        int channels = 0;
+        int samplerate = 0;
+        int err;
+
+        memset(&E, 0, sizeof(E));
+        E.opts = opts != NULL ? opts : &defaults;
+        E.result = result != NULL ? result : &R;
+        memset(E.result, 0, sizeof(*E.result));
+        if (strcmp(destfile, "-") == 0)
+        {
+                return EncError(&E, WAC_ERR_ARG, "WAC files cannot be written to a pipe");
+        }
+        src = strcmp(srcfile, "-") == 0 ? stdin : fopen(srcfile, "rb");
+        if (src == NULL)
+        {
+                return EncError(&E, WAC_ERR_OPEN, "%s: File not found", srcfile);
+        }
+        err = ReadWavHeader(&E, src, &channels, &samplerate, &samples);
+
+        // A data size to the end of the file: from the file size, or for a
+        // pipe by reading it all
+        if (err == WAC_OK && samples == ~0ULL)
+        {
+                off_t pos = ftello(src);
+
+                if (pos >= 0 && fstat(fileno(src), &st) == 0 && S_ISREG(st.st_mode))
+                {
+                        samples = (unsigned long long) (st.st_size - pos) / (2 * channels);
+                }
+                else
+                {
+                        size_t alloc = 0;
+                        size_t got;
+
+                        samples = 0;
+                        do
+                        {
+                                if (samples + 65536 > alloc)
+                                {
+                                        short *p = realloc(pcm, (alloc ? alloc * 2 : 65536 * 16) *
+                                                           channels * sizeof(short));
+
+                                        if (p == NULL)
+                                        {
+                                                err = EncError(&E, WAC_ERR_NOMEM, "Out of memory");
+                                                break;
+                                        }
+                                        pcm = p;
+                                        alloc = alloc ? alloc * 2 : 65536 * 16;
+                                }
+                                got = fread(pcm + samples * channels, channels * sizeof(short), 65536, src);
+                                samples += got;
+                        }
+                        while (got == 65536);
+                }
+        }
+        if (err == WAC_OK)
+        {
+                err = Layout(&E, channels, samplerate, samples);
+        }
+        if (err == WAC_OK)
+        {
+                E.fp = fopen(destfile, "wb");
+                if (E.fp == NULL)
+                {
+                        err = EncError(&E, WAC_ERR_OPEN, "%s: Cannot create file", destfile);
+                }
+        }
+        if (err == WAC_OK)
+        {
+                err = Encode(&E, pcm, pcm == NULL ? src : NULL);
+        }
+        if (E.fp != NULL && fclose(E.fp) != 0 && err == WAC_OK)
+        {
+                err = EncError(&E, WAC_ERR_IO, "Write error");
+        }
+        if (E.fp != NULL && err != WAC_OK)
+        {
+                remove(destfile);
+        }
+        if (src != stdin)
+        {
+                fclose(src);
+        }
+        free(E.seektbl);
+        free(pcm);
+        if (err == WAC_OK)
+        {
+                E.result->channels = channels;
+                E.result->samplerate = samplerate;
+                E.result->samples = (unsigned long) samples;
+                E.result->bytes = E.pos;
+                E.result->seconds = Now() - start;
+        }
+        return err;
+}
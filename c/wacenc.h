@@ -0,0 +1,82 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wacenc.h
+//
+// WAC encoder: 16-bit PCM, in memory or from a WAV file, to a WAC file that
+// the decoder reads back sample for sample (or, at the lossy levels, with
+// the dropped bits rounded off).
+//
+#ifndef WACENC_H_   /* Include guard */
+#define WACENC_H_
+
+#include "wac2wav.h"
+
+// Encoder options (all zero for a lossless, untagged file without GPS)
+typedef struct WacEncOptions_s
+{
+        int lossy;              // least-significant bits to drop: 0 for WAC0
+                                // (lossless), 1-4 for WAC1-WAC4 (at most 15)
+        int threads;            // number of encoder threads (0 or 1 = no threads)
+        int blocksize;          // frames per block (0 = 16, as on the recorders)
+        int seeksize;           // blocks per seek table entry (0 = 16, or more
+                                // if the file would need over 65535 entries)
+        int triggered;          // flag the file as triggered and code silent
+                                // channels of a frame as zero frames
+        int ngps;               // GPS fixes, in sample order: each seek table
+        const WacGps *gps;      // entry gets the last fix at or before its
+                                // first sample (or the first fix)
+        int ntags;              // tagged ranges (tags 1-15), in sample order:
+        const WacTagRange *tags;// each block gets the tag of the range holding
+                                // its first sample, or 0
+} WacEncOptions;
+
+// Result of an encode
+typedef struct WacEncResult_s
+{
+        int channels;           // channels encoded
+        int samplerate;         // sample rate
+        unsigned long samples;  // samples per channel encoded
+        unsigned long long bytes; // size of the WAC file
+        double seconds;         // wall time
+        char errmsg[256];       // description of the error, if any
+} WacEncResult;
+
+// Encode samples per channel of interleaved pcm into a malloc()ed buffer, or
+// a 16-bit PCM WAV file (RIFF or RF64, "-" for stdin) into destfile, which
+// must be seekable.  result may be NULL.  These return one of the WAC_xxx
+// error codes.
+int wac_encode(const short *pcm, unsigned long samples, int channels, int samplerate,
+               const WacEncOptions *opts, unsigned char **data, size_t *len,
+               WacEncResult *result);
+int wac_encode_wav(const char *srcfile, const char *destfile, const WacEncOptions *opts,
+                   WacEncResult *result);
+
+#endif // WACENC_H_
@@ -0,0 +1,423 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wacgen.c
+//
+// Generator for the synthetic WAC corpus used by the benchmark and the
+// tests.  The files are written exactly as described in wac2wavcmd.c: a
+// 24-byte header, the seek table, then the blocks of frames, each frame
+// with one Golomb code size per channel followed by the interleaved codes.
+// The code size of each channel is the one giving the fewest bits for the
+// frame.
+//
+// Built with -DWACGEN_MAIN this is also a command line tool that writes the
+// corpus to a directory:
+//
+//    wacgen [-n scale] dir
+//
+#include "wacgen.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Blocks are 16 frames and seek table entries 16 blocks, as on the recorders
+#define WACGEN_BLOCKSIZE 16
+#define WACGEN_SEEKSIZE  16
+
+// The corpus: mono and stereo, WAC0-WAC4, GPS and tags, triggered files,
+// and quiet and loud signals
+const WacGenSpec wacgen_corpus[] =
+{
+        // name        ch lossy gps tag trig signal        rate    samples   seed
+        { "mono0-quiet", 1, 0, 0, 0, 0, WACGEN_QUIET, 256000, 2560000,  1 },
+        { "mono0-loud",  1, 0, 0, 0, 0, WACGEN_LOUD,  256000, 2560000,  2 },
+        { "mono1-loud",  1, 1, 0, 0, 0, WACGEN_LOUD,  256000, 2560000,  3 },
+        { "mono2-loud",  1, 2, 0, 0, 0, WACGEN_LOUD,  256000, 2560000,  4 },
+        { "mono3-loud",  1, 3, 0, 0, 0, WACGEN_LOUD,  256000, 2560000,  5 },
+        { "mono4-loud",  1, 4, 0, 0, 0, WACGEN_LOUD,  256000, 2560000,  6 },
+        { "stereo0-quiet", 2, 0, 0, 0, 0, WACGEN_QUIET, 48000, 1440000, 7 },
+        { "stereo0-loud",  2, 0, 0, 0, 0, WACGEN_LOUD,  48000, 1440000, 8 },
+        { "stereo2-loud",  2, 2, 0, 0, 0, WACGEN_LOUD,  48000, 1440000, 9 },
+        { "stereo4-loud",  2, 4, 0, 0, 0, WACGEN_LOUD,  48000, 1440000, 10 },
+        { "mono0-gpstag",  1, 0, 1, 1, 0, WACGEN_LOUD,  256000, 2560000, 11 },
+        { "stereo1-gpstag", 2, 1, 1, 1, 0, WACGEN_QUIET, 48000, 1440000, 12 },
+        { "mono0-trig",    1, 0, 0, 0, 1, WACGEN_LOUD,  256000, 2560000, 13 },
+        { "stereo0-trig",  2, 0, 1, 1, 1, WACGEN_LOUD,  96000,  1440000, 14 },
+};
+const int wacgen_corpus_size = sizeof(wacgen_corpus) / sizeof(wacgen_corpus[0]);
+
+// Bit writer: bits go into 16-bit words msb first, as the decoder reads them
+typedef struct
+{
+        uint16_t *words;        // output words
+        size_t nwords;          // complete words in words
+        size_t alloc;           // allocated words
+        uint32_t acc;           // pending bits, right-justified
+        int nbits;              // number of pending bits
+        int error;              // set if out of memory
+} WacGenBits;
+
+static void PutWord(WacGenBits *BP, uint16_t w)
+{
+        if (BP->nwords == BP->alloc)
+        {
+                size_t alloc = BP->alloc ? BP->alloc * 2 : 65536;
+                uint16_t *words = realloc(BP->words, alloc * sizeof(uint16_t));
+
+                if (words == NULL)
+                {
+                        BP->error = 1;
+                        return;
+                }
+                BP->words = words;
+                BP->alloc = alloc;
+        }
+        BP->words[BP->nwords++] = w;
+}
+
+// Write the low n bits of v (n <= 16)
+static void PutBits(WacGenBits *BP, unsigned v, int n)
+{
+        BP->acc = (BP->acc << n) | (v & ((1u << n) - 1));
+        BP->nbits += n;
+        if (BP->nbits >= 16)
+        {
+                BP->nbits -= 16;
+                PutWord(BP, (uint16_t) (BP->acc >> BP->nbits));
+        }
+}
+
+// Pad with zero bits to the next word boundary
+static void AlignBits(WacGenBits *BP)
+{
+        if (BP->nbits > 0)
+        {
+                PutBits(BP, 0, 16 - BP->nbits);
+        }
+}
+
+// Golomb code: the g-bit remainder, then the quotient as bits alternating
+// from the remainder's low bit, then a stop bit repeating the last one
+static void PutCode(WacGenBits *BP, unsigned code, int g)
+{
+        unsigned q = code >> g;
+        unsigned bit = code & 1;
+        unsigned k;
+
+        PutBits(BP, code, g);
+        for (k = 0; k < q; k++)
+        {
+                PutBits(BP, bit ^ (k & 1), 1);
+        }
+        PutBits(BP, bit ^ 1 ^ (q & 1), 1);
+}
+
+// Deterministic random numbers (xorshift32)
+static double Random(unsigned *state)
+{
+        unsigned x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *state = x;
+        return x / 4294967296.0 * 2.0 - 1.0;
+}
+
+// Roughly gaussian noise with standard deviation amp
+static double Noise(unsigned *state, double amp)
+{
+        return (Random(state) + Random(state) + Random(state)) * amp;
+}
+
+// Sample t of channel ch of the test signal
+static int Sample(const WacGenSpec *spec, unsigned *state, unsigned long t, int ch)
+{
+        double s = t / (double) spec->samplerate;
+        double v;
+
+        if (spec->signal == WACGEN_QUIET)
+        {
+                // Faint hum and background noise
+                v = 20.0 * sin(2 * M_PI * 60.0 * s + ch) + Noise(state, 12.0);
+        }
+        else
+        {
+                // A 5 ms call sweeping down from 35% to 15% of the sample rate every
+                // 50 ms, slightly later on the second channel
+                double c = fmod(s + ch * 0.0003, 0.05);
+
+                v = Noise(state, 300.0);
+                if (c < 0.005)
+                {
+                        double f0 = 0.35 * spec->samplerate;
+                        double f1 = 0.15 * spec->samplerate;
+                        double phase = 2 * M_PI * (f0 * c + (f1 - f0) * c * c / (2 * 0.005));
+
+                        v += 12000.0 * sin(M_PI * c / 0.005) * sin(phase);
+                }
+        }
+        if (v > 32767)
+        {
+                v = 32767;
+        }
+        if (v < -32768)
+        {
+                v = -32768;
+        }
+        return (int) lrint(v);
+}
+
+// Triggered files record in events of 24 frames with 40 zero frames between
+// them, and the second channel of a stereo file also misses every 5th frame
+static int ZeroChannel(const WacGenSpec *spec, int frame, int ch)
+{
+        if (!spec->triggered)
+        {
+                return 0;
+        }
+        if (frame % 64 >= 24)
+        {
+                return 1;
+        }
+        return ch == 1 && frame % 5 == 3;
+}
+
+int wacgen_make(const WacGenSpec *spec, double scale, unsigned char **data, size_t *len)
+{
+        WacGenBits B;
+        unsigned long samples = scale > 0 ? (unsigned long) (spec->samples * scale) : spec->samples;
+        int framesize = 256 / spec->channels;
+        int nframes = (int) ((samples + framesize - 1) / framesize);
+        int nblocks = (nframes + WACGEN_BLOCKSIZE - 1) / WACGEN_BLOCKSIZE;
+        int nseek = (nblocks + WACGEN_SEEKSIZE - 1) / WACGEN_SEEKSIZE;
+        int flags = spec->lossy | (spec->triggered ? 0x10 : 0) | (spec->gps ? 0x20 : 0) |
+                (spec->tag ? 0x40 : 0);
+        size_t hdrwords = (24 + 4 * nseek) / 2;
+        uint32_t *seektbl;
+        unsigned state = spec->seed * 2654435761u + 1;
+        unsigned long t = 0;
+        unsigned char *out;
+        int frame;
+        int i;
+
+        memset(&B, 0, sizeof(B));
+        seektbl = calloc(nseek > 0 ? nseek : 1, sizeof(uint32_t));
+        if (seektbl == NULL)
+        {
+                return WAC_ERR_NOMEM;
+        }
+
+        for (frame = 0; frame < nframes; frame++)
+        {
+                unsigned short codes[2][256];
+                int g[2];
+                int ch;
+
+                // Block header, with a GPS fix at each seek table entry
+                if (frame % WACGEN_BLOCKSIZE == 0)
+                {
+                        int block = frame / WACGEN_BLOCKSIZE;
+
+                        AlignBits(&B);
+                        if (block % WACGEN_SEEKSIZE == 0)
+                        {
+                                seektbl[block / WACGEN_SEEKSIZE] = (uint32_t) (hdrwords + B.nwords);
+                        }
+                        PutBits(&B, 0x8000, 16);
+                        PutBits(&B, 0x0001, 16);
+                        PutBits(&B, block & 0xffff, 16);
+                        PutBits(&B, (block >> 16) & 0xffff, 16);
+                        if (spec->gps && block % WACGEN_SEEKSIZE == 0)
+                        {
+                                long lat = 4255123 + block;  // 42.55123 N, drifting north
+                                long lon = 7139880 - block;  // 71.39880 W, drifting east
+
+                                PutBits(&B, (lat >> 16) & 0x1ff, 9);
+                                PutBits(&B, lat & 0xffff, 16);
+                                PutBits(&B, (lon >> 16) & 0x3ff, 10);
+                                PutBits(&B, lon & 0xffff, 16);
+                        }
+                        if (spec->tag)
+                        {
+                                PutBits(&B, (block / 8) % 5, 4);
+                        }
+                }
+
+                // Fold the deltas of each channel into codes and pick the code size
+                // giving the fewest bits
+                for (ch = 0; ch < spec->channels; ch++)
+                {
+                        int last = 0;
+                        unsigned long best = 0;
+
+                        for (i = 0; i < framesize; i++)
+                        {
+                                int v = Sample(spec, &state, t + i, ch) >> spec->lossy;
+                                int d = (short) (v - last);
+
+                                last = v;
+                                codes[ch][i] = (unsigned short) (d >= 0 ? 2 * d : -2 * d - 1);
+                        }
+                        g[ch] = 0;
+                        if (ZeroChannel(spec, frame, ch))
+                        {
+                                continue;
+                        }
+                        for (i = 1; i < 16; i++)
+                        {
+                                unsigned long bits = 0;
+                                int k;
+
+                                for (k = 0; k < framesize; k++)
+                                {
+                                        bits += i + 1 + (codes[ch][k] >> i);
+                                }
+                                if (g[ch] == 0 || bits < best)
+                                {
+                                        best = bits;
+                                        g[ch] = i;
+                                }
+                        }
+                }
+                t += framesize;
+
+                for (ch = 0; ch < spec->channels; ch++)
+                {
+                        PutBits(&B, g[ch], 4);
+                }
+                for (i = 0; i < framesize; i++)
+                {
+                        for (ch = 0; ch < spec->channels; ch++)
+                        {
+                                if (g[ch] != 0)
+                                {
+                                        PutCode(&B, codes[ch][i], g[ch]);
+                                }
+                        }
+                }
+        }
+        AlignBits(&B);
+        if (B.error)
+        {
+                free(B.words);
+                free(seektbl);
+                return WAC_ERR_NOMEM;
+        }
+
+        *len = hdrwords * 2 + B.nwords * 2;
+        *data = out = malloc(*len);
+        if (out == NULL)
+        {
+                free(B.words);
+                free(seektbl);
+                return WAC_ERR_NOMEM;
+        }
+
+        // Header (little-endian)
+        memcpy(out, "WAac", 4);
+        out[4] = 4;
+        out[5] = (unsigned char) spec->channels;
+        out[6] = framesize & 0xff;
+        out[7] = framesize >> 8;
+        out[8] = WACGEN_BLOCKSIZE;
+        out[9] = 0;
+        out[10] = flags & 0xff;
+        out[11] = flags >> 8;
+        for (i = 0; i < 4; i++)
+        {
+                out[12 + i] = (spec->samplerate >> (8 * i)) & 0xff;
+                out[16 + i] = (samples >> (8 * i)) & 0xff;
+        }
+        out[20] = WACGEN_SEEKSIZE;
+        out[21] = 0;
+        out[22] = nseek & 0xff;
+        out[23] = nseek >> 8;
+        for (i = 0; i < nseek; i++)
+        {
+                int k;
+
+                for (k = 0; k < 4; k++)
+                {
+                        out[24 + 4 * i + k] = (seektbl[i] >> (8 * k)) & 0xff;
+                }
+        }
+        for (i = 0; i < (int) B.nwords; i++)
+        {
+                out[hdrwords * 2 + 2 * i] = B.words[i] & 0xff;
+                out[hdrwords * 2 + 2 * i + 1] = B.words[i] >> 8;
+        }
+        free(B.words);
+        free(seektbl);
+        return WAC_OK;
+}
+
+#ifdef WACGEN_MAIN
+int main(int argc, char **argv)
+{
+        double scale = 0;
+        int i;
+
+        if (argc == 4 && !strcmp(argv[1], "-n"))
+        {
+                scale = atof(argv[2]);
+                argv += 2;
+                argc -= 2;
+        }
+        if (argc != 2)
+        {
+                fprintf(stderr, "usage: %s [-n scale] dir\n", argv[0]);
+                return 1;
+        }
+        for (i = 0; i < wacgen_corpus_size; i++)
+        {
+                char name[1024];
+                unsigned char *data;
+                size_t len;
+                FILE *fp;
+
+                if (wacgen_make(&wacgen_corpus[i], scale, &data, &len) != WAC_OK)
+                {
+                        fprintf(stderr, "%s: out of memory\n", wacgen_corpus[i].name);
+                        return 1;
+                }
+                snprintf(name, sizeof(name), "%s/%s.wac", argv[1], wacgen_corpus[i].name);
+                fp = fopen(name, "wb");
+                if (fp == NULL || fwrite(data, 1, len, fp) != len || fclose(fp) != 0)
+                {
+                        fprintf(stderr, "%s: cannot write\n", name);
+                        return 1;
+                }
+                free(data);
+        }
+        return 0;
+}
+#endif
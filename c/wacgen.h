@@ -0,0 +1,69 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wacgen.h
+//
+// Synthetic WAC files for benchmarks and tests.  Every file of the corpus is
+// generated from a fixed seed, so the same build always produces the same
+// bytes.
+//
+#ifndef WACGEN_H_   /* Include guard */
+#define WACGEN_H_
+
+#include "wac2wav.h"
+
+// Test signals
+#define WACGEN_QUIET 0 // low-level background noise
+#define WACGEN_LOUD  1 // loud frequency-swept calls over noise
+
+// Description of one synthetic file
+typedef struct
+{
+        const char *name;       // corpus name (file name without .wac)
+        int channels;           // 1 (256-sample frames) or 2 (128-sample frames)
+        int lossy;              // WAC0-WAC4 (dropped least-significant bits)
+        int gps;                // GPS fix at every seek table entry
+        int tag;                // tag in every block
+        int triggered;          // triggered file with zero frames between events
+        int signal;             // WACGEN_xxx
+        int samplerate;         // sample rate in Hz
+        unsigned long samples;  // samples per channel
+        unsigned seed;          // random seed
+} WacGenSpec;
+
+// The standard corpus
+extern const WacGenSpec wacgen_corpus[];
+extern const int wacgen_corpus_size;
+
+// Generate the file described by spec (with samples scaled by scale, if not
+// zero) into a malloc()ed buffer.  Returns WAC_OK or WAC_ERR_NOMEM.
+int wacgen_make(const WacGenSpec *spec, double scale, unsigned char **data, size_t *len);
+
+#endif // WACGEN_H_
@@ -0,0 +1,1326 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2014-2017 Wildlife Acoustics, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Wildlife Acoustics, Inc.
+// 3 Mill and Main Place, Suite 210
+// Maynard, MA 01754-2657
+// +1 978 369 5225
+// www.wildlifeacoustics.com
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// wactest.c
+//
+// Bit-exactness checks of the faster decode paths against the reference
+// engine (the original bit-by-bit Golomb decoder with the scalar
+// reconstruction loop).  Each file of the synthetic corpus of wacgen.c, plus
+// any WAC files named on the command line, is decoded with the reference
+// engine and the hash of its samples compared with that of:
+//
+//    - the fast engine with each reconstruction kernel
+//    - multi-threaded decoding, from memory and from a file
+//    - the WAV writers, single and multi-threaded, and pipelined to a file
+//    - batch conversion, with more workers than files
+//    - the segment files and index of triggered files
+//    - truncated mode, on a copy of the file cut off half-way
+//    - random-access decoding of random ranges with both engines
+//    - streaming through wac_read() in chunks of assorted sizes
+//
+// wac_verify() and recover mode are also checked, on the file and on a copy
+// with a damaged block header, and threads on a copy with no seek table.
+// Finally the samples are re-encoded with wacenc.c and decoded again.
+//
+//    wactest [-n scale] [file.wac ...]
+//
+// Prints one line per failed check and a summary, and exits non-zero if any
+// check failed.
+//
+#include "wacgen.h"
+#include "wacenc.h"
+
+// Number of threads for the multi-threaded checks and number of random ranges
+#define TEST_THREADS 4
+#define TEST_RANGES  24
+
+static int checks;
+static int failures;
+
+// A file under test: its data, and a file holding it for the file checks
+typedef struct
+{
+        const char *name;
+        unsigned char *data;
+        size_t len;
+        const char *path;
+        int generated;          // set for the synthetic corpus
+} TestFile;
+
+// 64-bit FNV-1a hash
+static uint64_t Hash(const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        uint64_t h = 14695981039346656037ULL;
+        size_t i;
+
+        for (i = 0; i < len; i++)
+        {
+                h = (h ^ p[i]) * 1099511628211ULL;
+        }
+        return h;
+}
+
+static void Check(const TestFile *TP, const char *what, int ok)
+{
+        checks++;
+        if (!ok)
+        {
+                failures++;
+                printf("FAIL %s: %s\n", TP->name, what);
+        }
+}
+
+static unsigned Random(unsigned *state)
+{
+        unsigned x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return *state = x;
+}
+
+// Open the file under test from memory (or from its file if path is set)
+static int Open(const TestFile *TP, WacDecoder **D, const WacOptions *opts, const char *path)
+{
+        int err = path != NULL ? wac_open(D, path, opts) : wac_open_mem(D, TP->data, TP->len, opts);
+
+        if (err != WAC_OK)
+        {
+                printf("FAIL %s: open: %s\n", TP->name, wac_errmsg(*D));
+                failures++;
+                wac_close(*D);
+                *D = NULL;
+        }
+        return err;
+}
+
+// Hash of all of the samples decoded with opts, or 0 if decoding failed
+static uint64_t DecodeHash(const TestFile *TP, const WacOptions *opts, const char *path,
+                           short *pcm, size_t n)
+{
+        WacDecoder *D;
+        uint64_t h = 0;
+
+        if (Open(TP, &D, opts, path) != WAC_OK)
+        {
+                return 0;
+        }
+        memset(pcm, 0x55, n * sizeof(short));
+        if (wac_decode_all(D, pcm) == WAC_OK)
+        {
+                h = Hash(pcm, n * sizeof(short));
+        }
+        wac_close(D);
+        return h;
+}
+
+// Check the WAV writer: the header is the same for every option set and the
+// samples follow it
+static void CheckWav(const TestFile *TP, const WacOptions *opts, const short *ref, size_t n,
+                     const char *what)
+{
+        static unsigned char header[44];
+        WacDecoder *D;
+        unsigned char *wav;
+        size_t len;
+
+        if (Open(TP, &D, opts, NULL) != WAC_OK)
+        {
+                return;
+        }
+        len = (size_t) wac_wav_size(D);
+        wav = malloc(len);
+        Check(TP, what, wav != NULL && wac_wav_size(D) == 44 + n * sizeof(short) &&
+              wac_write_wav_mem(D, wav, len) == WAC_OK &&
+              (opts->threads <= 1 || !memcmp(header, wav, 44)) &&
+              !memcmp(wav + 44, ref, n * sizeof(short)));
+        if (wav != NULL && opts->threads <= 1)
+        {
+                memcpy(header, wav, 44);
+        }
+        free(wav);
+        wac_close(D);
+}
+
+static char *TempFile(const unsigned char *data, size_t len);
+static unsigned char *ReadFile(const char *path, size_t *len);
+static int Damage(const TestFile *TP, TestFile *bad);
+
+// Check a WAV file written by wac_write_wav() (from the file under test)
+static void CheckWavFile(const TestFile *TP, const WacOptions *opts, const short *ref, size_t n,
+                         const char *what)
+{
+        WacDecoder *D;
+        char *dest = TempFile(NULL, 0);
+        unsigned char *wav = NULL;
+        size_t len = 0;
+        int err;
+
+        if (dest == NULL || Open(TP, &D, opts, TP->path) != WAC_OK)
+        {
+                Check(TP, what, 0);
+                free(dest);
+                return;
+        }
+        err = wac_write_wav(D, dest);
+        wac_close(D);
+        if (err == WAC_OK)
+        {
+                wav = ReadFile(dest, &len);
+        }
+        Check(TP, what, wav != NULL && len == 44 + n * sizeof(short) &&
+              !memcmp(wav + 44, ref, n * sizeof(short)));
+        unlink(dest);
+        free(dest);
+        free(wav);
+}
+
+static size_t LE32(const unsigned char *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (size_t) p[3] << 24;
+}
+
+// Truncated mode on a copy of the file cut off half-way: the WAV file holds
+// the frames before the cut, and its header has been fixed up to match.
+// With the sample count in the WAC header zeroed as well (length unknown)
+// the header keeps room for an RF64 ds64 chunk, as a JUNK chunk.
+static void CheckTruncated(const TestFile *TP, const short *ref, size_t n)
+{
+        TestFile cut = *TP;
+        WacOptions opts;
+        int unknown;
+
+        memset(&opts, 0, sizeof(opts));
+        opts.truncated = 1;
+        cut.len = TP->len / 2;
+        for (unknown = 0; unknown < 2; unknown++)
+        {
+                const char *what = unknown ? "truncated copy, unknown length" : "truncated copy";
+                size_t hdr = unknown ? 80 : 44;
+                char *dest = TempFile(NULL, 0);
+                unsigned char *wav = NULL;
+                WacDecoder *D;
+                size_t len = 0;
+                int err;
+
+                if (unknown && (cut.data = malloc(cut.len)) != NULL)
+                {
+                        memcpy(cut.data, TP->data, cut.len);
+                        memset(cut.data + 16, 0, 4);
+                }
+                if (dest == NULL || cut.data == NULL || Open(&cut, &D, &opts, NULL) != WAC_OK)
+                {
+                        Check(TP, what, 0);
+                        free(dest);
+                        break;
+                }
+                err = wac_write_wav(D, dest);
+                wac_close(D);
+                if (err == WAC_OK)
+                {
+                        wav = ReadFile(dest, &len);
+                }
+                Check(TP, what, wav != NULL && len > hdr && len - hdr < n * sizeof(short) &&
+                      !memcmp(wav, "RIFF", 4) && LE32(wav + 4) == len - 8 &&
+                      (!unknown || (!memcmp(wav + 12, "JUNK", 4) && LE32(wav + 16) == 28)) &&
+                      !memcmp(wav + hdr - 8, "data", 4) && LE32(wav + hdr - 4) == len - hdr &&
+                      !memcmp(wav + hdr, ref, len - hdr));
+                unlink(dest);
+                free(dest);
+                free(wav);
+        }
+        if (cut.data != TP->data)
+        {
+                free(cut.data);
+        }
+}
+
+// The file joined to itself three times, with threads, is the reference
+// three times over.  A file with another sample rate cannot be joined to it,
+// and stops the others being converted (and the WAV file being created).
+static void CheckConcat(const TestFile *TP, const short *ref, size_t n)
+{
+        char *dest = TempFile(NULL, 0);
+        char *other = NULL;
+        unsigned char *data = malloc(TP->len);
+        unsigned char *wav = NULL;
+        WacJob jobs[3];
+        size_t len = 0;
+        int err, i;
+
+        memset(jobs, 0, sizeof(jobs));
+        for (i = 0; i < 3; i++)
+        {
+                jobs[i].srcfile = TP->path;
+        }
+        if (dest != NULL && wac_concat(jobs, 3, dest, TEST_THREADS, NULL) == WAC_OK)
+        {
+                wav = ReadFile(dest, &len);
+        }
+        for (i = 0; i < 3 && wav != NULL && len == 44 + 3 * n * sizeof(short); i++)
+        {
+                if (memcmp(wav + 44 + i * n * sizeof(short), ref, n * sizeof(short)) != 0)
+                {
+                        break;
+                }
+        }
+        Check(TP, "concat, threads", i == 3 && LE32(wav + 40) == 3 * n * sizeof(short));
+        free(wav);
+
+        if (data != NULL)
+        {
+                memcpy(data, TP->data, TP->len);
+                data[12] ^= 1;
+                other = TempFile(data, TP->len);
+        }
+        jobs[1].srcfile = other;
+        if (dest != NULL)
+        {
+                unlink(dest);
+        }
+        err = other != NULL ? wac_concat(jobs, 3, dest, TEST_THREADS, NULL) : WAC_OK;
+        Check(TP, "concat, other sample rate", err == WAC_ERR_FORMAT && jobs[0].skipped &&
+              jobs[1].status == WAC_ERR_FORMAT && !jobs[1].skipped && jobs[2].skipped &&
+              access(dest, F_OK) != 0);
+        if (other != NULL)
+        {
+                unlink(other);
+        }
+        if (dest != NULL)
+        {
+                unlink(dest);
+        }
+        free(other);
+        free(dest);
+        free(data);
+}
+
+// The file converted three times over by wac_batch(), with more workers than
+// files, gives the reference each time, and again with update set all three
+// are skipped.  A damaged copy fails and leaves no WAV file behind, whether
+// it is split between the workers or written through mmap.
+static void CheckBatch(const TestFile *TP, const short *ref, size_t n)
+{
+        struct timespec old[2];
+        WacOptions opts;
+        TestFile bad;
+        WacJob jobs[4];
+        int i, mmap;
+
+        memset(&opts, 0, sizeof(opts));
+        memset(jobs, 0, sizeof(jobs));
+        for (i = 0; i < 3; i++)
+        {
+                jobs[i].srcfile = TP->path;
+                jobs[i].destfile = TempFile(NULL, 0);
+        }
+        if (jobs[0].destfile != NULL && jobs[1].destfile != NULL && jobs[2].destfile != NULL &&
+            wac_batch(jobs, 3, 2 * TEST_THREADS, &opts) == WAC_OK)
+        {
+                for (i = 0; i < 3; i++)
+                {
+                        unsigned char *wav;
+                        size_t len = 0;
+
+                        wav = ReadFile(jobs[i].destfile, &len);
+                        if (wav == NULL || len != 44 + n * sizeof(short) || jobs[i].skipped ||
+                            memcmp(wav + 44, ref, n * sizeof(short)) != 0)
+                        {
+                                free(wav);
+                                break;
+                        }
+                        free(wav);
+                }
+        }
+        else
+        {
+                i = 0;
+        }
+        Check(TP, "batch, more workers than files", i == 3);
+
+        // Back-date the WAC file, as files written in the same second are redone
+        old[0].tv_sec = old[1].tv_sec = time(NULL) - 60;
+        old[0].tv_nsec = old[1].tv_nsec = 0;
+        opts.update = 1;
+        Check(TP, "batch, update", i == 3 && utimensat(AT_FDCWD, TP->path, old, 0) == 0 &&
+              wac_batch(jobs, 3, 2 * TEST_THREADS, &opts) == WAC_OK &&
+              jobs[0].skipped && jobs[1].skipped && jobs[2].skipped);
+        opts.update = 0;
+
+        if (Damage(TP, &bad) && (jobs[3].srcfile = TempFile(bad.data, bad.len)) != NULL)
+        {
+                for (mmap = 0; mmap < 2; mmap++)
+                {
+                        opts.mmap = mmap;
+                        jobs[3].destfile = jobs[0].destfile;
+                        Check(TP, mmap ? "batch, damaged copy, mmap" : "batch, damaged copy",
+                              wac_batch(jobs + 3, 1, TEST_THREADS, &opts) == WAC_ERR_BLOCK &&
+                              jobs[3].status == WAC_ERR_BLOCK && access(jobs[3].destfile, F_OK) != 0);
+                }
+                unlink(jobs[3].srcfile);
+                free((char *) jobs[3].srcfile);
+        }
+        free(bad.data);
+        for (i = 0; i < 3; i++)
+        {
+                if (jobs[i].destfile != NULL)
+                {
+                        unlink(jobs[i].destfile);
+                }
+                free((char *) jobs[i].destfile);
+        }
+}
+
+// A triggered file split into one WAV file per segment, then written as one
+// WAV file with a CSV index: each segment is its stretch of the reference,
+// and the index gives where it starts in the recording and in the WAV file.
+// A WAV file name too long for the segment names is refused.
+static void CheckTriggers(const TestFile *TP, const short *ref, int channels)
+{
+        const WacSegment *segs;
+        char *base = TempFile(NULL, 0);
+        char name[1100];
+        unsigned char *wav;
+        WacOptions opts;
+        WacDecoder *D;
+        size_t len, pos;
+        int err, i, nsegs = 0;
+        FILE *fp;
+
+        memset(&opts, 0, sizeof(opts));
+        if (base == NULL || Open(TP, &D, &opts, NULL) != WAC_OK)
+        {
+                Check(TP, "triggers, split", 0);
+                free(base);
+                return;
+        }
+        err = wac_write_wav(D, base);
+        nsegs = err == WAC_OK ? wac_segments(D, &segs) : 0;
+        for (i = 0; i < nsegs; i++)
+        {
+                size_t bytes = (size_t) segs[i].length * channels * sizeof(short);
+
+                sprintf(name, "%s_%04d.wav", base, i);
+                wav = ReadFile(name, &len);
+                unlink(name);
+                if (wav == NULL || len != 44 + bytes || LE32(wav + 40) != bytes ||
+                    memcmp(wav + 44, ref + (size_t) segs[i].start * channels, bytes) != 0)
+                {
+                        free(wav);
+                        break;
+                }
+                free(wav);
+        }
+        sprintf(name, "%s_%04d.wav", base, nsegs);
+        Check(TP, "triggers, split", nsegs > 0 && i == nsegs && access(name, F_OK) != 0);
+        wac_close(D);
+
+        opts.triggers = WAC_TRIGGER_INDEX;
+        sprintf(name, "%s.wav", base);
+        wav = NULL;
+        if (Open(TP, &D, &opts, NULL) != WAC_OK)
+        {
+                Check(TP, "triggers, index", 0);
+                unlink(base);
+                free(base);
+                return;
+        }
+        err = wac_write_wav(D, name);
+        nsegs = err == WAC_OK ? wac_segments(D, &segs) : 0;
+        if (nsegs > 0)
+        {
+                wav = ReadFile(name, &len);
+        }
+        unlink(name);
+        sprintf(name, "%s_segments.csv", base);
+        fp = fopen(name, "r");
+        pos = 0;
+        i = -1;
+        if (wav != NULL && len >= 44 && LE32(wav + 40) == len - 44 && fp != NULL &&
+            fscanf(fp, "segment,start,length,offset,start_seconds ") == 0)
+        {
+                int index;
+                unsigned long start, length, offset;
+                double seconds;
+
+                for (i = 0; i < nsegs; i++)
+                {
+                        size_t bytes = (size_t) segs[i].length * channels * sizeof(short);
+
+                        if (fscanf(fp, "%d,%lu,%lu,%lu,%lf ", &index, &start, &length, &offset, &seconds) != 5 ||
+                            index != i || start != segs[i].start || length != segs[i].length ||
+                            offset * channels * sizeof(short) != pos || 44 + pos + bytes > len ||
+                            memcmp(wav + 44 + pos, ref + (size_t) start * channels, bytes) != 0)
+                        {
+                                break;
+                        }
+                        pos += bytes;
+                }
+        }
+        Check(TP, "triggers, index", i == nsegs && 44 + pos == len && fp != NULL && fgetc(fp) == EOF);
+        if (fp != NULL)
+        {
+                fclose(fp);
+        }
+        unlink(name);
+        free(wav);
+        wac_close(D);
+
+        memset(name, 'x', sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        opts.triggers = WAC_TRIGGER_SPLIT;
+        if (Open(TP, &D, &opts, NULL) == WAC_OK)
+        {
+                Check(TP, "triggers, name too long", wac_write_wav(D, name) == WAC_ERR_ARG);
+                wac_close(D);
+        }
+        unlink(base);
+        free(base);
+}
+
+// Compare a Hann-windowed spectrogram with overlapping windows against a
+// direct DFT of the reference decode at a few columns, and the file written
+// by wac_write_spectrogram() against the one in memory
+static void CheckSpectrogram(const TestFile *TP, const short *ref, unsigned long samples, int channels)
+{
+        const double pi = 3.14159265358979323846;
+        WacSpecOptions so;
+        WacSpecInfo si;
+        WacDecoder *D;
+        float *spec = NULL;
+        unsigned char *file = NULL;
+        char *dest = TP->path != NULL ? TempFile(NULL, 0) : NULL;
+        size_t len = 0;
+        unsigned long col;
+        int ok = 0;
+
+        memset(&so, 0, sizeof(so));
+        so.fftsize = 64;
+        so.hop = 48;
+        if (Open(TP, &D, NULL, NULL) != WAC_OK)
+        {
+                free(dest);
+                return;
+        }
+        if (wac_spectrogram_info(D, &so, &si) == WAC_OK && si.channels == channels && si.bins == 33 &&
+            si.columns == (samples < 64 ? 0 : 1 + (samples - 64) / 48) &&
+            (spec = malloc(si.size + 1)) != NULL && wac_spectrogram(D, &so, spec) == WAC_OK)
+        {
+                ok = 1;
+        }
+        for (col = 0; ok && col < si.columns; col += col < 2 ? 1 : (si.columns - col - 1) / 2 + 1)
+        {
+                const short *x = ref + col * 48 * channels;
+                int c, k, i;
+
+                for (c = 0; c < channels; c++)
+                {
+                        for (k = 0; k < si.bins; k++)
+                        {
+                                double re = 0, im = 0, m;
+
+                                for (i = 0; i < 64; i++)
+                                {
+                                        double v = x[i * channels + c] / 32768.0 * (0.5 - 0.5 * cos(2 * pi * i / 64));
+                                        re += v * cos(2 * pi * k * i / 64);
+                                        im -= v * sin(2 * pi * k * i / 64);
+                                }
+                                m = sqrt(re * re + im * im) * 2 / 32 / (k == 0 || k == 32 ? 2 : 1);
+                                ok &= fabs(spec[(col * channels + c) * si.bins + k] - m) < 1e-4;
+                        }
+                }
+        }
+        Check(TP, "spectrogram", ok);
+
+        if (dest != NULL)
+        {
+                ok = ok && wac_write_spectrogram(D, &so, dest) == WAC_OK &&
+                        (file = ReadFile(dest, &len)) != NULL && len == 32 + si.size &&
+                        memcmp(file, "WSPC", 4) == 0 && LE32(file + 16) == si.columns &&
+                        memcmp(file + 32, spec, si.size) == 0;
+                Check(TP, "spectrogram file", ok);
+                unlink(dest);
+        }
+        wac_close(D);
+        free(file);
+        free(spec);
+        free(dest);
+}
+
+// Progress callback for CheckMetrics(): keeps the last report and asks to
+// stop once stop samples have been decoded (if stop is set)
+typedef struct
+{
+        WacProgress last;
+        int calls;
+        unsigned long stop;
+} TestProgress;
+
+static int TestProgressFn(void *ctx, const WacProgress *progress)
+{
+        TestProgress *PP = ctx;
+
+        PP->last = *progress;
+        PP->calls++;
+        return PP->stop > 0 && progress->samples >= PP->stop;
+}
+
+// Check the metrics of a full decode against the header and that progress
+// is reported up to the end, or can stop the decode, with and without threads
+static void CheckMetrics(const TestFile *TP, const WacInfo *info, short *pcm)
+{
+        unsigned long frames = (info->samplecount + info->framesize - 1) / info->framesize;
+        unsigned long blocks = (frames + info->blocksize - 1) / info->blocksize;
+        WacOptions opts;
+        WacDecoder *D;
+        WacMetrics m;
+        TestProgress P;
+        int threads, ch, i;
+
+        memset(&opts, 0, sizeof(opts));
+        opts.metrics = 1;
+        for (threads = 1; threads <= TEST_THREADS; threads += TEST_THREADS - 1)
+        {
+                const char *what = threads > 1 ? "metrics, threads" : "metrics";
+                unsigned long codes = 0, quotients = 0;
+                int ok;
+
+                opts.threads = threads;
+                if (Open(TP, &D, &opts, NULL) != WAC_OK)
+                {
+                        return;
+                }
+                memset(&P, 0, sizeof(P));
+                ok = wac_set_progress(D, TestProgressFn, &P, 1e-9) == WAC_OK &&
+                        wac_decode_all(D, pcm) == WAC_OK;
+                wac_metrics(D, &m);
+                for (ch = 0; ch < info->channelcount; ch++)
+                {
+                        unsigned long sum = 0;
+
+                        for (i = 0; i < 16; i++)
+                        {
+                                sum += m.codesizes[ch][i];
+                        }
+                        ok &= sum == frames;
+                        codes += (frames - m.codesizes[ch][0]) * info->framesize;
+                }
+                for (i = 0; i < WAC_METRICS_QUOTIENTS; i++)
+                {
+                        quotients += m.quotients[i];
+                }
+                Check(TP, what, ok && m.frames == frames && m.blocks == blocks && m.zeroframes <= frames &&
+                      m.bytesin > 0 && m.bytesout == info->samplecount * info->channelcount * sizeof(short) &&
+                      quotients == codes && m.seconds >= 0 && m.decodeseconds >= 0 &&
+                      P.calls > 0 && P.last.samples == info->samplecount && P.last.total == info->samplecount);
+
+                // Stop at the second block header (or at one of the workers')
+                if (blocks > 1)
+                {
+                        memset(&P, 0, sizeof(P));
+                        P.stop = 1;
+                        Check(TP, threads > 1 ? "progress cancel, threads" : "progress cancel",
+                              wac_decode_all(D, pcm) == WAC_ERR_CANCEL && P.last.samples < info->samplecount);
+                }
+                wac_close(D);
+        }
+}
+
+// Decode random ranges (and the ones at the very end) and compare them with
+// the full decode
+static void CheckRanges(const TestFile *TP, const WacOptions *opts, const short *ref,
+                        unsigned long samples, int channels, const char *what)
+{
+        WacDecoder *D;
+        short *out;
+        unsigned state = 12345;
+        int ok = 1;
+        int i;
+
+        if (Open(TP, &D, opts, NULL) != WAC_OK)
+        {
+                return;
+        }
+        out = malloc((samples + 1) * channels * sizeof(short));
+        for (i = 0; out != NULL && i < TEST_RANGES; i++)
+        {
+                unsigned long start, count, got, want;
+
+                if (i == 0)
+                {
+                        start = samples - 1;
+                        count = 1000;
+                }
+                else if (i == 1)
+                {
+                        start = 0;
+                        count = samples + 1;
+                }
+                else if (i == 2)
+                {
+                        // "Everything from start"
+                        start = samples / 2;
+                        count = (unsigned long) -1;
+                }
+                else
+                {
+                        start = Random(&state) % samples;
+                        count = 1 + Random(&state) % (i < TEST_RANGES / 2 ? 700 : 70000);
+                }
+                want = count < samples - start ? count : samples - start;
+                if (wac_decode_range(D, start, count, out, &got) != WAC_OK || got != want ||
+                    memcmp(out, ref + start * channels, got * channels * sizeof(short)))
+                {
+                        ok = 0;
+                }
+        }
+        if (opts->cache > 0)
+        {
+                WacCacheStats cs;
+
+                // The wide ranges are bound to meet entries decoded before
+                wac_cache_stats(D, &cs);
+                ok = ok && cs.hits > 0 && cs.misses > 0 && cs.used > 0 && cs.used <= cs.slots;
+        }
+        Check(TP, what, out != NULL && ok);
+        free(out);
+        wac_close(D);
+}
+
+// Stream the file through wac_read() in chunks of assorted sizes
+static void CheckStream(const TestFile *TP, const short *ref, unsigned long samples, int channels)
+{
+        static const unsigned long chunks[] = { 1, 7, 128, 256, 301, 4096, 65536 };
+        WacDecoder *D;
+        short *out;
+        unsigned long pos = 0;
+        int ok = 1;
+        int i = 0;
+
+        if (Open(TP, &D, NULL, NULL) != WAC_OK)
+        {
+                return;
+        }
+        out = malloc(65536 * channels * sizeof(short));
+        while (out != NULL && ok)
+        {
+                unsigned long got;
+
+                if (wac_read(D, out, chunks[i++ % 7], &got) != WAC_OK)
+                {
+                        ok = 0;
+                }
+                else if (got == 0)
+                {
+                        break;
+                }
+                else if (pos + got > samples ||
+                         memcmp(out, ref + pos * channels, got * channels * sizeof(short)))
+                {
+                        ok = 0;
+                }
+                pos += got;
+        }
+        Check(TP, "streaming", out != NULL && ok && pos == samples);
+        free(out);
+        wac_close(D);
+}
+
+// Make a copy of the file with the first block header in its second half
+// damaged.  Returns 0 if there is none.
+static int Damage(const TestFile *TP, TestFile *bad)
+{
+        size_t i;
+
+        *bad = *TP;
+        if ((bad->data = malloc(TP->len)) == NULL)
+        {
+                return 0;
+        }
+        memcpy(bad->data, TP->data, TP->len);
+        for (i = TP->len / 2 & ~(size_t) 1; i + 8 <= TP->len; i += 2)
+        {
+                if (bad->data[i] == 0x00 && bad->data[i + 1] == 0x80 && bad->data[i + 2] == 0x01 &&
+                    bad->data[i + 3] == 0x00)
+                {
+                        bad->data[i + 1] = 0x7f;
+                        return 1;
+                }
+        }
+        free(bad->data);
+        bad->data = NULL;
+        return 0;
+}
+
+// Verify the file, then a copy with the header of the middle block damaged
+static void CheckVerify(const TestFile *TP, unsigned long samples)
+{
+        TestFile bad;
+        WacDecoder *D;
+        WacVerify v;
+
+        if (Open(TP, &D, NULL, NULL) != WAC_OK)
+        {
+                return;
+        }
+        Check(TP, "verify", wac_verify(D, &v) == WAC_OK && v.badblock < 0 && v.samples == samples);
+        wac_close(D);
+
+        if (Damage(TP, &bad) && Open(&bad, &D, NULL, NULL) == WAC_OK)
+        {
+                WacInfo info;
+
+                wac_info(D, &info);
+                Check(TP, "verify damaged copy", wac_verify(D, &v) == WAC_ERR_BLOCK && v.badblock > 0 &&
+                      v.frames == (unsigned long) v.badblock * info.blocksize);
+                wac_close(D);
+        }
+        free(bad.data);
+}
+
+// A GPS file whose header has a seek size of 0 (GPS fixes are at every seek
+// size blocks) must be refused rather than crash the decoder
+static void CheckBadSeekSize(const TestFile *TP)
+{
+        unsigned char *data = malloc(TP->len);
+        WacDecoder *D = NULL;
+        int err;
+
+        if (data == NULL)
+        {
+                Check(TP, "out of memory", 0);
+                return;
+        }
+        memcpy(data, TP->data, TP->len);
+        data[20] = data[21] = 0;
+        err = wac_open_mem(&D, data, TP->len, NULL);
+        Check(TP, "zero seek size", err == WAC_ERR_FORMAT);
+        wac_close(D);
+        free(data);
+}
+
+// Recover mode on the damaged copy: one gap, silence in it and the recording
+// everywhere else, with and without threads.  A copy with the seek table
+// zeroed must decode the same with threads (from the rebuilt table).
+static void CheckRecover(const TestFile *TP, const short *ref, short *pcm, size_t n, uint64_t h)
+{
+        TestFile bad;
+        WacOptions opts;
+        WacDecoder *D;
+        WacInfo info;
+        const WacGap *gaps;
+        int threads;
+
+        memset(&opts, 0, sizeof(opts));
+        opts.recover = 1;
+        for (threads = 1; threads <= TEST_THREADS; threads += TEST_THREADS - 1)
+        {
+                const char *what = threads > 1 ? "recover, threads" : "recover";
+                size_t lo, hi;
+
+                opts.threads = threads;
+                if (!Damage(TP, &bad))
+                {
+                        return;
+                }
+                if (Open(&bad, &D, &opts, NULL) != WAC_OK)
+                {
+                        free(bad.data);
+                        return;
+                }
+                wac_info(D, &info);
+                memset(pcm, 0x55, n * sizeof(short));
+                if (wac_decode_all(D, pcm) != WAC_OK || wac_gaps(D, &gaps) != 1 ||
+                    gaps[0].length != (unsigned long) info.blocksize * info.framesize)
+                {
+                        Check(TP, what, 0);
+                }
+                else
+                {
+                        size_t i;
+
+                        lo = gaps[0].sample * info.channelcount;
+                        hi = lo + gaps[0].length * info.channelcount;
+                        hi = hi < n ? hi : n;
+                        for (i = lo; i < hi && pcm[i] == 0; i++)
+                        {
+                        }
+                        Check(TP, what, i == hi && !memcmp(pcm, ref, lo * sizeof(short)) &&
+                              !memcmp(pcm + hi, ref + hi, (n - hi) * sizeof(short)));
+                }
+                wac_close(D);
+                free(bad.data);
+        }
+
+        bad = *TP;
+        bad.path = NULL;
+        if (TP->len < 24 || (bad.data = malloc(TP->len)) == NULL)
+        {
+                return;
+        }
+        memcpy(bad.data, TP->data, TP->len);
+        memset(bad.data + 24, 0, 4 * (size_t) (TP->data[22] | TP->data[23] << 8));
+        opts.recover = 0;
+        opts.threads = TEST_THREADS;
+        Check(TP, "zeroed seek table, threads", DecodeHash(&bad, &opts, NULL, pcm, n) == h);
+        free(bad.data);
+}
+
+// Decode WAC data from memory and compare it with ref
+static int SameDecode(const unsigned char *data, size_t len, const WacOptions *opts,
+                      const short *ref, short *pcm, size_t n)
+{
+        WacDecoder *D;
+        WacInfo info;
+        int ok;
+
+        if (wac_open_mem(&D, data, len, opts) != WAC_OK)
+        {
+                wac_close(D);
+                return 0;
+        }
+        wac_info(D, &info);
+        ok = (size_t) info.samplecount * info.channelcount == n && wac_decode_all(D, pcm) == WAC_OK &&
+                !memcmp(pcm, ref, n * sizeof(short));
+        wac_close(D);
+        return ok;
+}
+
+// Re-encode the reference decode with the file's lossy level, flags, GPS
+// fixes and tags and check that it decodes to the same samples, with and
+// without threads and from a WAV file.  The synthetic files come back byte
+// for byte (but for a short last frame, which wacgen.c fills from the
+// signal).  The lossy levels are checked on the lossless files and small
+// blocks and seek table entries on all of them.
+static void CheckEncode(const TestFile *TP, const WacInfo *info, const short *ref, short *pcm,
+                        size_t n)
+{
+        WacEncOptions eopts;
+        WacOptions opts;
+        WacDecoder *D;
+        WacProbe probe;
+        unsigned char *data = NULL, *other = NULL;
+        size_t len = 0, olen = 0;
+        size_t i;
+        int ok;
+
+        if (Open(TP, &D, NULL, NULL) != WAC_OK)
+        {
+                return;
+        }
+        memset(&opts, 0, sizeof(opts));
+        memset(&eopts, 0, sizeof(eopts));
+        eopts.lossy = info->flags & 0x0f;
+        eopts.triggered = (info->flags & 0x10) != 0;
+        if (wac_probe(D, &probe) == WAC_OK)
+        {
+                eopts.ngps = probe.ngps;
+                eopts.gps = probe.gps;
+                eopts.ntags = probe.ntags;
+                eopts.tags = probe.tags;
+        }
+        eopts.threads = 1;
+        ok = wac_encode(ref, info->samplecount, info->channelcount, info->samplerate, &eopts,
+                        &data, &len, NULL) == WAC_OK;
+        Check(TP, "encode, round trip", ok && SameDecode(data, len, &opts, ref, pcm, n));
+        if (TP->generated && info->samplecount % info->framesize == 0)
+        {
+                Check(TP, "encode, same bytes", ok && len == TP->len && !memcmp(data, TP->data, len));
+        }
+
+        eopts.threads = TEST_THREADS;
+        Check(TP, "encode, threads", ok && wac_encode(ref, info->samplecount, info->channelcount,
+                                                      info->samplerate, &eopts, &other, &olen,
+                                                      NULL) == WAC_OK &&
+              olen == len && !memcmp(other, data, len));
+        free(other);
+        other = NULL;
+
+        // From a WAV file
+        if (!(info->flags & 0x10))
+        {
+                char *wav = TempFile(NULL, 0);
+                char *dest = TempFile(NULL, 0);
+
+                ok = wav != NULL && dest != NULL && wac_write_wav(D, wav) == WAC_OK &&
+                        wac_encode_wav(wav, dest, &eopts, NULL) == WAC_OK &&
+                        (other = ReadFile(dest, &olen)) != NULL;
+                Check(TP, "encode, WAV file", ok && olen == len && !memcmp(other, data, len));
+                free(other);
+                other = NULL;
+                if (wav != NULL)
+                {
+                        unlink(wav);
+                }
+                if (dest != NULL)
+                {
+                        unlink(dest);
+                }
+                free(wav);
+                free(dest);
+        }
+        free(data);
+        data = NULL;
+
+        // Small blocks and seek table entries, decoded through the seek table
+        eopts.blocksize = 5;
+        eopts.seeksize = 3;
+        opts.threads = TEST_THREADS;
+        Check(TP, "encode, small blocks", wac_encode(ref, info->samplecount, info->channelcount,
+                                                     info->samplerate, &eopts, &data, &len,
+                                                     NULL) == WAC_OK &&
+              SameDecode(data, len, &opts, ref, pcm, n));
+        free(data);
+        data = NULL;
+        wac_close(D); // holds the GPS fixes and tags
+
+        // Lossy levels: every sample within half a step (a whole step at the
+        // top of the range)
+        if ((info->flags & 0x0f) == 0)
+        {
+                WacEncOptions lopts;
+                int lossy;
+
+                for (lossy = 1; lossy <= 4; lossy += 3)
+                {
+                        memset(&lopts, 0, sizeof(lopts));
+                        lopts.lossy = lossy;
+                        lopts.threads = TEST_THREADS;
+                        lopts.triggered = eopts.triggered;
+                        D = NULL;
+                        ok = wac_encode(ref, info->samplecount, info->channelcount, info->samplerate,
+                                        &lopts, &data, &len, NULL) == WAC_OK &&
+                                wac_open_mem(&D, data, len, NULL) == WAC_OK &&
+                                wac_decode_all(D, pcm) == WAC_OK;
+                        for (i = 0; ok && i < n; i++)
+                        {
+                                int err = ref[i] - pcm[i];
+
+                                ok = pcm[i] % (1 << lossy) == 0 && (abs(err) <= 1 << (lossy - 1) ||
+                                                                    (err > 0 && err < 1 << lossy));
+                        }
+                        Check(TP, lossy == 1 ? "encode, WAC1" : "encode, WAC4", ok);
+                        wac_close(D);
+                        free(data);
+                        data = NULL;
+                }
+        }
+}
+
+// Encoder edge cases: codes with very long quotients (spikes in silence),
+// deltas that wrap around (full-scale square waves) and bad arguments
+static void CheckEncodeEdges(void)
+{
+        static const TestFile T = { "encoder", NULL, 0, NULL, 0 };
+        unsigned long samples = 3001; // a short last frame
+        short *ref = malloc(samples * 2 * sizeof(short));
+        short *pcm = malloc(samples * 2 * sizeof(short));
+        WacEncOptions eopts;
+        WacOptions opts;
+        unsigned char *data = NULL;
+        size_t len = 0;
+        unsigned long i;
+
+        if (ref == NULL || pcm == NULL)
+        {
+                Check(&T, "out of memory", 0);
+                free(ref);
+                free(pcm);
+                return;
+        }
+        for (i = 0; i < samples; i++)
+        {
+                ref[2 * i] = i % 97 == 0 ? 32767 : i % 89 == 0 ? -32768 : (short) (i % 3);
+                ref[2 * i + 1] = i & 1 ? 32767 : -32768;
+        }
+        memset(&eopts, 0, sizeof(eopts));
+        memset(&opts, 0, sizeof(opts));
+        Check(&T, "spikes and square waves", wac_encode(ref, samples, 2, 8000, &eopts, &data, &len,
+                                                        NULL) == WAC_OK &&
+              SameDecode(data, len, &opts, ref, pcm, samples * 2));
+        free(data);
+        data = NULL;
+
+        Check(&T, "three channels", wac_encode(ref, samples, 3, 8000, &eopts, &data, &len,
+                                               NULL) == WAC_ERR_ARG && data == NULL);
+        eopts.lossy = 16;
+        Check(&T, "lossy level 16", wac_encode(ref, samples, 2, 8000, &eopts, &data, &len,
+                                               NULL) == WAC_ERR_ARG && data == NULL);
+        free(ref);
+        free(pcm);
+}
+
+static void TestOne(const TestFile *TP)
+{
+        static const struct { int simd; const char *name; } kernels[] =
+        {
+                { WAC_SIMD_AUTO, "fast engine, best kernel" },
+                { WAC_SIMD_NONE, "fast engine, scalar kernel" },
+                { WAC_SIMD_SSE2, "fast engine, SSE2 kernel" },
+                { WAC_SIMD_AVX2, "fast engine, AVX2 kernel" },
+                { WAC_SIMD_NEON, "fast engine, NEON kernel" },
+        };
+        WacOptions opts;
+        WacDecoder *D;
+        WacInfo info;
+        short *ref, *pcm;
+        unsigned long samples;
+        size_t n;
+        uint64_t h;
+        int i;
+
+        if (Open(TP, &D, NULL, NULL) != WAC_OK)
+        {
+                return;
+        }
+        wac_info(D, &info);
+        wac_close(D);
+        samples = info.samplecount;
+        n = (size_t) samples * info.channelcount;
+        ref = malloc((n + 1) * sizeof(short));
+        pcm = malloc((n + 1) * sizeof(short));
+        if (ref == NULL || pcm == NULL)
+        {
+                Check(TP, "out of memory", 0);
+                free(ref);
+                free(pcm);
+                return;
+        }
+
+        // Reference decode
+        memset(&opts, 0, sizeof(opts));
+        opts.engine = WAC_ENGINE_REFERENCE;
+        h = DecodeHash(TP, &opts, NULL, ref, n);
+        Check(TP, "reference decode", h != 0);
+        if (h == 0)
+        {
+                free(ref);
+                free(pcm);
+                return;
+        }
+
+        // Fast engine with every kernel (kernels the CPU lacks fall back to the
+        // best one it has)
+        opts.engine = WAC_ENGINE_FAST;
+        for (i = 0; i < (int) (sizeof(kernels) / sizeof(kernels[0])); i++)
+        {
+                opts.simd = kernels[i].simd;
+                Check(TP, kernels[i].name, DecodeHash(TP, &opts, NULL, pcm, n) == h);
+        }
+        opts.simd = WAC_SIMD_AUTO;
+
+        // Multi-threaded decoding, both engines, from memory and from a file
+        opts.threads = TEST_THREADS;
+        Check(TP, "fast engine, threads", DecodeHash(TP, &opts, NULL, pcm, n) == h);
+        if (TP->path != NULL)
+        {
+                Check(TP, "fast engine, threads, file", DecodeHash(TP, &opts, TP->path, pcm, n) == h);
+                opts.threads = 1;
+                Check(TP, "fast engine, file", DecodeHash(TP, &opts, TP->path, pcm, n) == h);
+                opts.threads = TEST_THREADS;
+        }
+        opts.engine = WAC_ENGINE_REFERENCE;
+        Check(TP, "reference engine, threads", DecodeHash(TP, &opts, NULL, pcm, n) == h);
+        opts.engine = WAC_ENGINE_FAST;
+
+        // WAV writers
+        opts.threads = 1;
+        CheckWav(TP, &opts, ref, n, "WAV in memory");
+        opts.threads = TEST_THREADS;
+        CheckWav(TP, &opts, ref, n, "WAV in memory, threads");
+        opts.threads = 1;
+        if (TP->path != NULL && !(info.flags & 0x10))
+        {
+                opts.pipeline = 1;
+                CheckWavFile(TP, &opts, ref, n, "WAV file, pipelined");
+                opts.pipeline = 0;
+        }
+        if (!(info.flags & 0x10))
+        {
+                CheckTruncated(TP, ref, n);
+        }
+        if (TP->path != NULL && !(info.flags & 0x10))
+        {
+                CheckConcat(TP, ref, n);
+                CheckBatch(TP, ref, n);
+        }
+        if (!(info.flags & 0x10))
+        {
+                CheckSpectrogram(TP, ref, samples, info.channelcount);
+        }
+        else
+        {
+                CheckTriggers(TP, ref, info.channelcount);
+        }
+
+        // Random access and streaming
+        CheckRanges(TP, &opts, ref, samples, info.channelcount, "fast engine, ranges");
+        opts.engine = WAC_ENGINE_REFERENCE;
+        CheckRanges(TP, &opts, ref, samples, info.channelcount, "reference engine, ranges");
+        opts.engine = WAC_ENGINE_FAST;
+        opts.cache = 1; // one slot
+        CheckRanges(TP, &opts, ref, samples, info.channelcount, "ranges, one-entry cache");
+        opts.cache = 1 << 20;
+        CheckRanges(TP, &opts, ref, samples, info.channelcount, "ranges, cache");
+        opts.cache = 0;
+        CheckStream(TP, ref, samples, info.channelcount);
+        CheckMetrics(TP, &info, pcm);
+        CheckVerify(TP, samples);
+        CheckRecover(TP, ref, pcm, n, h);
+        if (info.flags & 0x20)
+        {
+                CheckBadSeekSize(TP);
+        }
+        CheckEncode(TP, &info, ref, pcm, n);
+
+        free(ref);
+        free(pcm);
+}
+
+// Write data to a temporary file for the file checks; returns its name or NULL
+static char *TempFile(const unsigned char *data, size_t len)
+{
+        const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+        char *name = malloc(strlen(dir) + 20);
+        FILE *fp;
+        int fd;
+
+        if (name == NULL)
+        {
+                return NULL;
+        }
+        sprintf(name, "%s/wactestXXXXXX", dir);
+        fd = mkstemp(name);
+        if (fd < 0 || (fp = fdopen(fd, "wb")) == NULL)
+        {
+                free(name);
+                return NULL;
+        }
+        if ((len > 0 && fwrite(data, 1, len, fp) != len) || fclose(fp) != 0)
+        {
+                unlink(name);
+                free(name);
+                return NULL;
+        }
+        return name;
+}
+
+// Read a whole file into memory
+static unsigned char *ReadFile(const char *path, size_t *len)
+{
+        FILE *fp = fopen(path, "rb");
+        unsigned char *data = NULL;
+        long size;
+
+        if (fp == NULL)
+        {
+                return NULL;
+        }
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+            (data = malloc(size)) != NULL && fread(data, 1, size, fp) != (size_t) size)
+        {
+                free(data);
+                data = NULL;
+        }
+        *len = data != NULL ? (size_t) size : 0;
+        fclose(fp);
+        return data;
+}
+
+int main(int argc, char **argv)
+{
+        // Odd lengths, so the last frame is partial
+        static const WacGenSpec extra[] =
+        {
+                { "mono2-odd",   1, 2, 1, 1, 0, WACGEN_LOUD, 256000, 100003, 21 },
+                { "stereo3-odd", 2, 3, 0, 1, 1, WACGEN_LOUD, 48000,  77777,  22 },
+        };
+        double scale = 0.25;
+        int nextra = (int) (sizeof(extra) / sizeof(extra[0]));
+        int i;
+
+        if (argc >= 3 && !strcmp(argv[1], "-n"))
+        {
+                scale = atof(argv[2]);
+                argv += 2;
+                argc -= 2;
+        }
+
+        // The synthetic corpus
+        for (i = 0; i < wacgen_corpus_size + nextra; i++)
+        {
+                const WacGenSpec *spec = i < wacgen_corpus_size ? &wacgen_corpus[i] :
+                        &extra[i - wacgen_corpus_size];
+                TestFile T;
+                char *path;
+
+                memset(&T, 0, sizeof(T));
+                T.name = spec->name;
+                T.generated = 1;
+                if (wacgen_make(spec, i < wacgen_corpus_size ? scale : 0, &T.data, &T.len) != WAC_OK)
+                {
+                        fprintf(stderr, "%s: out of memory\n", spec->name);
+                        return 1;
+                }
+                T.path = path = TempFile(T.data, T.len);
+                TestOne(&T);
+                if (path != NULL)
+                {
+                        unlink(path);
+                        free(path);
+                }
+                free(T.data);
+        }
+
+        CheckEncodeEdges();
+
+        // Files named on the command line
+        for (i = 1; i < argc; i++)
+        {
+                TestFile T;
+
+                memset(&T, 0, sizeof(T));
+                T.name = T.path = argv[i];
+                T.data = ReadFile(argv[i], &T.len);
+                if (T.data == NULL)
+                {
+                        printf("FAIL %s: cannot read\n", argv[i]);
+                        failures++;
+                        continue;
+                }
+                TestOne(&T);
+                free(T.data);
+        }
+
+        printf("%d checks, %d failed\n", checks, failures);
+        return failures != 0;
+}
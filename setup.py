@@ -7,4 +7,7 @@ setup(
     version="0.1",
     packages=find_packages(),
     ext_modules=cythonize(
-        [Extension("wac2wav", ["wac2wav.pyx", "c/wac2wav.c"])]))
+        [Extension("wac2wav", ["wac2wav.pyx", "c/wac2wav.c", "c/wacenc.c"],
+                   extra_compile_args=["-pthread"],
+                   extra_link_args=["-pthread"],
+                   libraries=["m"])]))
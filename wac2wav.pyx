@@ -1,11 +1,848 @@
 # file: wac2wav.pyx
 
+from cpython cimport array
+from cpython.bytes cimport PyBytes_FromStringAndSize, PyBytes_AS_STRING
+from libc.stdlib cimport calloc, free
+import array
+import os
+import sys
+
 cdef extern from "c/wac2wav.h":
-    int wac2wav_c(char *srcfile, char *destfile)
+    ctypedef struct WacOptions:
+        int engine
+        int threads
+        int mmap
+        int triggers
+        int format
+        int channels
+        int rate
+        int simd
+        int update
+        int pipeline
+        int truncated
+        int recover
+        size_t cache
+        int metrics
+
+    ctypedef struct WacSegment:
+        unsigned long start
+        unsigned long length
+
+    ctypedef struct WacGap:
+        unsigned long sample
+        unsigned long length
+        long long offset
+
+    ctypedef struct WacInfo:
+        int version
+        int channelcount
+        int framesize
+        int blocksize
+        int flags
+        int samplerate
+        unsigned long samplecount
+        int seeksize
+        int seekentries
+
+    ctypedef struct WacGps:
+        unsigned long sample
+        double latitude
+        double longitude
+
+    ctypedef struct WacTagRange:
+        int tag
+        unsigned long start
+        unsigned long length
+
+    ctypedef struct WacProbe:
+        WacInfo info
+        double seconds
+        int ngps
+        const WacGps *gps
+        int ntags
+        const WacTagRange *tags
+
+    ctypedef struct WacStreamInfo:
+        unsigned long sample
+        unsigned long block
+        int tag
+        int gpsvalid
+        WacGps gps
+
+    ctypedef struct WacVerify:
+        unsigned long frames
+        unsigned long samples
+        long badblock
+        unsigned int crc
+
+    ctypedef struct WacCacheStats:
+        unsigned long hits
+        unsigned long misses
+        int slots
+        int used
+
+    ctypedef struct WacSpecOptions:
+        int fftsize
+        int hop
+        int window
+        int format
+
+    ctypedef struct WacSpecInfo:
+        unsigned long columns
+        int channels
+        int bins
+        size_t size
+
+    enum: WAC_METRICS_QUOTIENTS
+
+    ctypedef struct WacMetrics:
+        unsigned long frames
+        unsigned long zeroframes
+        unsigned long blocks
+        unsigned long long bytesin
+        unsigned long long bytesout
+        double seconds
+        double readseconds
+        double decodeseconds
+        double writeseconds
+        unsigned long codesizes[2][16]
+        unsigned long quotients[WAC_METRICS_QUOTIENTS]
+
+    ctypedef struct WacProgress:
+        unsigned long samples
+        unsigned long total
+        unsigned long long bytesin
+        double seconds
+
+    ctypedef int (*WacProgressFn)(void *ctx, const WacProgress *progress) noexcept
+
+    ctypedef struct WacDecoder:
+        pass
+
+    ctypedef struct WacJob:
+        const char *srcfile
+        const char *destfile
+        int status
+        double seconds
+        int skipped
+        char errmsg[256]
+
+    int wac2wav_c(char *srcfile, char *destfile) nogil
+    int wac2wav_opts_c(char *srcfile, char *destfile, const WacOptions *opts) nogil
+    int wac_batch(WacJob *jobs, int njobs, int workers, const WacOptions *opts) nogil
+    int wac_concat(WacJob *jobs, int njobs, const char *destfile, int workers, const WacOptions *opts) nogil
+    int wac_open(WacDecoder **decoder, const char *srcfile, const WacOptions *opts)
+    int wac_open_mem(WacDecoder **decoder, const void *data, size_t len, const WacOptions *opts)
+    void wac_close(WacDecoder *decoder)
+    void wac_info(const WacDecoder *decoder, WacInfo *info)
+    int wac_write_wav(WacDecoder *decoder, const char *destfile) nogil
+    int wac_probe(WacDecoder *decoder, WacProbe *probe) nogil
+    int wac_verify(WacDecoder *decoder, WacVerify *result) nogil
+    int wac_read(WacDecoder *decoder, short *out, unsigned long count, unsigned long *got) nogil
+    void wac_stream_info(const WacDecoder *decoder, WacStreamInfo *info)
+    int wac_decode_range(WacDecoder *decoder, unsigned long start, unsigned long count,
+                         short *out, unsigned long *decoded) nogil
+    void wac_cache_stats(const WacDecoder *decoder, WacCacheStats *stats)
+    void wac_metrics(const WacDecoder *decoder, WacMetrics *metrics)
+    int wac_set_progress(WacDecoder *decoder, WacProgressFn fn, void *ctx, double interval)
+    int wac_segments(const WacDecoder *decoder, const WacSegment **segments)
+    int wac_gaps(const WacDecoder *decoder, const WacGap **gaps)
+    int wac_decode_all(WacDecoder *decoder, short *out) nogil
+    int wac_spectrogram_info(const WacDecoder *decoder, const WacSpecOptions *opts, WacSpecInfo *info)
+    int wac_spectrogram(WacDecoder *decoder, const WacSpecOptions *opts, void *out) nogil
+    int wac_write_spectrogram(WacDecoder *decoder, const WacSpecOptions *opts, const char *destfile) nogil
+    unsigned long long wac_wav_size(const WacDecoder *decoder)
+    int wac_write_wav_mem(WacDecoder *decoder, void *buf, size_t size) nogil
+    const char *wac_errmsg(const WacDecoder *decoder)
+    const char *wac_strerror(int error)
+
+cdef extern from "c/wacenc.h":
+    ctypedef struct WacEncOptions:
+        int lossy
+        int threads
+        int blocksize
+        int seeksize
+        int triggered
+        int ngps
+        const WacGps *gps
+        int ntags
+        const WacTagRange *tags
+
+    ctypedef struct WacEncResult:
+        int channels
+        int samplerate
+        unsigned long samples
+        unsigned long long bytes
+        double seconds
+        char errmsg[256]
+
+    int wac_encode(const short *pcm, unsigned long samples, int channels, int samplerate,
+                   const WacEncOptions *opts, unsigned char **data, size_t *len,
+                   WacEncResult *result) nogil
+    int wac_encode_wav(const char *srcfile, const char *destfile, const WacEncOptions *opts,
+                       WacEncResult *result) nogil
+
+cdef int _open(WacDecoder **D, src, WacOptions *opts, list keep) except -1:
+    # Open src, which is either a file name or a bytes-like object holding
+    # a WAC file.  keep holds whatever must stay alive while D is open.
+    cdef const unsigned char[::1] view
+    cdef bytes path
+    if isinstance(src, str):
+        path = bytes(src, "utf-8")
+        keep.append(path)
+        return wac_open(D, path, opts)
+    view = src
+    keep.append(view)
+    if view.shape[0] == 0:
+        return wac_open_mem(D, NULL, 0, opts)
+    return wac_open_mem(D, &view[0], view.shape[0], opts)
+
+_CHANNELS = {"all": 0, "left": 1, "right": 2, "mix": 3}
+
+cdef _options(WacOptions *opts, threads, mmap=False, float32=False, channels="all", rate=0):
+    opts.engine = 0
+    opts.threads = threads if threads > 0 else (os.cpu_count() or 1)
+    opts.mmap = 1 if mmap else 0
+    opts.triggers = 0
+    opts.format = 1 if float32 else 0
+    if channels not in _CHANNELS:
+        raise ValueError("channels must be one of %s" % ", ".join(sorted(_CHANNELS)))
+    opts.channels = _CHANNELS[channels]
+    opts.rate = rate
+    opts.simd = 0
+    opts.update = 0
+    opts.pipeline = 0
+    opts.truncated = 0
+    opts.recover = 0
+    opts.cache = 0
+    opts.metrics = 0
+
+cdef int _progress(void *ctx, const WacProgress *p) noexcept with gil:
+    # Progress callback, called from the decoder threads.  ctx is a list of
+    # the Python callable and the exception it raised, if any, which stops
+    # the decode.
+    cdef list state = <list> ctx
+    try:
+        state[0](p.samples, p.total, p.bytesin, p.seconds)
+    except BaseException as e:
+        state[1] = e
+        return 1
+    return 0
+
+cdef dict _metrics(WacDecoder *D, int channels):
+    cdef WacMetrics m
+    wac_metrics(D, &m)
+    return {"frames": m.frames, "zeroframes": m.zeroframes, "blocks": m.blocks,
+            "bytesin": m.bytesin, "bytesout": m.bytesout, "seconds": m.seconds,
+            "readseconds": m.readseconds, "decodeseconds": m.decodeseconds,
+            "writeseconds": m.writeseconds,
+            "codesizes": [[m.codesizes[c][g] for g in range(16)] for c in range(channels)],
+            "quotients": [m.quotients[q] for q in range(WAC_METRICS_QUOTIENTS)]}
+
+def wac2wav(src, dest, threads=1, mmap=False, triggers="split", float32=False,
+            channels="all", rate=0, pipeline=False, truncated=False, recover=False,
+            gaps=None, progress=None, metrics=None):
+    """Convert the WAC file src to the WAV file dest.
+
+    threads is the number of decoder threads (0 = one per processor).  With
+    mmap=True the source is memory-mapped and the WAV file is preallocated
+    and decoded straight into a mapping of it.
+
+    Triggered files skip the untriggered time between recordings.  With
+    triggers="split" each segment goes to its own file dest_NNNN.wav; with
+    triggers="index" they are all written to dest, along with an index in
+    dest_segments.csv.  Returns the (start, length) sample positions of the
+    segments in the recording (empty for untriggered files).
+
+    float32=True writes 32-bit float samples (full scale +/-1.0) and
+    channels selects "all", "left", "right" or a "mix" of both channels.
+    rate downsamples the output (e.g. rate=48000 for a 256 kHz recording)
+    in the same pass; resampled files are decoded on one thread.
+
+    pipeline=True reads, decodes and writes a single-threaded conversion in
+    three threads, to hide the latency of slow or network storage.
+
+    truncated=True converts a recording that was cut short: it is decoded up
+    to the end of the data, rather than failing there, and the WAV header
+    gives the length actually written.  src or dest may be "-" for standard
+    input or output.
+
+    recover=True carries on past damaged blocks from the next good block,
+    with silence in place of what was lost.  If gaps is a list, a (sample,
+    length, offset) tuple is appended to it for each damaged spot: the first
+    sample lost, the number of samples lost and the byte offset in src.
+
+    progress is called as progress(samples, total, bytesin, seconds) about
+    every half second while converting (from the decoder threads, holding
+    the GIL) and once at the end.  An exception raised by it stops the
+    conversion and is raised again here.  If metrics is a dict it is filled
+    in with the decoder counters: "frames", "zeroframes", "blocks",
+    "bytesin", "bytesout", the wall time "seconds" and the time spent in
+    each stage ("readseconds", "decodeseconds", "writeseconds", added up
+    over threads), and the histograms "codesizes" (frames by code size, per
+    channel) and "quotients" (codes by quotient, the last bin being 31 or
+    more).
+    """
+    cdef bytes bdest = bytes(dest, "utf-8")
+    cdef char *cdest = bdest
+    cdef WacOptions opts
+    cdef WacDecoder *D = NULL
+    cdef const WacSegment *segs
+    cdef const WacGap *gp
+    cdef WacInfo info
+    cdef int status, i, n
+    cdef list state = [progress, None]
+    keep = []
+    _options(&opts, threads, mmap, float32, channels, rate)
+    if triggers not in ("split", "index"):
+        raise ValueError("triggers must be 'split' or 'index'")
+    opts.triggers = 1 if triggers == "index" else 0
+    opts.pipeline = 1 if pipeline else 0
+    opts.truncated = 1 if truncated else 0
+    opts.recover = 1 if recover else 0
+    opts.metrics = 1 if metrics is not None else 0
+    try:
+        status = _open(&D, src, &opts, keep)
+        if status == 0 and progress is not None:
+            status = wac_set_progress(D, _progress, <void *> state, 0.5)
+        if status == 0:
+            with nogil:
+                status = wac_write_wav(D, cdest)
+        if state[1] is not None:
+            raise state[1]
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+        if metrics is not None:
+            wac_info(D, &info)
+            metrics.update(_metrics(D, info.channelcount))
+        if gaps is not None:
+            n = wac_gaps(D, &gp)
+            gaps.extend([(gp[i].sample, gp[i].length, gp[i].offset) for i in range(n)])
+        n = wac_segments(D, &segs)
+        return [(segs[i].start, segs[i].length) for i in range(n)]
+    finally:
+        wac_close(D)
+
+def wacs2wav(list, workers=0, update=False, concat=None):
+    """Convert a list of (src, dest) pairs using a pool of worker threads.
+
+    workers is the number of threads (0 = one per processor).  The largest
+    files are started first and idle workers help with the files still being
+    converted.  With update=True, pairs whose dest is newer than src and
+    complete are skipped.  The GIL is released while converting.  Returns one
+    dict per pair with the keys "src", "dest", "status" (0 on success),
+    "error" (empty on success), "skipped" and "seconds" (wall time of the
+    conversion).
+
+    With concat set to a WAV file name, list is a list of src names instead,
+    which are joined in order into that one file.  They must have the same
+    sample rate, channels and flags.  "skipped" is then set for files not
+    converted because another one failed, and concat is removed on error.
+    """
+    if concat is not None:
+        pairs = [(bytes(src, "utf-8"), None) for src in list]
+        names = [(src, concat) for src in list]
+    else:
+        pairs = [(bytes(src, "utf-8"), bytes(dest, "utf-8")) for (src, dest) in list]
+        names = list
+    cdef int njobs = len(pairs)
+    cdef int nworkers = workers
+    cdef WacJob *jobs = <WacJob *> calloc(njobs if njobs > 0 else 1, sizeof(WacJob))
+    cdef WacOptions opts
+    cdef int i
+    cdef bytes bsrc, bdest
+    cdef bytes bconcat = None
+    cdef const char *cconcat = NULL
+    if jobs == NULL:
+        raise MemoryError()
+    if concat is not None:
+        bconcat = bytes(concat, "utf-8")
+        cconcat = bconcat
+    try:
+        # pairs keeps the encoded names alive while the workers run
+        for i in range(njobs):
+            bsrc, bdest = pairs[i]
+            jobs[i].srcfile = bsrc
+            if bdest is not None:
+                jobs[i].destfile = bdest
+        _options(&opts, 1)
+        opts.update = 1 if update else 0
+        with nogil:
+            if cconcat != NULL:
+                wac_concat(jobs, njobs, cconcat, nworkers, &opts)
+            else:
+                wac_batch(jobs, njobs, nworkers, &opts)
+        results = []
+        for i in range(njobs):
+            results.append({"src": names[i][0],
+                            "dest": names[i][1],
+                            "status": jobs[i].status,
+                            "error": jobs[i].errmsg.decode("utf-8", "replace"),
+                            "skipped": bool(jobs[i].skipped),
+                            "seconds": jobs[i].seconds})
+        return results
+    finally:
+        free(jobs)
+
+cdef unsigned long _clip(unsigned long start, unsigned long count, unsigned long samples):
+    # Samples per channel of the range start, count within a file of samples
+    if start >= samples:
+        return 0
+    return count if count < samples - start else samples - start
+
+def wac2wav_range(src, start, count):
+    """Decode count samples per channel of src starting at sample start.
+
+    Returns an array.array('h') of interleaved 16-bit samples, shorter than
+    count * channels if the range runs past the end of the file.
+    """
+    cdef array.array out = array.array('h')
+    cdef bytes bsrc = bytes(src, "utf-8")
+    cdef char *csrc = bsrc
+    cdef unsigned long cstart = start
+    cdef unsigned long ccount = count
+    cdef unsigned long decoded = 0
+    cdef WacDecoder *D = NULL
+    cdef WacInfo info
+    cdef short *buf
+    cdef int status
+    status = wac_open(&D, csrc, NULL)
+    if status != 0:
+        wac_close(D)
+        raise IOError("%s: %s" % (src, wac_strerror(status).decode("utf-8")))
+    try:
+        # The buffer only needs to hold the part of the range in the file
+        wac_info(D, &info)
+        ccount = _clip(cstart, ccount, info.samplecount)
+        array.resize(out, ccount * info.channelcount)
+        buf = out.data.as_shorts
+        with nogil:
+            status = wac_decode_range(D, cstart, ccount, buf, &decoded)
+        if status != 0:
+            raise IOError("%s: %s" % (src, wac_strerror(status).decode("utf-8")))
+        array.resize(out, decoded * info.channelcount)
+        return out
+    finally:
+        wac_close(D)
+
+cdef class WacReader:
+    """An open WAC file for random access, e.g. by a viewer.
+
+    src is a file name or a bytes-like object holding a WAC file.  With
+    cache set to a number of bytes, decoded seek table entries are kept in
+    an LRU cache of that size, so reading the same stretch again is a copy
+    rather than a decode.
+    """
+    cdef WacDecoder *D
+    cdef list keep
+    cdef readonly int channels
+    cdef readonly int samplerate
+    cdef readonly unsigned long samples
+
+    def __cinit__(self, src, cache=64 << 20):
+        cdef WacOptions opts
+        cdef WacInfo info
+        cdef int status
+        self.keep = []
+        _options(&opts, 1)
+        opts.cache = cache
+        status = _open(&self.D, src, &opts, self.keep)
+        if status != 0:
+            msg = wac_errmsg(self.D).decode("utf-8", "replace")
+            wac_close(self.D)
+            self.D = NULL
+            raise IOError(msg)
+        wac_info(self.D, &info)
+        self.channels = info.channelcount
+        self.samplerate = info.samplerate
+        self.samples = info.samplecount
+
+    def __dealloc__(self):
+        wac_close(self.D)
+
+    def read(self, start, count):
+        """Decode count samples per channel starting at sample start.
+
+        Returns an array.array('h') of interleaved 16-bit samples, shorter
+        than count * channels if the range runs past the end of the file.
+        """
+        cdef array.array out = array.array('h')
+        cdef unsigned long cstart = start
+        cdef unsigned long ccount = count
+        cdef unsigned long decoded = 0
+        cdef short *buf
+        cdef int status
+        if self.D == NULL:
+            raise ValueError("WacReader is closed")
+        ccount = _clip(cstart, ccount, self.samples)
+        array.resize(out, ccount * self.channels)
+        buf = out.data.as_shorts
+        with nogil:
+            status = wac_decode_range(self.D, cstart, ccount, buf, &decoded)
+        if status != 0:
+            raise IOError(wac_errmsg(self.D).decode("utf-8", "replace"))
+        array.resize(out, decoded * self.channels)
+        return out
+
+    def cache_stats(self):
+        """Return the cache counters as a dict: "hits" and "misses" (seek
+        table entries copied from the cache and decoded into it), "slots"
+        (entries it can hold) and "used" (entries it holds now)."""
+        cdef WacCacheStats cs
+        if self.D == NULL:
+            raise ValueError("WacReader is closed")
+        wac_cache_stats(self.D, &cs)
+        return {"hits": cs.hits, "misses": cs.misses, "slots": cs.slots, "used": cs.used}
+
+    def close(self):
+        wac_close(self.D)
+        self.D = NULL
+
+def wac2wav_read(src, threads=0):
+    """Decode all of src straight into memory.
+
+    src is a file name or a bytes-like object (bytes, bytearray, memoryview)
+    holding a WAC file.  The samples are decoded in place (with the GIL
+    released) into a buffer sized from the WAC header and returned as a
+    memoryview of int16 with shape (samples, channels), so numpy.asarray()
+    on the result gives an array without copying.  threads is the number of
+    decoder threads (0 = one per processor).
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacOptions opts
+    cdef WacInfo info
+    cdef array.array out = array.array('h')
+    cdef short *buf
+    cdef int status
+    cdef list keep = []
+    _options(&opts, threads)
+    info.samplecount = 0
+    try:
+        status = _open(&D, src, &opts, keep)
+        if status == 0:
+            wac_info(D, &info)
+            array.resize(out, info.samplecount * info.channelcount)
+            buf = out.data.as_shorts
+            with nogil:
+                status = wac_decode_all(D, buf)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+    finally:
+        wac_close(D)
+    if info.samplecount == 0:
+        return memoryview(out)
+    return memoryview(out).cast('B').cast('h', (info.samplecount, info.channelcount))
+
+_WINDOWS = {"hann": 0, "hamming": 1, "rect": 2}
+_SPEC_FORMATS = {"magnitude": 0, "db": 1, "db8": 2}
+
+def wac2wav_spectrogram(src, fftsize=256, hop=0, window="hann", format="magnitude",
+                        channels="all", dest=None):
+    """Decode src straight into a short-time Fourier transform.
+
+    src is a file name or a bytes-like WAC file.  Every hop samples (0 =
+    fftsize / 2) a window of fftsize samples (a power of two from 16 to
+    65536) is weighted by a "hann", "hamming" or "rect" window and
+    transformed.  format is "magnitude" (a full-scale sine gives 1.0), "db"
+    (dB relative to full scale) or "db8" (bytes, -120 dB to 0 dB in 255
+    steps), and channels selects "all", "left", "right" or a "mix".
+
+    Returns a memoryview of float32 (uint8 for "db8") with shape (columns,
+    channels, bins), where bins runs from 0 Hz to half the sample rate.
+    With dest set the spectrogram is written to that file instead (in the
+    WSPC format of wac_write_spectrogram()) and the shape is returned.
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacOptions opts
+    cdef WacSpecOptions so
+    cdef WacSpecInfo si
+    cdef array.array out
+    cdef void *buf
+    cdef bytes path
+    cdef const char *cpath
+    cdef int status
+    cdef list keep = []
+    if window not in _WINDOWS:
+        raise ValueError("window must be one of %s" % ", ".join(sorted(_WINDOWS)))
+    if format not in _SPEC_FORMATS:
+        raise ValueError("format must be one of %s" % ", ".join(sorted(_SPEC_FORMATS)))
+    _options(&opts, 1, channels=channels)
+    so.fftsize = fftsize
+    so.hop = hop
+    so.window = _WINDOWS[window]
+    so.format = _SPEC_FORMATS[format]
+    out = array.array('B' if format == "db8" else 'f')
+    si.columns = 0
+    try:
+        status = _open(&D, src, &opts, keep)
+        if status == 0:
+            status = wac_spectrogram_info(D, &so, &si)
+            if status != 0:
+                raise ValueError("Bad spectrogram options")
+        if status == 0 and dest is not None:
+            path = bytes(dest, "utf-8")
+            cpath = path
+            with nogil:
+                status = wac_write_spectrogram(D, &so, cpath)
+        elif status == 0:
+            array.resize(out, si.size // out.itemsize)
+            buf = out.data.as_voidptr
+            with nogil:
+                status = wac_spectrogram(D, &so, buf)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+    finally:
+        wac_close(D)
+    if dest is not None:
+        return (si.columns, si.channels, si.bins)
+    if si.columns == 0:
+        return memoryview(out)
+    return memoryview(out).cast('B').cast(out.typecode, (si.columns, si.channels, si.bins))
+
+def wac2wav_bytes(src, threads=0, float32=False, channels="all", rate=0):
+    """Convert src (a file name or a bytes-like WAC file) to WAV in memory.
+
+    Returns the complete WAV file as bytes.  The samples are decoded in
+    place into the returned object with the GIL released.  float32,
+    channels and rate select the output format as for wac2wav().
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacOptions opts
+    cdef bytes out = None
+    cdef char *buf
+    cdef unsigned long long wavsize
+    cdef size_t size
+    cdef int status
+    cdef list keep = []
+    _options(&opts, threads, False, float32, channels, rate)
+    try:
+        status = _open(&D, src, &opts, keep)
+        if status == 0:
+            wavsize = wac_wav_size(D)
+            if wavsize > sys.maxsize:
+                raise MemoryError("WAV file of %d bytes too large for memory" % wavsize)
+            size = <size_t> wavsize
+            out = PyBytes_FromStringAndSize(NULL, size)
+            buf = PyBytes_AS_STRING(out)
+            with nogil:
+                status = wac_write_wav_mem(D, buf, size)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+    finally:
+        wac_close(D)
+    return out
+
+def wac2wav_probe(src):
+    """Return the metadata of src without decoding the audio.
+
+    src is a file name or a bytes-like object holding a WAC file.  Returns a
+    dict with the header fields, "seconds", "gps" (a list of (sample,
+    latitude, longitude) fixes) and "tags" (a list of (tag, start, length)
+    sample ranges, tag 1-4 for EM3 buttons A-D).
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacProbe p
+    cdef int status, i
+    keep = []
+    try:
+        status = _open(&D, src, NULL, keep)
+        if status == 0:
+            with nogil:
+                status = wac_probe(D, &p)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+        return {"version": p.info.version,
+                "channels": p.info.channelcount,
+                "framesize": p.info.framesize,
+                "blocksize": p.info.blocksize,
+                "flags": p.info.flags,
+                "samplerate": p.info.samplerate,
+                "samples": p.info.samplecount,
+                "seeksize": p.info.seeksize,
+                "seekentries": p.info.seekentries,
+                "seconds": p.seconds,
+                "gps": [(p.gps[i].sample, p.gps[i].latitude, p.gps[i].longitude)
+                        for i in range(p.ngps)],
+                "tags": [(p.tags[i].tag, p.tags[i].start, p.tags[i].length)
+                         for i in range(p.ntags)]}
+    finally:
+        wac_close(D)
+
+def wac2wav_verify(src):
+    """Decode src without writing anything, to check that it is intact.
+
+    Returns a dict with "ok", "frames" and "samples" (per channel) decoded,
+    "crc" (the CRC-32 of the decoded 16-bit samples, as in the WAV data) and,
+    if "ok" is False, "badblock" (the first bad block) and "error".
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacVerify v
+    cdef int status
+    keep = []
+    try:
+        status = _open(&D, src, NULL, keep)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+        with nogil:
+            status = wac_verify(D, &v)
+        result = {"ok": status == 0, "frames": v.frames, "samples": v.samples,
+                  "crc": v.crc}
+        if status != 0:
+            result["badblock"] = v.badblock
+            result["error"] = wac_errmsg(D).decode("utf-8", "replace")
+        return result
+    finally:
+        wac_close(D)
+
+def wac2wav_stream(src, chunk=65536, sideband=False):
+    """Decode src a chunk at a time, in constant memory.
+
+    A generator yielding array.array('h') chunks of up to chunk samples per
+    channel (interleaved).  With sideband=True it yields (samples, info)
+    pairs, where info is a dict with the "sample" position after the chunk,
+    the "block" and "tag" of its last sample and the most recent "gps" fix as
+    (sample, latitude, longitude), or None before the first one.
+    """
+    cdef WacDecoder *D = NULL
+    cdef WacInfo info
+    cdef WacStreamInfo si
+    cdef array.array out
+    cdef unsigned long count = chunk
+    cdef unsigned long got
+    cdef short *buf
+    cdef int status
+    keep = []
+    if chunk <= 0:
+        raise ValueError("chunk must be positive")
+    try:
+        status = _open(&D, src, NULL, keep)
+        if status != 0:
+            raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+        wac_info(D, &info)
+        while True:
+            out = array.array('h')
+            array.resize(out, count * info.channelcount)
+            buf = out.data.as_shorts
+            with nogil:
+                status = wac_read(D, buf, count, &got)
+            if status != 0:
+                raise IOError(wac_errmsg(D).decode("utf-8", "replace"))
+            if got == 0:
+                return
+            array.resize(out, got * info.channelcount)
+            if not sideband:
+                yield out
+                continue
+            wac_stream_info(D, &si)
+            gps = None
+            if si.gpsvalid:
+                gps = (si.gps.sample, si.gps.latitude, si.gps.longitude)
+            yield out, {"sample": si.sample, "block": si.block, "tag": si.tag, "gps": gps}
+    finally:
+        wac_close(D)
+
+cdef int _encode_options(WacEncOptions *opts, lossy, threads, triggered, gps, tags) except -1:
+    # Fill in opts, with the GPS fixes and tags in calloc()ed arrays that the
+    # caller frees
+    cdef WacGps *fixes = NULL
+    cdef WacTagRange *ranges = NULL
+    cdef int i
+    opts.lossy = lossy
+    opts.threads = threads
+    opts.blocksize = 0
+    opts.seeksize = 0
+    opts.triggered = 1 if triggered else 0
+    opts.ngps = 0
+    opts.gps = NULL
+    opts.ntags = 0
+    opts.tags = NULL
+    if gps:
+        fixes = <WacGps *> calloc(len(gps), sizeof(WacGps))
+        if fixes == NULL:
+            raise MemoryError()
+        opts.gps = fixes
+        for i, (sample, latitude, longitude) in enumerate(gps):
+            fixes[i].sample = sample
+            fixes[i].latitude = latitude
+            fixes[i].longitude = longitude
+        opts.ngps = len(gps)
+    if tags:
+        ranges = <WacTagRange *> calloc(len(tags), sizeof(WacTagRange))
+        if ranges == NULL:
+            raise MemoryError()
+        opts.tags = ranges
+        for i, (tag, start, length) in enumerate(tags):
+            ranges[i].tag = tag
+            ranges[i].start = start
+            ranges[i].length = length
+        opts.ntags = len(tags)
+    return 0
+
+def wav2wac(src, dest, lossy=0, threads=1, triggered=False, gps=None, tags=None):
+    """Encode the 16-bit PCM WAV file src (RIFF or RF64) into the WAC file dest.
+
+    lossy drops that many least-significant bits (1-4 for WAC1-WAC4).  With
+    triggered=True silent frames are left out as in a triggered recording.
+    gps is a list of (sample, latitude, longitude) fixes and tags a list of
+    (tag, start, length) ranges, in sample order, as returned by
+    wac2wav_probe().  The GIL is released while encoding.  Returns a dict
+    with "channels", "samplerate", "samples" (per channel), "bytes" and
+    "seconds".
+    """
+    cdef WacEncOptions opts
+    cdef WacEncResult r
+    cdef bytes bsrc = bytes(src, "utf-8")
+    cdef bytes bdest = bytes(dest, "utf-8")
+    cdef const char *csrc = bsrc
+    cdef const char *cdest = bdest
+    cdef int status
+    opts.gps = NULL
+    opts.tags = NULL
+    try:
+        _encode_options(&opts, lossy, threads, triggered, gps, tags)
+        with nogil:
+            status = wac_encode_wav(csrc, cdest, &opts, &r)
+        if status != 0:
+            raise IOError(r.errmsg.decode("utf-8", "replace"))
+        return {"channels": r.channels, "samplerate": r.samplerate, "samples": r.samples,
+                "bytes": r.bytes, "seconds": r.seconds}
+    finally:
+        free(<void *> opts.gps)
+        free(<void *> opts.tags)
 
-def wac2wav(src, dest):
-    wac2wav_c(bytes(src, "utf-8"), bytes(dest, "utf-8"))
+def wav2wac_bytes(pcm, channels, samplerate, lossy=0, threads=1, triggered=False,
+                  gps=None, tags=None):
+    """Encode interleaved 16-bit samples into a WAC file in memory.
 
-def wacs2wav(list):
-    for (src, dest) in list:
-      wac2wav_c(bytes(src, "utf-8"), bytes(dest, "utf-8"))
+    pcm is any bytes-like object of native 16-bit samples, such as
+    array.array('h') or the output of wac2wav_read().  The other arguments
+    are as for wav2wac().  Returns the WAC file as bytes.
+    """
+    cdef WacEncOptions opts
+    cdef WacEncResult r
+    cdef const short[::1] view = memoryview(pcm).cast("B").cast("h")
+    cdef const short *buf = NULL
+    cdef unsigned long samples
+    cdef unsigned char *data = NULL
+    cdef size_t size = 0
+    cdef int nchannels = channels
+    cdef int rate = samplerate
+    cdef int status
+    if nchannels <= 0 or view.shape[0] % nchannels != 0:
+        raise ValueError("pcm must hold a whole number of samples per channel")
+    samples = view.shape[0] // nchannels
+    if view.shape[0] > 0:
+        buf = &view[0]
+    opts.gps = NULL
+    opts.tags = NULL
+    try:
+        _encode_options(&opts, lossy, threads, triggered, gps, tags)
+        with nogil:
+            status = wac_encode(buf, samples, nchannels, rate, &opts, &data, &size, &r)
+        if status != 0:
+            raise IOError(r.errmsg.decode("utf-8", "replace"))
+        return PyBytes_FromStringAndSize(<char *> data, size)
+    finally:
+        free(data)
+        free(<void *> opts.gps)
+        free(<void *> opts.tags)